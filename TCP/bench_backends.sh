@@ -0,0 +1,59 @@
+#!/bin/bash
+#
+# File name: bench_backends.sh
+# Description: Compares the plain blocking path with the io_uring backend over loopback. Each run
+# starts a one-shot server and sends one file with the matching client, and the script prints the
+# wall time, throughput and the CPU time (user + sys) spent by the server and the client.
+#
+# usage: ./bench_backends.sh [size_MB] [runs] [port]
+#
+
+SIZE_MB=${1:-512}
+RUNS=${2:-3}
+PORT=${3:-9500}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+gcc -O2 -pthread -o "$DIR/server" server.c || exit 1
+gcc -O2 -pthread -o "$DIR/client" client.c || exit 1
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$DIR/input.bin"
+
+TIMEFORMAT="%R %U %S"
+
+# run <name> <server options> <client options>
+run() {
+
+	local name=$1 srv_opts=$2 cli_opts=$3 i srv cli wall mbps
+
+	for i in $(seq 1 "$RUNS"); do
+
+		(cd "$DIR" && { time ./server $srv_opts "$PORT" > /dev/null; } 2> server.time) &
+		sleep 0.2
+
+		cli=$( { time "$DIR/client" $cli_opts "$DIR/input.bin" output.bin 127.0.0.1 "$PORT" > /dev/null; } 2>&1 )
+		wait
+		srv=$(cat "$DIR/server.time")
+
+		if ! cmp -s "$DIR/input.bin" "$DIR/output.bin"; then
+			echo "$name: run $i produced a different file" >&2
+			exit 1
+		fi
+
+		wall=$(echo "$cli" | awk '{ print $1 }')
+		mbps=$(awk -v s="$SIZE_MB" -v t="$wall" 'BEGIN { printf "%.1f", s / t }')
+
+		printf "%-6s run %d: %6ss %9s MB/s  server cpu %6ss  client cpu %6ss\n" "$name" "$i" "$wall" "$mbps" \
+			"$(echo "$srv" | awk '{ print $2 + $3 }')" "$(echo "$cli" | awk '{ print $2 + $3 }')"
+
+		rm -f "$DIR/output.bin"
+		PORT=$((PORT + 1))
+	done
+
+}
+
+echo "Sending $SIZE_MB MB over loopback, $RUNS runs per backend"
+
+run plain "-b plain -r buffer" "-b plain -f"
+run uring "-b uring" "-b uring"
@@ -1,20 +1,54 @@
 /* 
  * Author: Chi Zhang (czhang2@scu.edu)
  * File name: client.c
- * Description: The file builds the client side of TCP (Transmission Control Protocol). The client reads a text
- * file and sends the file content to the server in chunks of 10 bytes. 
+ * Description: The file builds the client side of TCP (Transmission Control Protocol). The client uploads
+ * one or more files to the server over one connection, each as a frame that names the new file. By default
+ * a body goes out in 10-byte send() calls straight from the file mapped into memory; -f and -b uring send
+ * it through the zero-copy and io_uring paths instead, -n stripes a file over parallel connections, and
+ * -R resumes an interrupted upload from the server's checkpoint.
+ *
+ * Every file goes out as one frame (see proto.h): a header with the name length, file size, flags
+ * and checksum, then the new file name and the body. Several input/output pairs may be given, and
+ * their frames are pipelined back to back over the same connection.
+ *
+ * With -n N each file is striped instead: it is cut into -s sized byte ranges that are dealt out
+ * round-robin to N parallel connections, each sending its ranges as range frames, and the progress
+ * of every stream is reported once a second.
+ *
+ * The plain path and the last resort of the fast path send straight from the file mapped into
+ * memory (../common/reader.h) instead of reading it into a buffer first, and a resumed prefix is
+ * hashed from the mapping as well.
+ *
+ * With -R an interrupted transfer is resumed: before each file the client asks the server for its
+ * checkpoint, hashes the same prefix of the local file, and when both agree sends only the rest.
+ *
+ * With -f the file goes out through the fast send path instead: sendfile() moves it straight from
+ * the page cache to the socket, falling back to splice() through a pipe and then to large-buffer
+ * write() calls when the kernel or the file type does not support the zero-copy calls.
+ * With -b uring the file is sent through io_uring: each chunk is a read into a registered buffer
+ * linked to the send of that buffer, and a whole batch of pairs costs a single system call.
+ *
+ * Every sending thread counts connections, frames, body bytes and files into counters of its own
+ * (../common/metrics.h), and before a connection closes its retransmits and RTT estimate are taken
+ * from the kernel (TCP_INFO). With -l they go to a JSON line log once a second and at the end.
  *
  * Referencer:
  * Socket Programming in C
  * https://docs.oracle.com/cd/E19455-01/806-1017/6jab5di2e/index.html
  * http://stackoverflow.com/questions/10527187/reading-and-writing-in-chunks-on-linux-using-c
  * http://stackoverflow.com/questions/13837868/getting-or-symbol-when-reading-from-text-file-with-fread
+ * http://man7.org/linux/man-pages/man2/sendfile.2.html
+ * https://man7.org/linux/man-pages/man2/mmap.2.html
+ * https://kernel.dk/io_uring.pdf
+ * https://jsonlines.org/
  * 
  *
  */
 
 
 
+#define _GNU_SOURCE /* splice */
+
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
@@ -22,9 +56,701 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "uring.h"
+#include "proto.h"
+#include "../common/metrics.h"
+#include "../common/reader.h"
+
+#define CHUNK 10 /* send 10 bytes at a time */
+
+#define FAST_CHUNK (1024 * 1024) /* bytes per call on the fast send path */
+
+#define URING_DEPTH 8 /* linked read -> send pairs per io_uring submission */
+#define URING_LEN_MASK 0xffffffffULL /* user_data: expected length of the operation */
+#define URING_SEND_TAG (1ULL << 32) /* user_data: the operation is a send */
+
+#define MAX_STREAMS 64
+#define DEFAULT_STRIPE (16 * 1024 * 1024) /* bytes per range frame when striping */
+
+
+// how file bodies are sent
+enum tx_mode {
+	TX_PLAIN, // CHUNK-byte send() calls
+	TX_FAST, // sendfile(), splice() or large write()
+	TX_URING // linked read -> send on io_uring
+};
+
+// one connection of a striped transfer
+typedef struct stream {
+	pthread_t thread;
+	int id;
+	int fd; // the input file, shared by all streams
+	const char *newfile_name;
+	off_t file_size;
+	unsigned long long assigned; // bytes of the file this stream sends
+	unsigned long long sent; // progress, updated while sending
+	int failed;
+	int done;
+} stream;
+
+
+enum tx_mode tx_mode = TX_PLAIN;
+char *ip_addr;
+int port_num;
+int num_streams = 1;
+int resume = 0;
+off_t stripe_size = DEFAULT_STRIPE;
+
+// progress counter of the calling thread's current transfer (NULL when not tracked)
+__thread unsigned long long *tx_progress;
+
+// io_uring of the calling thread and its registered buffers, set up by its first send_file_uring()
+// and kept for its later files until uring_tx_release()
+typedef struct uring_tx {
+	uring ring;
+	struct iovec iov[URING_DEPTH];
+	char *bufs; // NULL until set up
+} uring_tx;
+
+__thread uring_tx utx;
+
+// what the sending threads count (metrics.h)
+enum { M_CONNECTIONS, M_FRAMES, M_BYTES, M_FILES, M_RESUMED, M_RETRANSMITS, M_COUNT };
+enum { H_FILE, H_RTT, H_COUNT };
+
+const metric_def counter_defs[M_COUNT] = {
+	[M_CONNECTIONS] = { "connections_total", "Connections opened to the server" },
+	[M_FRAMES] = { "frames_sent_total", "Frame headers sent" },
+	[M_BYTES] = { "sent_bytes_total", "File bytes handed to the socket (goodput)" },
+	[M_FILES] = { "files_sent_total", "Files sent whole" },
+	[M_RESUMED] = { "resumed_bytes_total", "File bytes skipped because the server had committed them" },
+	[M_RETRANSMITS] = { "tcp_retransmits_total", "Segments the kernel retransmitted on the connections" },
+};
+
+const metric_def hist_defs[H_COUNT] = {
+	[H_FILE] = { "file_duration_seconds", "From the frame header of a file to its last byte sent" },
+	[H_RTT] = { "tcp_rtt_seconds", "The kernel's RTT estimate of each connection when it closes" },
+};
+
+
+
+// account n more bytes as sent
+
+void tx_advance(size_t n) {
+
+	metric_add(M_BYTES, n);
+
+	if (tx_progress != NULL) {
+		__atomic_fetch_add(tx_progress, n, __ATOMIC_RELAXED);
+	}
+
+}
+
+
+
+// zero-copy send of len bytes starting at *offset with sendfile()
+// returns 0 on success, -1 with errno set on failure
+
+int send_sendfile(int sock, int fd, off_t *offset, off_t len) {
+
+	ssize_t n;
+	off_t end = *offset + len;
+
+	while (*offset < end) {
+		n = sendfile(sock, fd, offset, (end - *offset) < FAST_CHUNK ? (size_t)(end - *offset) : FAST_CHUNK);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (n == 0) {
+			errno = EIO; // the file shrank under us
+			return -1;
+		}
+		tx_advance(n);
+	}
+
+	return 0;
+
+}
+
+
+
+// zero-copy send through a pipe with splice(), for kernels or files sendfile() rejects
+
+int send_splice(int sock, int fd, off_t *offset, off_t len) {
+
+	int pipe_fd[2];
+	ssize_t in, out;
+	off_t end = *offset + len;
+
+	if (pipe(pipe_fd) < 0) {
+		return -1;
+	}
+
+	while (*offset < end) {
+
+		in = splice(fd, offset, pipe_fd[1], NULL, (end - *offset) < FAST_CHUNK ? (size_t)(end - *offset) : FAST_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (in < 0 && errno == EINTR) {
+			continue;
+		}
+		if (in <= 0) {
+			if (in == 0) {
+				errno = EIO;
+			}
+			break;
+		}
+
+		// drain the pipe completely before the next fill
+		while (in > 0) {
+			out = splice(pipe_fd[0], NULL, sock, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (out < 0 && errno == EINTR) {
+				continue;
+			}
+			if (out <= 0) {
+				close(pipe_fd[0]);
+				close(pipe_fd[1]);
+				return -1;
+			}
+			in -= out;
+			tx_advance(out);
+		}
+	}
+
+	close(pipe_fd[0]);
+	close(pipe_fd[1]);
+
+	return *offset < end ? -1 : 0;
+
+}
+
+
+
+// send len bytes of the file from *offset straight out of its mapping, in send() calls of up to piece bytes
+
+int send_mapped(int sock, int fd, off_t *offset, off_t len, size_t piece) {
+
+	reader input;
+	const char *p;
+	size_t got;
+	ssize_t out, done;
+	off_t end = *offset + len;
+	int rc = 0;
+
+	reader_open(&input, fd, piece);
+
+	while (*offset < end && rc == 0) {
+
+		p = reader_at(&input, *offset, (end - *offset) < (off_t)piece ? (size_t)(end - *offset) : piece, &got);
+		if (p == NULL || got == 0) {
+			if (p != NULL) {
+				errno = EIO; // the file shrank since its header went out
+			}
+			rc = -1;
+			break;
+		}
+
+		for (done = 0; done < (ssize_t)got; done += out) {
+			out = send(sock, p + done, got - done, 0);
+			if (out < 0 && errno == EINTR) {
+				out = 0;
+				continue;
+			}
+			if (out < 0) {
+				rc = -1;
+				break;
+			}
+		}
+
+		*offset += done;
+		tx_advance(done);
+		reader_release(&input, *offset);
+	}
+
+	reader_close(&input);
+
+	return rc;
+
+}
+
+
+
+// large send() calls from the mapping, the last resort of the fast path
+
+int send_buffered(int sock, int fd, off_t *offset, off_t len) {
+
+	return send_mapped(sock, fd, offset, len, FAST_CHUNK);
+
+}
+
+
+
+// send the whole file, trying sendfile(), then splice(), then write()
+// a later method only takes over from where the previous one stopped
+
+int send_file_fast(int sock, int fd, off_t offset, off_t size) {
+
+	off_t end = offset + size;
+
+	if (send_sendfile(sock, fd, &offset, end - offset) == 0) {
+		return 0;
+	}
+	if (errno != EINVAL && errno != ENOSYS) {
+		return -1;
+	}
+
+	printf("sendfile() unavailable, falling back to splice()\n");
+
+	if (send_splice(sock, fd, &offset, end - offset) == 0) {
+		return 0;
+	}
+	if (errno != EINVAL && errno != ENOSYS) {
+		return -1;
+	}
+
+	printf("splice() unavailable, falling back to write()\n");
+
+	return send_buffered(sock, fd, &offset, end - offset);
+
+}
+
+
+// let go of the calling thread's io_uring, its mappings and its pinned buffers, before the thread ends
+
+void uring_tx_release(void) {
+
+	if (utx.bufs == NULL) {
+		return;
+	}
+
+	uring_exit(&utx.ring);
+	free(utx.bufs);
+	utx.bufs = NULL;
+
+}
+
+
+
+// send the whole file through io_uring
+// the pairs of a batch form one chain so the sends reach the socket in file order
+// the ring and its registered buffers are set up once per thread and reused for every file
+
+int send_file_uring(int sock, int fd, off_t offset, off_t size) {
+
+	uring *ring = &utx.ring;
+	struct iovec *iov = utx.iov;
+	char *bufs;
+	struct io_uring_sqe *sqe = NULL;
+	struct io_uring_cqe *cqe;
+	off_t end = offset + size;
+	unsigned len;
+	int i, ret, queued, failed = 0;
+
+	if (utx.bufs == NULL) {
+
+		if ((ret = uring_init(ring, 2 * URING_DEPTH)) < 0) {
+			errno = -ret;
+			return -1;
+		}
+
+		bufs = aligned_alloc(4096, (size_t)URING_DEPTH * FAST_CHUNK);
+		if (bufs == NULL) {
+			uring_exit(ring);
+			errno = ENOMEM;
+			return -1;
+		}
+
+		for (i = 0; i < URING_DEPTH; i++) {
+			iov[i].iov_base = bufs + (size_t)i * FAST_CHUNK;
+			iov[i].iov_len = FAST_CHUNK;
+		}
+
+		if ((ret = uring_register_buffers(ring, iov, URING_DEPTH)) < 0) {
+			uring_exit(ring);
+			free(bufs);
+			errno = -ret;
+			return -1;
+		}
+
+		utx.bufs = bufs;
+	}
+
+	while (!failed && offset < end) {
+
+		// queue the next batch: read(i) -> send(i) -> read(i+1) -> ...
+		queued = 0;
+		for (i = 0; i < URING_DEPTH && offset < end; i++) {
+
+			len = (end - offset) < FAST_CHUNK ? (unsigned)(end - offset) : FAST_CHUNK;
+
+			// the ring holds exactly a batch, an SQE missing is a bug rather than a full ring
+			sqe = uring_get_sqe(ring);
+			if (sqe == NULL) {
+				failed = EBUSY;
+				break;
+			}
+			uring_prep_rw(sqe, IORING_OP_READ_FIXED, fd, iov[i].iov_base, len, offset);
+			sqe->buf_index = i;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = len;
+
+			sqe = uring_get_sqe(ring);
+			if (sqe == NULL) {
+				failed = EBUSY;
+				break;
+			}
+			uring_prep_send(sqe, sock, iov[i].iov_base, len, MSG_WAITALL);
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = len | URING_SEND_TAG;
+
+			offset += len;
+			queued += 2;
+		}
+		if (failed) {
+			break;
+		}
+		sqe->flags = 0; // end the chain with the batch
+
+		// a short read or send breaks the chain, every completion must report its full length;
+		// a submission that failed outright leaves nothing to wait for
+		ret = uring_submit(ring, queued);
+		if (ret < 0 && ret != -EINTR) {
+			failed = -ret;
+			break;
+		}
+		while (queued > 0) {
+			cqe = uring_peek(ring);
+			if (cqe == NULL) {
+				ret = uring_submit(ring, queued);
+				if (ret < 0 && ret != -EINTR) {
+					failed = -ret;
+					break;
+				}
+				continue;
+			}
+			if (cqe->res != (int)(cqe->user_data & URING_LEN_MASK) && !failed) {
+				failed = cqe->res < 0 ? -cqe->res : EIO;
+			}
+			if (cqe->res > 0 && (cqe->user_data & URING_SEND_TAG)) {
+				tx_advance(cqe->res);
+			}
+			uring_cqe_seen(ring);
+			queued--;
+		}
+	}
+
+	// SQEs left unsubmitted or operations still owned by the kernel: start over with a new ring
+	if (failed) {
+		uring_tx_release();
+		errno = failed;
+		return -1;
+	}
+
+	return 0;
+
+}
+
+
+
+// send size bytes of the file from offset in CHUNK-byte pieces (the plain path)
+
+int send_file_plain(int sock, int fd, off_t offset, off_t size) {
+
+	return send_mapped(sock, fd, &offset, size, CHUNK);
+
+}
+
+
+
+// send size bytes of the file from offset with the selected method
+
+int send_body(int sock, int fd, off_t offset, off_t size) {
+
+	switch (tx_mode) {
+	case TX_URING:
+		return send_file_uring(sock, fd, offset, size);
+	case TX_FAST:
+		return send_file_fast(sock, fd, offset, size);
+	default:
+		return send_file_plain(sock, fd, offset, size);
+	}
+
+}
+
+
+
+// send the frame header and the new file name, held back (MSG_MORE) to share segments with the body
+// range frames carry [offset, offset + size) of a file of total_size bytes
+
+int send_frame_header(int sock, const char *newfile_name, uint16_t flags, off_t size, off_t offset, off_t total_size) {
+
+	frame_hdr hdr;
+	size_t name_len = strlen(newfile_name);
+
+	frame_encode(&hdr, flags, newfile_name, size, offset, total_size);
+
+	if (send(sock, &hdr, sizeof hdr, MSG_MORE) != sizeof hdr) {
+		return -1;
+	}
+	if (send(sock, newfile_name, name_len, size > 0 ? MSG_MORE : 0) != (ssize_t)name_len) {
+		return -1;
+	}
+
+	metric_add(M_FRAMES, 1);
+
+	return 0;
+
+}
+
+
+
+// ask the server how much of newfile_name it already holds and check that prefix against the local file
+// returns the offset to resume from (0 to start over) or -1 when the connection failed
+
+off_t query_resume(int sock, int fd, const char *newfile_name, off_t file_size) {
+
+	resume_reply reply;
+	unsigned long long committed, done;
+	uint64_t hash = PREFIX_HASH_INIT;
+	reader input;
+	const char *p;
+	size_t n;
+
+	if (send_frame_header(sock, newfile_name, FRAME_F_QUERY, 0, 0, 0) < 0) {
+		return -1;
+	}
+	if (recv(sock, &reply, sizeof reply, MSG_WAITALL) != sizeof reply || be32toh(reply.magic) != FRAME_MAGIC) {
+		return -1;
+	}
+
+	committed = be64toh(reply.committed);
+	if (committed == 0 || committed > (unsigned long long)file_size) {
+		return 0;
+	}
+
+	reader_open(&input, fd, FAST_CHUNK);
+
+	for (done = 0; done < committed; done += n) {
+		p = reader_at(&input, done, (committed - done) < FAST_CHUNK ? committed - done : FAST_CHUNK, &n);
+		if (p == NULL || n == 0) {
+			reader_close(&input);
+			return 0;
+		}
+		hash = prefix_hash(hash, p, n);
+		reader_release(&input, done + n);
+	}
+
+	reader_close(&input);
+
+	if (hash != be64toh(reply.hash)) {
+		printf("Checkpoint of %s does not match the local file, starting over\n", newfile_name);
+		return 0;
+	}
+
+	return committed;
+
+}
+
+
+
+// open a connection to the server, -1 on failure
+
+int connect_server(void) {
+
+	int des_sock;
+	struct sockaddr_in sock_addr;
+
+	des_sock = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (des_sock < 0) {
+		return -1;
+	}
+
+	bzero(&sock_addr, sizeof sock_addr);
+	sock_addr.sin_family = AF_INET; 
+	sock_addr.sin_port = htons(port_num);
+	sock_addr.sin_addr.s_addr = inet_addr(ip_addr);
+	memset(sock_addr.sin_zero, '\0', sizeof sock_addr.sin_zero);  
+
+	if (connect(des_sock, (struct sockaddr *)&sock_addr, sizeof sock_addr) != 0) {
+		close(des_sock);
+		return -1;
+	}
+
+	metric_add(M_CONNECTIONS, 1);
+
+	return des_sock;
+
+}
+
+
+
+// close a connection, counting its retransmits and RTT estimate first
+
+void close_server(int sock) {
+
+	struct tcp_info info;
+	socklen_t len = sizeof info;
+
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+		metric_add(M_RETRANSMITS, info.tcpi_total_retrans);
+		metric_observe(H_RTT, info.tcpi_rtt / 1e6);
+	}
+
+	close(sock);
+
+}
+
+
+
+// one stream of a striped transfer: stripes id, id + N, id + 2N, ... on its own connection
+
+void *stream_main(void *arg) {
+
+	stream *st = arg;
+	int sock;
+	off_t offset, len;
+
+	tx_progress = &st->sent;
+
+	sock = connect_server();
+	if (sock < 0) {
+		st->failed = errno;
+		__atomic_store_n(&st->done, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	for (offset = (off_t)st->id * stripe_size; offset < st->file_size; offset += (off_t)num_streams * stripe_size) {
+
+		len = (st->file_size - offset) < stripe_size ? st->file_size - offset : stripe_size;
+
+		if (send_frame_header(sock, st->newfile_name, FRAME_F_RANGE, len, offset, st->file_size) < 0 ||
+			send_body(sock, st->fd, offset, len) < 0) {
+			st->failed = errno ? errno : EIO;
+			break;
+		}
+	}
+
+	close_server(sock);
+	uring_tx_release();
+	__atomic_store_n(&st->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+
+}
+
+
+
+double now_seconds(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+
+
+// send one file striped over num_streams parallel connections, reporting the progress of each stream
+
+int send_striped(int fd, const char *newfile_name, off_t file_size) {
+
+	static stream streams[MAX_STREAMS];
+	struct timespec tick = { 0, 100 * 1000 * 1000 };
+	double start = now_seconds(), last_report = start, elapsed;
+	off_t offset;
+	int i, running, failed = 0;
+
+	memset(streams, 0, sizeof streams);
+
+	for (i = 0; i < num_streams; i++) {
+		streams[i].id = i;
+		streams[i].fd = fd;
+		streams[i].newfile_name = newfile_name;
+		streams[i].file_size = file_size;
+	}
+
+	for (offset = 0, i = 0; offset < file_size; offset += stripe_size, i = (i + 1) % num_streams) {
+		streams[i].assigned += (file_size - offset) < stripe_size ? file_size - offset : stripe_size;
+	}
+
+	for (i = 0; i < num_streams; i++) {
+		if (pthread_create(&streams[i].thread, NULL, stream_main, &streams[i]) != 0) {
+			printf("ERROR: failed starting stream %d\n", i);
+			exit(1);
+		}
+	}
+
+	do {
+		nanosleep(&tick, NULL);
+
+		running = 0;
+		for (i = 0; i < num_streams; i++) {
+			running += !__atomic_load_n(&streams[i].done, __ATOMIC_ACQUIRE);
+		}
+
+		if (running > 0 && now_seconds() - last_report >= 1.0) {
+			last_report = now_seconds();
+			for (i = 0; i < num_streams; i++) {
+				unsigned long long sent = __atomic_load_n(&streams[i].sent, __ATOMIC_RELAXED);
+				printf("stream %d: %llu / %llu bytes (%.0f%%)\n", i, sent, streams[i].assigned,
+					streams[i].assigned ? 100.0 * sent / streams[i].assigned : 100.0);
+			}
+		}
+	} while (running > 0);
+
+	elapsed = now_seconds() - start;
+
+	for (i = 0; i < num_streams; i++) {
+		pthread_join(streams[i].thread, NULL);
+
+		if (streams[i].failed) {
+			printf("stream %d failed: %s\n", i, strerror(streams[i].failed));
+			failed = 1;
+		}
+		else {
+			printf("stream %d: %llu bytes sent\n", i, streams[i].sent);
+		}
+	}
+
+	printf("%lld bytes over %d streams in %.3f s (%.1f MB/s)\n", (long long)file_size, num_streams, elapsed,
+		elapsed > 0 ? file_size / elapsed / 1e6 : 0.0);
+
+	return failed ? -1 : 0;
+
+}
+
+
+
+// parse a size such as 4096, 512K, 64M or 1G
+
+off_t parse_size(const char *arg) {
+
+	char *end;
+	double v = strtod(arg, &end);
+
+	switch (*end) {
+	case 'k': case 'K': v *= 1024; break;
+	case 'm': case 'M': v *= 1024 * 1024; break;
+	case 'g': case 'G': v *= 1024.0 * 1024 * 1024; break;
+	}
+
+	return (off_t)v;
+
+}
 
-#define CHUNK 10 /* read 10 bytes at a time */
 
 
 int main(int argc, char *argv[]) {
@@ -34,113 +760,217 @@ int main(int argc, char *argv[]) {
 	// input variables
 	char *oldfile_name;
 	char *newfile_name;
-	char *ip_addr;
-	int port_num;
 
 	// socket variable
-	int des_sock; 
-	struct sockaddr_in sock_addr;
-	socklen_t size;
+	int des_sock = -1; 
 
 	// file reading variables
 	FILE *oldfile;
-	char buf[CHUNK+1];
+	struct stat st;
+	int num_files, i, ret;
+	int opt;
+	off_t offset;
+	double started;
+
+	// JSON line log of the metrics, none by default
+	const char *metrics_log = NULL;
+
+
+	// examine the use input (-f selects the fast send path, -b the plain or io_uring backend,
+	// -n the number of parallel streams per file, -s the stripe size, -R resumes interrupted transfers
+	// and -l logs the metrics as JSON lines to a file)
+
+	metrics_init("tcp_client", counter_defs, M_COUNT, hist_defs, H_COUNT, M_BYTES);
+
+	while ((opt = getopt(argc, argv, "fb:n:s:Rl:")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (tx_mode == TX_PLAIN) {
+				tx_mode = TX_FAST;
+			}
+			break;
+		case 'n':
+			num_streams = atoi(optarg);
+			if (num_streams < 1 || num_streams > MAX_STREAMS) {
+				printf("ERROR: stream count must be between 1 and %d\n", MAX_STREAMS);
+				exit(1);
+			}
+			break;
+		case 's':
+			stripe_size = parse_size(optarg);
+			if (stripe_size < 1) {
+				printf("ERROR: invalid stripe size\n");
+				exit(1);
+			}
+			break;
+		case 'R':
+			resume = 1;
+			break;
+		case 'b':
+			if (strcmp(optarg, "plain") == 0) {
+				if (tx_mode == TX_URING) {
+					tx_mode = TX_PLAIN;
+				}
+			}
+			else if (strcmp(optarg, "uring") == 0) {
+				tx_mode = TX_URING;
+			}
+			else {
+				printf("ERROR: backend must be plain or uring\n");
+				exit(1);
+			}
+			break;
+		case 'l':
+			metrics_log = optarg;
+			break;
+		default:
+			printf("usage: %s [-f] [-b plain|uring] [-n streams] [-s stripe_size] [-R] [-l metrics_log] <input_filename> <output_filename> [<input_filename> <output_filename> ...] <server_ip_address> <server_port>\n", argv[0]);
+			exit(1);
+		}
+	}
 
+	argc -= optind - 1;
+	argv += optind - 1;
 
-	// examine the use input
+	// checkpoints cover whole files, the stripes of a file are not tracked
+	if (resume && num_streams > 1) {
+		printf("ERROR: -R cannot be combined with -n\n");
+		exit(1);
+	}
 
 	if (argc < 2) {
 		printf("ERROR: no input\n");
 		exit(1);
 	}
-	else if (argc != 5) {
+	else if (argc < 5 || argc % 2 == 0) {
 		printf("ERROR: wrong input\n");
 		exit(1);
 	}
 	else {
 		printf("Input received\n");
-		oldfile_name = argv[1];
-		newfile_name = argv[2];
-		ip_addr = argv[3];
-		port_num = atoi(argv[4]);
+		num_files = (argc - 3) / 2;
+		ip_addr = argv[argc - 2];
+		port_num = atoi(argv[argc - 1]);
 	}
 
+	metrics_start(metrics_log, NULL);
 
-	// create a socket that connects to the server
 
-	des_sock = socket(AF_INET, SOCK_STREAM, 0);
+	// create a socket that connects to the server (striped files open their own)
 
+	if (num_streams == 1) {
 
-	if (des_sock < 0) {
-		printf("ERROR: failed creating the socket\n");
-		close(des_sock);
-		exit(1);
+		des_sock = connect_server();
+
+		if (des_sock < 0) {
+			printf("\nERROR: failed connecting to the server\n");
+			exit(1);
+		} else {
+			printf("Client socket created\n");
+			printf("\n************************");
+			printf("\nConnecting to the server");
+			printf("\n************************");
+		}
 	}
 
 
-	printf("Client socket created\n");
+	// send every file as one frame, back to back on this connection, or striped
 
+	for (i = 0; i < num_files; i++) {
 
-	bzero(&sock_addr, sizeof sock_addr);
-	sock_addr.sin_family = AF_INET; 
-	sock_addr.sin_port = htons(port_num);
-	sock_addr.sin_addr.s_addr = inet_addr(ip_addr);
-	memset(sock_addr.sin_zero, '\0', sizeof sock_addr.sin_zero);  
+		oldfile_name = argv[1 + 2 * i];
+		newfile_name = argv[2 + 2 * i];
 
-	//inet_pton(AF_INET, ip, &server_addr.sin_addr);
+		if (strlen(newfile_name) == 0 || strlen(newfile_name) > FRAME_NAME_MAX) {
+			printf("ERROR: the new file name must have 1 to %d characters\n", FRAME_NAME_MAX);
+			exit(1);
+		}
 
-	if (connect(des_sock, (struct sockaddr *)&sock_addr, sizeof sock_addr) != 0) {
-		printf("\nERROR: failed connecting to the server\n");
-		close(des_sock);
-		exit(1);
-	} else {
-		printf("\n************************");
-		printf("\nConnecting to the server");
-		printf("\n************************");
-	}
+		printf("\nRead file %s...\n", oldfile_name);
 
+		oldfile = fopen(oldfile_name, "rb");
 
-	// send over the new file name
+		if (oldfile == NULL || fstat(fileno(oldfile), &st) < 0) {
+			printf("Error in opening the file\n");
+			exit(1);
+		}
 
-	printf("%s\n", newfile_name);
-	if (send(des_sock, newfile_name, 20, 0) < 0) {
-		printf("Error in sending the new file name\n");
-    	exit(1);
-	}
+		started = now_seconds();
 
-	printf("New file name sent\n");
 
+		// stripes only pay off for non-empty files (an empty one has no range to send)
 
+		if (num_streams > 1 && st.st_size > 0) {
+			if (send_striped(fileno(oldfile), newfile_name, st.st_size) < 0) {
+				printf("Error in sending the file\n");
+				exit(1);
+			}
+			metric_add(M_FILES, 1);
+			metric_observe(H_FILE, now_seconds() - started);
+			fclose(oldfile);
+			continue;
+		}
 
-	printf("\nRead file...\n");
+		if (des_sock < 0 && (des_sock = connect_server()) < 0) {
+			printf("\nERROR: failed connecting to the server\n");
+			exit(1);
+		}
 
-	oldfile = fopen(oldfile_name, "rb");
 
-	if (oldfile == NULL) {
-		printf("Error in opening the file\n");
-		close(des_sock);
-		exit(1);
-	}
+		// pick up after the part the server has already committed
+
+		offset = 0;
+
+		if (resume && (offset = query_resume(des_sock, fileno(oldfile), newfile_name, st.st_size)) < 0) {
+			printf("Error in querying the checkpoint of %s\n", newfile_name);
+			exit(1);
+		}
+
+
+		// the header announces the size, the body must match it exactly
 
+		if (offset > 0) {
+			printf("Resuming %s at %lld bytes\n", newfile_name, (long long)offset);
+			metric_add(M_RESUMED, offset);
+			ret = send_frame_header(des_sock, newfile_name, FRAME_F_RESUME, st.st_size - offset, offset, st.st_size);
+		}
+		else {
+			ret = send_frame_header(des_sock, newfile_name, 0, st.st_size, 0, st.st_size);
+		}
 
-	// reading the file in chunks and send it over to the server
+		if (ret < 0) {
+			printf("Error in sending the new file name\n");
+			exit(1);
+		}
 
-	bzero(buf, sizeof buf);
-	while (fread(buf, 1, sizeof buf - 1, oldfile) > 0) {
-		//printf("%s\n", buf);
-    	if (send(des_sock, buf, sizeof(buf) - 1, 0) < 0) {
-    		printf("Error in sending the file\n");
-    		exit(1);
-    	}
-    	bzero(buf, sizeof buf);
+		printf("New file name %s sent\n", newfile_name);
+
+
+		// hand the whole file to the kernel on the fast path or to io_uring,
+		// or read it in chunks and send it over to the server
+
+		ret = send_body(des_sock, fileno(oldfile), offset, st.st_size - offset);
+
+		if (ret < 0) {
+			perror("Error in sending the file");
+			exit(1);
+		}
+
+		metric_add(M_FILES, 1);
+		metric_observe(H_FILE, now_seconds() - started);
+
+		fclose(oldfile);
 	}
 
 
 	printf("Finish reading file, close the socket\n");
 
-	fclose(oldfile);
+	if (des_sock >= 0) {
+		close_server(des_sock);
+	}
+	uring_tx_release();
 
-	close(des_sock);
+	metrics_stop();
 
 	return 0;
 
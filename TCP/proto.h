@@ -0,0 +1,194 @@
+/*
+ * File name: proto.h
+ * Description: The wire format shared by the TCP client and server. Every file on a connection is
+ * one frame: a fixed header, the new file name, and exactly file_size bytes of body. Frames follow
+ * each other back to back, so one connection carries any number of files, and the client closes
+ * the connection after the last one.
+ *
+ * A range frame (FRAME_F_RANGE) carries only the bytes [offset, offset + file_size) of a file that
+ * is total_size bytes long. The server writes them in place with positional writes, so the ranges
+ * of one file can arrive in any order over any number of parallel connections.
+ *
+ * Interrupted transfers resume from the server's checkpoint: a query frame (FRAME_F_QUERY, no body)
+ * is answered with a resume_reply holding the committed byte count and the hash of that prefix,
+ * and a resume frame (FRAME_F_RESUME) then carries only the bytes from that offset on.
+ *
+ * All header fields are in network byte order. The checksum covers the header (with the checksum
+ * field set to zero) and the name, so a corrupted or misaligned frame is rejected instead of being
+ * written out under a wrong name or length.
+ *
+ */
+
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+
+#define FRAME_MAGIC 0x53465450u /* "SFTP" */
+#define FRAME_VERSION 2
+#define FRAME_NAME_MAX 255 /* longest new file name */
+
+#define FRAME_F_RANGE 0x0001 /* the body is one range of a larger file, do not truncate it */
+#define FRAME_F_QUERY 0x0002 /* no body, the server answers with the file's resume_reply */
+#define FRAME_F_RESUME 0x0004 /* the body continues the file from the server's checkpoint (offset) */
+
+#define FRAME_FLAGS_KNOWN (FRAME_F_RANGE | FRAME_F_QUERY | FRAME_F_RESUME) /* frames with other flags are rejected */
+
+#define PREFIX_HASH_INIT 14695981039346656037ULL /* hash of the empty prefix */
+
+typedef struct frame_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t flags;
+	uint16_t name_len;
+	uint16_t reserved;
+	uint32_t checksum;
+	uint64_t file_size; // bytes of body in this frame
+	uint64_t offset; // where the body goes in the file (range frames)
+	uint64_t total_size; // final size of the file (range frames)
+} __attribute__((packed)) frame_hdr;
+
+// answer to a query frame, network byte order
+typedef struct resume_reply {
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t committed; // bytes of the file the server has made durable
+	uint64_t hash; // prefix_hash() of those bytes
+} __attribute__((packed)) resume_reply;
+
+
+
+// FNV-1a over the header and the name
+
+static inline uint32_t frame_checksum(const frame_hdr *wire, const char *name, unsigned name_len) {
+
+	frame_hdr h = *wire;
+	const unsigned char *p = (const unsigned char *)&h;
+	uint32_t sum = 2166136261u;
+	unsigned i;
+
+	h.checksum = 0;
+
+	for (i = 0; i < sizeof h; i++) {
+		sum = (sum ^ p[i]) * 16777619u;
+	}
+	for (i = 0; i < name_len; i++) {
+		sum = (sum ^ (unsigned char)name[i]) * 16777619u;
+	}
+
+	return sum;
+
+}
+
+
+
+// fill in a header ready to be sent in front of name
+// plain frames pass offset 0 and total_size equal to file_size
+
+static inline void frame_encode(frame_hdr *wire, uint16_t flags, const char *name, uint64_t file_size,
+	uint64_t offset, uint64_t total_size) {
+
+	unsigned name_len = strlen(name);
+
+	memset(wire, 0, sizeof *wire);
+	wire->magic = htobe32(FRAME_MAGIC);
+	wire->version = htobe16(FRAME_VERSION);
+	wire->flags = htobe16(flags);
+	wire->name_len = htobe16(name_len);
+	wire->file_size = htobe64(file_size);
+	wire->offset = htobe64(offset);
+	wire->total_size = htobe64(total_size);
+	wire->checksum = htobe32(frame_checksum(wire, name, name_len));
+
+}
+
+
+
+// check the fixed part of a received header and convert it to host order
+// returns 0 when the name length can be trusted, -1 for a header that is not ours
+
+static inline int frame_decode(const frame_hdr *wire, frame_hdr *host) {
+
+	host->magic = be32toh(wire->magic);
+	host->version = be16toh(wire->version);
+	host->flags = be16toh(wire->flags);
+	host->name_len = be16toh(wire->name_len);
+	host->reserved = be16toh(wire->reserved);
+	host->checksum = be32toh(wire->checksum);
+	host->file_size = be64toh(wire->file_size);
+	host->offset = be64toh(wire->offset);
+	host->total_size = be64toh(wire->total_size);
+
+	if (host->magic != FRAME_MAGIC || host->version != FRAME_VERSION) {
+		return -1;
+	}
+	if (host->offset > host->total_size || host->file_size > host->total_size - host->offset) {
+		return -1;
+	}
+	if (host->name_len == 0 || host->name_len > FRAME_NAME_MAX || (host->flags & ~FRAME_FLAGS_KNOWN) != 0) {
+		return -1;
+	}
+	if ((host->flags & FRAME_F_QUERY) && host->file_size != 0) {
+		return -1;
+	}
+
+	return 0;
+
+}
+
+
+
+// verify the checksum once the name has arrived
+
+static inline int frame_verify(const frame_hdr *wire, const char *name, unsigned name_len) {
+
+	if (frame_checksum(wire, name, name_len) != be32toh(wire->checksum)) {
+		return -1;
+	}
+	if (memchr(name, '\0', name_len) != NULL) {
+		return -1;
+	}
+
+	return 0;
+
+}
+
+
+
+// whether a name from the network is a plain file name in the server's directory: not empty, no '/'
+// (no absolute path, no other directory), not "." or ".."
+
+static inline int frame_name_ok(const char *name, unsigned name_len) {
+
+	if (name_len == 0 || memchr(name, '/', name_len) != NULL) {
+		return 0;
+	}
+	if ((name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.')) {
+		return 0;
+	}
+
+	return 1;
+
+}
+
+
+
+// FNV-1a 64 over a file prefix, fed in pieces: h = prefix_hash(h, piece, len) starting from PREFIX_HASH_INIT
+
+static inline uint64_t prefix_hash(uint64_t h, const void *buf, size_t len) {
+
+	const unsigned char *p = buf;
+
+	while (len-- > 0) {
+		h = (h ^ *p++) * 1099511628211ULL;
+	}
+
+	return h;
+
+}
+
+
+#endif
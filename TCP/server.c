@@ -2,7 +2,40 @@
  * Author: Chi Zhang (czhang2@scu.edu)
  * File name: client.c
  * Description: The file builds the server side of TCP (Transmission Control Protocol). As the client
- * sends over a txt file, The server receives data in chunk of 10 bytes and writes in chunk of 5 bytes.
+ * sends over a txt file, The server moves the data from the socket into the new file with splice()
+ * through a pipe, so the bytes never cross into user space (-r buffer receives into the buffers of
+ * a writer thread instead, ../common/writer.h, which writes them in large runs so that a slow disk
+ * does not hold up the socket).
+ *
+ * With -e the server keeps running and serves every upload from a single non-blocking epoll loop.
+ * Each connection carries a small state machine (reading a frame header, the file name, the body,
+ * closing) so thousands of concurrent uploads share one thread instead of queueing behind accept().
+ *
+ * Files arrive as frames (see proto.h): a header with the name length, file size, flags and a
+ * checksum, then the name and the body. A connection may carry any number of frames back to back.
+ * Range frames carry one stripe of a larger file: the server sizes the file up front and writes
+ * each stripe in place, so a client may send the stripes of one file over parallel connections.
+ * With -w N the server starts N such loops on their own threads, each owning a SO_REUSEPORT
+ * listener on the same port, so the kernel spreads connections across cores (-c pins them).
+ * With -b uring every loop runs on io_uring instead: a multishot accept feeds the connections and
+ * each body chunk is a linked recv -> write pair on registered buffers, so one thread keeps many
+ * transfers in flight with very few system calls.
+ *
+ * While a whole file comes in, the server checkpoints it every CKPT_INTERVAL bytes and when the
+ * connection breaks: the data is flushed with fdatasync() and <name>.ckpt records the committed
+ * byte count and the hash of that prefix. A reconnecting client queries the checkpoint and resumes
+ * from there instead of from byte zero; the checkpoint is removed once the file is complete.
+ *
+ * Every thread counts connections, body bytes, files, bad frames, checksum failures, broken transfers
+ * and checkpoints into counters of its own (../common/metrics.h), with histograms of how long files
+ * take and of the kernel's RTT estimate (TCP_INFO) of each connection, whose retransmits are counted
+ * too. With -l they go to a JSON line log once a second, with -m they are served in the Prometheus
+ * text format on 127.0.0.1:<port> or on a Unix socket.
+ *
+ * With -o the frame's size is put to use (../common/outfile.h): every file is preallocated, a whole
+ * file is written to <name>.part (where a resume continues it) and renamed once complete, the
+ * writeback is started and the page cache dropped every sync=SIZE bytes, fsync flushes each file
+ * before the rename, and with -r buffer direct writes big files with O_DIRECT.
  *
  * Referencer:
  * Socket Programming in C
@@ -10,11 +43,17 @@
  * http://stackoverflow.com/questions/9840629/create-a-file-if-one-doesnt-exist-c
  * http://www.studytonight.com/c/file-input-output.php
  * http://stackoverflow.com/questions/5850000/how-to-split-array-into-two-arrays-in-c
+ * http://man7.org/linux/man-pages/man7/epoll.7.html
+ * http://man7.org/linux/man-pages/man2/splice.2.html
+ * https://kernel.dk/io_uring.pdf
+ * https://prometheus.io/docs/instrumenting/exposition_formats/
  * 
  *
  */
 
 
+#define _GNU_SOURCE /* accept4, CPU affinity, splice */
+
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
@@ -22,48 +61,344 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "uring.h"
+#include "proto.h"
+#include "../common/metrics.h"
+#include "../common/outfile.h"
+#include "../common/writer.h"
 
 
 
 #define BACKLOG 10 // how many pending connections queue will hold
 
-#define CHUNK 10 /* read 10 bytes at a time */
+#define EVENT_BACKLOG 4096 /* pending connections queue in the persistent server */
+#define MAX_EVENTS 256 /* epoll events handled per wakeup */
+#define RECV_BUF (1024 * 1024) /* bytes moved per receive call, also the pipe size for splice() */
+#define READS_PER_EVENT 16 /* reads per readiness event before yielding to other connections */
+#define MAX_WORKERS 256
+
+#define CKPT_INTERVAL (64ULL * 1024 * 1024) /* bytes between checkpoints of a whole-file transfer */
+
+#define URING_ENTRIES 4096 /* submission queue size of an io_uring loop */
+#define URING_BUFS 256 /* registered buffers, one per connection receiving a body */
+#define URING_BUF (256 * 1024) /* size of one registered buffer */
+
+
+// per-connection state of the event-driven server
+enum conn_state {
+	CONN_READ_HEADER,
+	CONN_READ_NAME,
+	CONN_READ_BODY,
+	CONN_CLOSING
+};
+
+typedef struct conn {
+	int sock;
+	enum conn_state state;
+	frame_hdr wire; // header as received
+	frame_hdr hdr; // header in host order
+	size_t got; // bytes of the header or the name received so far
+	char newfile_name[FRAME_NAME_MAX + 1];
+	int newfile;
+	outfile file; // newfile, its names and how it is written
+	writer_file *out; // newfile once its body goes through a writer thread, which then owns it
+	writer *disk; // that thread
+	unsigned long long received; // body bytes of the current file
+	unsigned files; // files completed on this connection
+	double file_started; // when the name of the current file arrived
+
+	// checkpoint of a whole-file (plain or resumed) frame
+	int ckpt; // the current frame is checkpointed
+	unsigned long long ck_committed; // bytes of the file flushed and hashed
+	uint64_t ck_hash; // prefix_hash() of those bytes
+	unsigned long long ck_next; // offset of the next checkpoint
+
+	// io_uring backend only
+	int buf_index; // registered buffer in use, -1 when none
+	int inflight; // operations the kernel still owns
+	unsigned chunk; // length of the current linked pair
+	int recv_res, write_res; // results of the current linked pair
+	unsigned write_done; // bytes of the chunk written so far
+	struct conn *next; // queue of connections waiting for a buffer
+} conn;
+
+// which loop serves the connections
+enum backend {
+	BACKEND_PLAIN, // blocking one-shot or epoll
+	BACKEND_URING
+};
+
+// operations tagged into the io_uring user_data (conn pointers are 8-byte aligned)
+enum uring_op {
+	OP_ACCEPT,
+	OP_HEADER,
+	OP_NAME,
+	OP_RECV,
+	OP_WRITE,
+	OP_TAIL
+};
+
+// state of one io_uring loop
+typedef struct uring_loop {
+	uring ring;
+	int listen_sock;
+	int multishot; // the kernel keeps the accept armed
+	int persistent; // keep accepting after the first connection
+	int live; // open connections
+	int accepted; // one-shot servers stop after the first connection
+	char *bufs;
+	int free_bufs[URING_BUFS];
+	int num_free;
+	conn *wait_head, *wait_tail; // connections waiting for a buffer
+} uring_loop;
+
+// how the body moves from the socket into the file
+enum rx_mode {
+	RX_SPLICE, // socket -> pipe -> file, no user-space copy
+	RX_BUFFER  // recv() into the buffers of a writer thread, which writes them
+};
+
+// per-thread receive resources (one pipe or writer shared by all connections of a loop)
+typedef struct rx_path {
+	enum rx_mode mode;
+	int pipe_fd[2];
+	char *buf;
+	writer *disk; // buffer mode, started when the loop switches to it
+} rx_path;
+
+// one sharded acceptor thread
+typedef struct worker {
+	pthread_t thread;
+	int id;
+	int port_num;
+	int cpu; // -1 when not pinned
+} worker;
+
 
 
-int main(int argc, char *argv[]) {
+enum rx_mode rx_default = RX_SPLICE;
+enum backend backend = BACKEND_PLAIN;
+outfile_opts output; // -o, how the files are written
 
-	// set up variables
+// what every thread counts (metrics.h)
+enum {
+	M_CONNECTIONS, M_BYTES, M_FILES, M_QUERIES, M_BAD_FRAMES, M_CHECKSUM, M_INCOMPLETE, M_CHECKPOINTS,
+	M_RETRANSMITS, M_DISK_STALLS, M_COUNT
+};
+enum { H_FILE, H_RTT, H_COUNT };
 
-	int port_num;
-	char newfile_name[20];
-	char ip_addr[INET_ADDRSTRLEN];
-	
-	int accept_sock, new_sock; 
-	struct sockaddr_in sock_addr;
-	socklen_t size; 
+const metric_def counter_defs[M_COUNT] = {
+	[M_CONNECTIONS] = { "connections_total", "Connections accepted" },
+	[M_BYTES] = { "received_bytes_total", "File bytes received and written (goodput)" },
+	[M_FILES] = { "files_received_total", "Files and ranges received whole" },
+	[M_QUERIES] = { "resume_queries_total", "Checkpoint queries answered" },
+	[M_BAD_FRAMES] = { "bad_frames_total", "Frame headers that failed to decode or named a path" },
+	[M_CHECKSUM] = { "checksum_failures_total", "Frames whose header checksum did not match" },
+	[M_INCOMPLETE] = { "incomplete_transfers_total", "Connections closed in the middle of a file" },
+	[M_CHECKPOINTS] = { "checkpoints_total", "Checkpoints recorded" },
+	[M_RETRANSMITS] = { "tcp_retransmits_total", "Segments the kernel retransmitted on the connections" },
+	[M_DISK_STALLS] = { "disk_stalls_total", "Receives that waited for the writer thread to free a buffer" },
+};
 
-	char buf[CHUNK + 1];
-	FILE *newfile;
+const metric_def hist_defs[H_COUNT] = {
+	[H_FILE] = { "file_duration_seconds", "From the name of a file to its last byte" },
+	[H_RTT] = { "tcp_rtt_seconds", "The kernel's RTT estimate of each connection when it closes" },
+};
 
 
-	// examine the user input (only need a port here)
 
-	if (argc < 2) {
-		printf("ERROR: no port number input\n");
-		exit(1);
+// receive through the buffers of a writer thread from now on
+
+void rx_use_buffer(rx_path *rx) {
+
+	rx->mode = RX_BUFFER;
+
+	if (rx->disk == NULL) {
+		rx->disk = malloc(sizeof *rx->disk);
+		if (rx->disk == NULL) {
+			printf("ERROR: out of memory\n");
+			exit(1);
+		}
+		writer_start(rx->disk);
 	}
-	else if (argc != 2) {
-		printf("ERROR: wrong input\n");
+
+}
+
+
+
+// set up the receive path of one thread, the pipe stays empty between calls
+
+void rx_path_init(rx_path *rx, enum rx_mode mode) {
+
+	rx->mode = mode;
+	rx->pipe_fd[0] = rx->pipe_fd[1] = -1;
+	rx->buf = malloc(RECV_BUF);
+	rx->disk = NULL;
+
+	if (rx->buf == NULL) {
+		printf("ERROR: failed allocating the receive buffer\n");
 		exit(1);
 	}
+
+	if (mode == RX_BUFFER) {
+		rx_use_buffer(rx);
+	}
+	else if (pipe2(rx->pipe_fd, O_CLOEXEC) < 0) {
+		printf("pipe() failed, receiving through a buffer\n");
+		rx_use_buffer(rx);
+	}
 	else {
-		port_num = atoi(argv[1]);
+		fcntl(rx->pipe_fd[1], F_SETPIPE_SZ, RECV_BUF); // best effort, the default 64 KB also works
+	}
+
+}
+
+
+
+// write all of len bytes at offset (pwrite() may stop short on signals or full disks)
+
+int pwrite_all(int fd, const char *buf, size_t len, off_t offset) {
+
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+
+}
+
+
+
+// receive up to max bytes of the file at offset straight into the buffers of the writer thread
+// (a full ring waits for the disk, which holds up this socket and no other thread)
+// returns like rx_to_file()
+
+ssize_t rx_to_writer(writer *disk, int sock, writer_file *out, off_t offset, size_t max) {
+
+	unsigned long long stalls = disk->stalls;
+	size_t room;
+	char *buf;
+	ssize_t in;
+
+	if (writer_failed(out)) {
+		errno = writer_failed(out);
+		return -1;
+	}
+
+	buf = writer_space(disk, out, offset, &room);
+	if (disk->stalls != stalls) {
+		metric_add(M_DISK_STALLS, disk->stalls - stalls);
+	}
+
+	in = recv(sock, buf, max < room ? max : room, 0);
+	if (in > 0) {
+		writer_commit(disk, in);
+	}
+
+	return in;
+
+}
+
+
+
+// move up to max bytes from the socket into the file at offset
+// returns the byte count, 0 at end of stream, -1 with errno set on failure (EAGAIN: try later)
+
+ssize_t rx_to_file(rx_path *rx, int sock, int file, off_t offset, size_t max) {
+
+	ssize_t in, out, n;
+	loff_t off = offset;
+
+	if (max > RECV_BUF) {
+		max = RECV_BUF;
+	}
+
+	// files opened before the switch to buffer mode finish here, the next ones go through the writer
+	if (rx->mode == RX_BUFFER) {
+		in = recv(sock, rx->buf, max, 0);
+		if (in > 0 && pwrite_all(file, rx->buf, in, offset) < 0) {
+			return -1;
+		}
+		return in;
+	}
+
+	in = splice(sock, NULL, rx->pipe_fd[1], NULL, max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (in < 0 && (errno == EINVAL || errno == ENOSYS)) {
+		printf("splice() unsupported on sockets, receiving through a buffer\n");
+		rx_use_buffer(rx);
+		return rx_to_file(rx, sock, file, offset, max);
+	}
+	if (in <= 0) {
+		return in;
+	}
+
+	// drain the pipe completely so the next connection starts with it empty
+	for (n = in; n > 0; n -= out) {
+
+		out = splice(rx->pipe_fd[0], NULL, file, &off, n, SPLICE_F_MOVE);
+		if (out < 0 && errno == EINTR) {
+			out = 0;
+			continue;
+		}
+		if (out > 0) {
+			continue;
+		}
+
+		// the file system cannot splice, copy what is left in the pipe by hand
+		if (out < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			printf("splice() unsupported by the file system, receiving through a buffer\n");
+			rx_use_buffer(rx);
+			while (n > 0) {
+				out = read(rx->pipe_fd[0], rx->buf, n);
+				if (out <= 0 || pwrite_all(file, rx->buf, out, off) < 0) {
+					return -1;
+				}
+				n -= out;
+				off += out;
+			}
+			break;
+		}
+
+		return -1;
 	}
 
+	return in;
+
+}
+
+
 
+// create the listening socket on port_num
+// with reuseport every worker can bind its own socket to the same port
 
-	// create a new socket
+int open_listener(int port_num, int backlog, int reuseport) {
+
+	int new_sock;
+	struct sockaddr_in sock_addr;
+	int on = 1;
 
 	new_sock = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -74,14 +409,19 @@ int main(int argc, char *argv[]) {
 
 	printf("\nConnection created...");
 
+	setsockopt(new_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+
+	if (reuseport && setsockopt(new_sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0) {
+		printf("ERROR: SO_REUSEPORT not supported\n");
+		exit(1);
+	}
 
-	// set up server_addr values
 
-	inet_ntop(AF_INET, &sock_addr, ip_addr, INET_ADDRSTRLEN); // get the current ip address
+	// set up server_addr values
 
 	bzero(&sock_addr, sizeof sock_addr);
 	sock_addr.sin_family = AF_INET;
-	sock_addr.sin_addr.s_addr = inet_addr(ip_addr);
+	sock_addr.sin_addr.s_addr = htonl(INADDR_ANY);
 	sock_addr.sin_port = htons(port_num);
 	memset(sock_addr.sin_zero, '\0', sizeof sock_addr.sin_zero);  
 
@@ -100,7 +440,7 @@ int main(int argc, char *argv[]) {
 
 	// listen
 
-	if(listen(new_sock, BACKLOG) < 0 )
+	if(listen(new_sock, backlog) < 0 )
  	{  
  		printf("ERROR: failed listening\n");
        	exit(1);
@@ -108,76 +448,1247 @@ int main(int argc, char *argv[]) {
 
 	printf("Listening success\n");
 
+	return new_sock;
 
+}
 
-	// accept
 
-	size = sizeof sock_addr;
 
-	accept_sock = accept(new_sock, (struct sockaddr *)&sock_addr, &size);
+// checkpoint file of a new file name
 
-	if (accept_sock < 0) {
-		printf("\nERROR: failed accepting");
-		exit(1);
+void ckpt_path(char *path, size_t size, const char *newfile_name) {
+
+	snprintf(path, size, "%s.ckpt", newfile_name);
+
+}
+
+
+
+// read the checkpoint of a file, 0 when there is one
+
+int ckpt_load(const char *newfile_name, unsigned long long *committed, uint64_t *hash) {
+
+	char path[FRAME_NAME_MAX + 16];
+	unsigned long long h;
+	FILE *f;
+	int ok;
+
+	ckpt_path(path, sizeof path, newfile_name);
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+
+	ok = fscanf(f, "%llu %llx", committed, &h) == 2;
+	fclose(f);
+	*hash = h;
+
+	return ok ? 0 : -1;
+
+}
+
+
+
+// record a checkpoint, replacing the previous one atomically
+
+void ckpt_save(const char *newfile_name, unsigned long long committed, uint64_t hash) {
+
+	char path[FRAME_NAME_MAX + 16], tmp[FRAME_NAME_MAX + 32];
+	FILE *f;
+
+	ckpt_path(path, sizeof path, newfile_name);
+	snprintf(tmp, sizeof tmp, "%s.tmp", path);
+
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		return;
+	}
+
+	fprintf(f, "%llu %llx\n", committed, (unsigned long long)hash);
+
+	if (fflush(f) == 0 && fdatasync(fileno(f)) == 0 && fclose(f) == 0) {
+		rename(tmp, path);
 	}
 	else {
-		printf("\nAccepting success\n");
+		unlink(tmp);
+	}
+
+}
+
+
+
+// make everything received so far durable, extend the prefix hash over it and record it
+
+void conn_checkpoint(conn *c) {
+
+	unsigned long long end = c->hdr.offset + c->received;
+	char *buf;
+	ssize_t n;
+
+	if (!c->ckpt || end <= c->ck_committed) {
+		return;
+	}
+
+	// the bytes to hash must have left the writer thread (a rare wait, once per CKPT_INTERVAL)
+	if (c->out != NULL) {
+		writer_sync(c->disk);
+	}
+
+	if (fdatasync(c->newfile) < 0 || (buf = malloc(RECV_BUF)) == NULL) {
+		return;
+	}
+
+	// O_DIRECT takes no reads of any size, and the writer has nothing of this file left to write
+	if (c->file.direct) {
+		outfile_set_direct(&c->file, 0);
+	}
+
+	// the new bytes are still in the page cache, reading them back is cheap
+	while (c->ck_committed < end) {
+		n = pread(c->newfile, buf, (end - c->ck_committed) < RECV_BUF ? end - c->ck_committed : RECV_BUF, c->ck_committed);
+		if (n <= 0) {
+			break;
+		}
+		c->ck_hash = prefix_hash(c->ck_hash, buf, n);
+		c->ck_committed += n;
+	}
+
+	free(buf);
+
+	// should this fail, the writes that follow simply go through the page cache
+	if (c->file.direct) {
+		outfile_set_direct(&c->file, 1);
+	}
+
+	ckpt_save(c->newfile_name, c->ck_committed, c->ck_hash);
+	metric_add(M_CHECKPOINTS, 1);
+	c->ck_next = c->ck_committed + CKPT_INTERVAL;
+
+}
+
+
+
+// the kernel's view of a connection that is about to close: its retransmits and RTT estimate
+// (a receiver sends no data to time, so its estimate of the receive RTT when there is one)
+
+void conn_tcp_info(conn *c) {
+
+	struct tcp_info info;
+	socklen_t len = sizeof info;
+
+	if (getsockopt(c->sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+		return;
+	}
+
+	metric_add(M_RETRANSMITS, info.tcpi_total_retrans);
+	metric_observe(H_RTT, (info.tcpi_rcv_rtt > 0 ? info.tcpi_rcv_rtt : info.tcpi_rtt) / 1e6);
+
+}
+
+
+
+// close the current file, after the writes the writer thread still has queued for it
+// (a complete one gets its name, outfile_finish())
+
+void conn_close_file(conn *c, int complete) {
+
+	if (c->out != NULL) {
+		writer_close(c->disk, c->out, complete);
+		c->out = NULL;
+	}
+	else if (outfile_finish(&c->file, complete) < 0) {
+		printf("ERROR: failed finishing %s (%s)\n", c->newfile_name, strerror(errno));
+	}
+	c->newfile = -1;
+
+}
+
+
+
+// release a connection
+
+void conn_close(conn *c) {
+
+	conn_tcp_info(c);
+
+	if (c->newfile >= 0) {
+		if (c->state == CONN_READ_BODY) {
+			conn_checkpoint(c); // keep what arrived for a resume
+		}
+		conn_close_file(c, 0);
+	}
+
+	if (c->state == CONN_READ_BODY) {
+		printf("Connection closed in the middle of %s (%llu of %llu bytes)\n", c->newfile_name,
+			c->received, (unsigned long long)c->hdr.file_size);
+		metric_add(M_INCOMPLETE, 1);
+	}
+	else if (c->state == CONN_READ_NAME || c->got > 0) {
+		printf("Connection closed in the middle of a frame header\n");
+	}
+
+	printf("Connection closed after %u files\n", c->files);
+
+	close(c->sock);
+	free(c);
+
+}
+
+
+
+// the fixed header is complete, check it before trusting the name length
+
+int conn_header_done(conn *c) {
+
+	if (frame_decode(&c->wire, &c->hdr) < 0) {
+		printf("ERROR: invalid frame header\n");
+		metric_add(M_BAD_FRAMES, 1);
+		return -1;
+	}
+
+	c->state = CONN_READ_NAME;
+	c->got = 0;
+
+	return 0;
+
+}
+
+
+
+// the current file is complete, the next frame may follow
+
+void conn_file_done(conn *c) {
+
+	char path[FRAME_NAME_MAX + 16];
+
+	conn_close_file(c, 1);
+	c->files++;
+	metric_add(M_FILES, 1);
+	metric_observe(H_FILE, metrics_now() - c->file_started);
+
+	if (c->ckpt) {
+		ckpt_path(path, sizeof path, c->newfile_name);
+		unlink(path);
+	}
+
+	if (c->hdr.flags & FRAME_F_RANGE) {
+		printf("Range [%llu, %llu) of %s received\n", (unsigned long long)c->hdr.offset,
+			(unsigned long long)(c->hdr.offset + c->received), c->newfile_name);
+	}
+	else if (c->hdr.flags & FRAME_F_RESUME) {
+		printf("File %s received (resumed at %llu, %llu bytes)\n", c->newfile_name,
+			(unsigned long long)c->hdr.offset, c->received);
+	}
+	else {
+		printf("File %s received (%llu bytes)\n", c->newfile_name, c->received);
 	}
 
+	c->state = CONN_READ_HEADER;
+	c->got = 0;
+
+}
 
 
-	// receive the file
 
-	// receive the newfile name
+// answer a query frame with the checkpoint of the file (nothing committed when there is none)
+// the reply is tiny and the socket buffer empty, so a plain send() completes at once
 
-	bzero(newfile_name, sizeof newfile_name);
+int conn_answer_query(conn *c) {
 
-	if (recv(accept_sock, newfile_name, sizeof(newfile_name), 0) > 0) {
-		printf("New file name received!\n");
-		//printf("%s\n", newfile_name);
-	} 
+	resume_reply reply;
+	unsigned long long committed = 0;
+	uint64_t hash = PREFIX_HASH_INIT;
+	char path[FRAME_NAME_MAX + 16];
+	struct stat st;
+
+	// an interrupted file is still under its temp name with -o
+	if (output.on) {
+		outfile_temp_name(path, sizeof path, c->newfile_name);
+	}
 	else {
-		printf("File name receive error.\n");
-		exit(1);
+		snprintf(path, sizeof path, "%s", c->newfile_name);
+	}
+
+	// a checkpoint past the end of the file (truncated since) cannot be trusted
+	if (ckpt_load(c->newfile_name, &committed, &hash) < 0 || stat(path, &st) < 0 ||
+		(unsigned long long)st.st_size < committed) {
+		committed = 0;
+		hash = PREFIX_HASH_INIT;
+	}
+
+	memset(&reply, 0, sizeof reply);
+	reply.magic = htobe32(FRAME_MAGIC);
+	reply.committed = htobe64(committed);
+	reply.hash = htobe64(hash);
+
+	printf("Checkpoint of %s: %llu bytes committed\n", c->newfile_name, committed);
+	metric_add(M_QUERIES, 1);
+
+	if (send(c->sock, &reply, sizeof reply, MSG_NOSIGNAL) != sizeof reply) {
+		return -1;
 	}
 
+	c->state = CONN_READ_HEADER;
+	c->got = 0;
+
+	return 0;
+
+}
+
 
-	// create a new empty file ????????????
 
-	newfile = fopen(newfile_name, "wb+");
-	if (newfile == NULL) {
-		newfile = fopen(newfile_name, "wb+");
+// the name is complete, verify the frame and create the new file
+
+int conn_name_done(conn *c) {
+
+	char path[FRAME_NAME_MAX + 16];
+	enum outfile_kind kind;
+	unsigned long long size;
+
+	// O_DIRECT only takes the page-aligned buffers of the writer thread
+	int direct_ok = backend == BACKEND_PLAIN && rx_default == RX_BUFFER;
+
+	if (frame_verify(&c->wire, c->newfile_name, c->hdr.name_len) < 0) {
+		printf("ERROR: frame checksum mismatch\n");
+		metric_add(M_CHECKSUM, 1);
+		return -1;
 	}
-	
 
-	// receive msg from the client and write to the new file
+	c->newfile_name[c->hdr.name_len] = '\0';
 
-	char buf_wri[5];
+	// the name becomes a path for the file, its .part and its .ckpt: nothing outside this directory
+	if (!frame_name_ok(c->newfile_name, c->hdr.name_len)) {
+		printf("ERROR: refusing file name %s\n", c->newfile_name);
+		metric_add(M_BAD_FRAMES, 1);
+		return -1;
+	}
+
+	if (c->hdr.flags & FRAME_F_QUERY) {
+		return conn_answer_query(c);
+	}
 
-	bzero(buf, sizeof buf);
+	c->ckpt = 0;
 
-	while (recv(accept_sock, buf, sizeof(buf)-1, 0) > 0) {
+	// a range shares the file with the other stripes, only size it (the first stripe to arrive does)
+	if (c->hdr.flags & FRAME_F_RANGE) {
+		kind = OUTFILE_RANGE;
+		size = c->hdr.total_size;
+	}
 
-		// write the file in 5 byte chunks
-		int i, d, c;
-		for (i = 0; i < 2; i++) {
-			bzero(buf_wri, sizeof buf_wri);
-			d = i * 5;
-			memcpy(buf_wri, &buf[d], 5 * sizeof(char));
-			fwrite(buf_wri, sizeof(char), sizeof buf_wri, newfile);
+	// a resume continues exactly where the checkpoint left off
+	else if (c->hdr.flags & FRAME_F_RESUME) {
+		if (ckpt_load(c->newfile_name, &c->ck_committed, &c->ck_hash) < 0 || c->ck_committed != c->hdr.offset) {
+			printf("ERROR: resume of %s at %llu does not match its checkpoint\n", c->newfile_name,
+				(unsigned long long)c->hdr.offset);
+			return -1;
 		}
+		kind = OUTFILE_RESUME;
+		size = c->hdr.offset + c->hdr.file_size;
+		c->ckpt = 1;
+	}
 
-		// printf("%s\n", buf);
-		bzero(buf, sizeof buf);
+	// a whole file starts over, together with its checkpoint
+	else {
+		ckpt_path(path, sizeof path, c->newfile_name);
+		unlink(path);
+		kind = OUTFILE_NEW;
+		size = c->hdr.file_size;
+		c->ckpt = 1;
+		c->ck_committed = 0;
+		c->ck_hash = PREFIX_HASH_INIT;
 	}
 
+	if (outfile_open(&c->file, c->newfile_name, size, kind, direct_ok, &output) < 0) {
+		printf("ERROR: failed creating %s (%s)\n", c->newfile_name, strerror(errno));
+		return -1;
+	}
+	c->newfile = c->file.fd;
 
-	printf("File transfer finished, close the server.\n");
+	c->state = CONN_READ_BODY;
+	c->received = 0;
+	c->file_started = metrics_now();
+	c->ck_next = c->ck_committed + CKPT_INTERVAL;
 
+	if (c->hdr.file_size == 0) {
+		conn_file_done(c);
+	}
 
-	fclose(newfile); 
+	return 0;
 
-	close(new_sock);
+}
+
+
+
+// n more body bytes are on disk: checkpoint when due, finish the file when complete
+
+void conn_received(conn *c, size_t n) {
+
+	// the writer thread paces the writeback of its own writes
+	if (c->out == NULL) {
+		outfile_wrote(&c->file, c->hdr.offset + c->received, n);
+	}
+
+	c->received += n;
+	metric_add(M_BYTES, n);
+
+	if (c->ckpt && c->hdr.offset + c->received >= c->ck_next && c->received < c->hdr.file_size) {
+		conn_checkpoint(c);
+	}
+
+	if (c->received == c->hdr.file_size) {
+		conn_file_done(c);
+	}
+
+}
+
+
+
+// whether a failed call only has to wait for the next readiness event
+
+int would_block(void) {
+
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+}
+
+
+
+// advance the state machine of a readable connection
+// returns CONN_CLOSING once the connection should be released
+
+enum conn_state conn_on_readable(conn *c, rx_path *rx) {
+
+	int reads;
+	ssize_t n;
+	unsigned long long left;
+
+	for (reads = 0; reads < READS_PER_EVENT; reads++) {
+
+		switch (c->state) {
+
+		// the header and the name may arrive in pieces
+		case CONN_READ_HEADER:
+			n = recv(c->sock, (char *)&c->wire + c->got, sizeof c->wire - c->got, 0);
+			if (n == 0) {
+				return CONN_CLOSING; // a clean close between frames ends the connection
+			}
+			if (n < 0) {
+				return would_block() ? c->state : CONN_CLOSING;
+			}
+
+			c->got += n;
+			if (c->got == sizeof c->wire && conn_header_done(c) < 0) {
+				return CONN_CLOSING;
+			}
+			break;
+
+		case CONN_READ_NAME:
+			n = recv(c->sock, c->newfile_name + c->got, c->hdr.name_len - c->got, 0);
+			if (n == 0) {
+				return CONN_CLOSING;
+			}
+			if (n < 0) {
+				return would_block() ? c->state : CONN_CLOSING;
+			}
+
+			c->got += n;
+			if (c->got == c->hdr.name_len && conn_name_done(c) < 0) {
+				return CONN_CLOSING;
+			}
+			break;
+
+		// the body is exactly file_size bytes, the next header follows it
+		case CONN_READ_BODY:
+			left = c->hdr.file_size - c->received;
+
+			// a file begun in buffer mode hands its descriptor to the writer thread
+			if (c->out == NULL && c->received == 0 && rx->mode == RX_BUFFER) {
+				c->out = writer_open(&c->file);
+				c->disk = rx->disk;
+			}
+
+			if (c->out != NULL) {
+				n = rx_to_writer(c->disk, c->sock, c->out, c->hdr.offset + c->received, left < RECV_BUF ? left : RECV_BUF);
+			}
+			else {
+				n = rx_to_file(rx, c->sock, c->newfile, c->hdr.offset + c->received, left < RECV_BUF ? left : RECV_BUF);
+			}
+			if (n == 0) {
+				return CONN_CLOSING;
+			}
+			if (n < 0) {
+				if (would_block()) {
+					return c->state;
+				}
+				printf("ERROR: failed receiving %s\n", c->newfile_name);
+				return CONN_CLOSING;
+			}
+
+			conn_received(c, n);
+			break;
+
+		default:
+			return CONN_CLOSING;
+		}
+	}
+
+	return c->state;
+
+}
+
+
+
+// new connection waiting for its first frame
+
+conn *conn_new(int sock) {
+
+	conn *c = calloc(1, sizeof *c);
+
+	if (c != NULL) {
+		c->sock = sock;
+		c->state = CONN_READ_HEADER;
+		c->newfile = -1;
+		c->buf_index = -1;
+		metric_add(M_CONNECTIONS, 1);
+	}
+
+	return c;
+
+}
+
+
+
+// accept one client, receive its files and return (the original one-shot server)
+
+void serve_once(int new_sock) {
+
+	int accept_sock;
+	struct sockaddr_in sock_addr;
+	socklen_t size; 
+	conn *c;
+	rx_path rx;
+
+
+	// accept
+
+	size = sizeof sock_addr;
+
+	accept_sock = accept(new_sock, (struct sockaddr *)&sock_addr, &size);
+
+	if (accept_sock < 0) {
+		printf("\nERROR: failed accepting");
+		exit(1);
+	}
+	else {
+		printf("\nAccepting success\n");
+	}
+
+
+
+	// receive the files, the blocking socket drives the same state machine as the event loop
+
+	c = conn_new(accept_sock);
+	if (c == NULL) {
+		printf("ERROR: out of memory\n");
+		exit(1);
+	}
+
+	rx_path_init(&rx, rx_default);
+
+	while (conn_on_readable(c, &rx) != CONN_CLOSING) {
+	}
+
+
+	printf("File transfer finished, close the server.\n");
+
+
+	conn_close(c);
+
+	// the files are complete on disk before the server exits
+	if (rx.disk != NULL) {
+		writer_stop(rx.disk);
+	}
+
+}
+
+
+
+// accept every pending connection on the non-blocking listener
+
+void accept_pending(int listen_sock, int epoll_fd) {
+
+	int accept_sock;
+	conn *c;
+	struct epoll_event ev;
+
+	while (1) {
+
+		accept_sock = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (accept_sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("accept"); // e.g. out of descriptors, retried on the next wakeup
+			}
+			return;
+		}
+
+		c = conn_new(accept_sock);
+		if (c == NULL) {
+			close(accept_sock);
+			continue;
+		}
+
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = c;
+
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, accept_sock, &ev) < 0) {
+			perror("epoll_ctl");
+			close(accept_sock);
+			free(c);
+		}
+	}
+
+}
+
+
+
+// serve uploads forever from one non-blocking epoll loop
+
+void serve_events(int listen_sock) {
+
+	int epoll_fd, n, i;
+	struct epoll_event ev, events[MAX_EVENTS];
+	rx_path rx;
+	conn *c;
+
+	rx_path_init(&rx, rx_default);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (epoll_fd < 0) {
+		printf("ERROR: failed setting up the event loop\n");
+		exit(1);
+	}
+
+	fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL) | O_NONBLOCK);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; // the listener is the only entry without a connection
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &ev) < 0) {
+		printf("ERROR: failed watching the listener\n");
+		exit(1);
+	}
+
+	printf("Serving uploads...\n");
+
+	while (1) {
+
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			exit(1);
+		}
+
+		for (i = 0; i < n; i++) {
+
+			c = events[i].data.ptr;
+
+			if (c == NULL) {
+				accept_pending(listen_sock, epoll_fd);
+				continue;
+			}
+
+			// read first even on hangup so the tail of the body is not lost
+			if (conn_on_readable(c, &rx) == CONN_CLOSING) {
+				conn_close(c); // closing the socket also removes it from the epoll set
+			}
+		}
+
+		// what the events added to a file goes to the writer now rather than waiting to fill a buffer
+		if (rx.disk != NULL) {
+			writer_flush(rx.disk);
+		}
+	}
+
+}
+
+
+
+// queue one operation of connection c, NULL c stands for the listener
+
+struct io_uring_sqe *uring_sqe(uring_loop *l, conn *c, enum uring_op op) {
+
+	struct io_uring_sqe *sqe = uring_get_sqe(&l->ring);
+
+	if (sqe == NULL) {
+		printf("ERROR: io_uring submission queue overflow\n");
+		exit(1);
+	}
+
+	sqe->user_data = (unsigned long long)(uintptr_t)c | op;
+	if (c != NULL) {
+		c->inflight++;
+	}
+
+	return sqe;
+
+}
+
+
+
+void uring_arm_accept(uring_loop *l) {
+
+	struct io_uring_sqe *sqe = uring_sqe(l, NULL, OP_ACCEPT);
+
+	uring_prep_accept_multishot(sqe, l->listen_sock, SOCK_CLOEXEC);
+	if (!l->multishot) {
+		sqe->ioprio = 0;
+	}
+
+}
+
+
+
+// the rest of the header or the name, MSG_WAITALL so only end of stream returns short
+
+void uring_recv_header(uring_loop *l, conn *c) {
+
+	uring_prep_recv(uring_sqe(l, c, OP_HEADER), c->sock, (char *)&c->wire + c->got, sizeof c->wire - c->got, MSG_WAITALL);
+
+}
+
+
+
+void uring_recv_name(uring_loop *l, conn *c) {
+
+	uring_prep_recv(uring_sqe(l, c, OP_NAME), c->sock, c->newfile_name + c->got, c->hdr.name_len - c->got, MSG_WAITALL);
+
+}
+
+
+
+// one body chunk: a recv of the whole chunk linked to the write of that buffer
+// a short recv (end of stream) breaks the link and cancels the write
+
+void uring_recv_body(uring_loop *l, conn *c) {
+
+	char *buf = l->bufs + (size_t)c->buf_index * URING_BUF;
+	unsigned long long left = c->hdr.file_size - c->received;
+	struct io_uring_sqe *sqe;
+
+	c->chunk = left < URING_BUF ? left : URING_BUF;
+	c->write_done = 0;
+
+	// the pair goes to the kernel in one submission, or the link between the two is lost
+	if (uring_reserve(&l->ring, 2) < 0) {
+		printf("ERROR: io_uring submission queue overflow\n");
+		exit(1);
+	}
+
+	sqe = uring_sqe(l, c, OP_RECV);
+	uring_prep_recv(sqe, c->sock, buf, c->chunk, MSG_WAITALL);
+	sqe->flags |= IOSQE_IO_LINK;
+
+	sqe = uring_sqe(l, c, OP_WRITE);
+	uring_prep_rw(sqe, IORING_OP_WRITE_FIXED, c->newfile, buf, c->chunk, c->hdr.offset + c->received);
+	sqe->buf_index = c->buf_index;
+
+}
+
+
+
+// give c a registered buffer and start its body, or queue it until one is free
+
+void uring_start_body(uring_loop *l, conn *c) {
+
+	if (l->num_free == 0) {
+		c->next = NULL;
+		if (l->wait_tail != NULL) {
+			l->wait_tail->next = c;
+		}
+		else {
+			l->wait_head = c;
+		}
+		l->wait_tail = c;
+		return;
+	}
+
+	c->buf_index = l->free_bufs[--l->num_free];
+	uring_recv_body(l, c);
+
+}
+
+
+
+// return the buffer of c, handing it straight to the oldest waiting connection
+
+void uring_put_buf(uring_loop *l, conn *c) {
+
+	conn *w;
+
+	if (c->buf_index < 0) {
+		return;
+	}
+
+	l->free_bufs[l->num_free++] = c->buf_index;
+	c->buf_index = -1;
+
+	if ((w = l->wait_head) != NULL) {
+		l->wait_head = w->next;
+		if (l->wait_head == NULL) {
+			l->wait_tail = NULL;
+		}
+		uring_start_body(l, w);
+	}
+
+}
+
+
+
+// release c once the kernel holds no more of its operations
+
+void uring_finish(uring_loop *l, conn *c) {
+
+	if (c->inflight > 0) {
+		return;
+	}
+
+	uring_put_buf(l, c);
+	conn_close(c);
+	l->live--;
+
+}
+
+
+
+// continue with whatever the state machine expects next
+
+void uring_next(uring_loop *l, conn *c) {
+
+	if (c->state == CONN_READ_HEADER) {
+		uring_put_buf(l, c);
+		uring_recv_header(l, c);
+	}
+	else if (c->state == CONN_READ_NAME) {
+		uring_recv_name(l, c);
+	}
+	else if (c->buf_index >= 0) {
+		uring_recv_body(l, c);
+	}
+	else {
+		uring_start_body(l, c);
+	}
+
+}
+
+
+
+void uring_on_accept(uring_loop *l, int res, unsigned cqe_flags) {
+
+	conn *c;
+
+	if (res == -EINVAL && l->multishot) {
+		printf("multishot accept unsupported, accepting one at a time\n");
+		l->multishot = 0;
+	}
+
+	// multishot ended (or was never used): re-arm, a one-shot server only re-arms after failures
+	if (!(cqe_flags & IORING_CQE_F_MORE) && (l->persistent || res < 0)) {
+		uring_arm_accept(l);
+	}
+
+	if (res < 0) {
+		return;
+	}
+
+	c = conn_new(res);
+	if (c == NULL) {
+		close(res);
+		return;
+	}
+
+	l->live++;
+	l->accepted++;
+
+	uring_recv_header(l, c);
+
+}
+
+
+
+void uring_on_completion(uring_loop *l, conn *c, enum uring_op op, int res) {
+
+	c->inflight--;
+
+	switch (op) {
+
+	// MSG_WAITALL: anything short of the request means the peer is gone
+	case OP_HEADER:
+		if (res > 0) {
+			c->got += res;
+		}
+		if (c->got < sizeof c->wire || conn_header_done(c) < 0) {
+			uring_finish(l, c);
+			return;
+		}
+		uring_next(l, c);
+		return;
+
+	case OP_NAME:
+		if (res > 0) {
+			c->got += res;
+		}
+		if (c->got < c->hdr.name_len || conn_name_done(c) < 0) {
+			uring_finish(l, c);
+			return;
+		}
+		uring_next(l, c);
+		return;
+
+	case OP_RECV:
+		c->recv_res = res;
+		break;
+
+	case OP_WRITE:
+		c->write_res = res;
+		if (res > 0) {
+			c->write_done += res;
+		}
+		break;
+
+	case OP_TAIL:
+		if (res > 0) {
+			c->received += res;
+			metric_add(M_BYTES, res);
+		}
+		uring_finish(l, c);
+		return;
+
+	default:
+		return;
+	}
+
+	// wait for both halves of the linked pair
+	if (c->inflight > 0) {
+		return;
+	}
+
+	if (c->recv_res == (int)c->chunk && c->write_done == c->chunk) {
+		conn_received(c, c->chunk);
+		uring_next(l, c);
+		return;
+	}
+
+	// a short write: the rest of the buffer goes after it before the next recv
+	if (c->recv_res == (int)c->chunk && c->write_res > 0) {
+		struct io_uring_sqe *sqe = uring_sqe(l, c, OP_WRITE);
+		uring_prep_rw(sqe, IORING_OP_WRITE_FIXED, c->newfile, l->bufs + (size_t)c->buf_index * URING_BUF + c->write_done,
+			c->chunk - c->write_done, c->hdr.offset + c->received + c->write_done);
+		sqe->buf_index = c->buf_index;
+		return;
+	}
+
+	// the peer went away mid-body: the short recv cancelled its write, keep what did arrive
+	if (c->recv_res > 0 && c->write_res == -ECANCELED) {
+		struct io_uring_sqe *sqe = uring_sqe(l, c, OP_TAIL);
+		uring_prep_rw(sqe, IORING_OP_WRITE_FIXED, c->newfile, l->bufs + (size_t)c->buf_index * URING_BUF, c->recv_res,
+			c->hdr.offset + c->received);
+		sqe->buf_index = c->buf_index;
+		return;
+	}
+
+	// a failed recv, or a write that failed or wrote nothing; a peer that closed before the body cancels the write
+	if (c->recv_res < 0 || c->write_res != -ECANCELED) {
+		printf("ERROR: failed receiving %s (%s)\n", c->newfile_name,
+			strerror(c->recv_res < 0 ? -c->recv_res : c->write_res < 0 ? -c->write_res : EIO));
+	}
+
+	uring_finish(l, c);
+
+}
+
+
+
+// serve uploads from one io_uring, forever or (one-shot) until the first connection is done
+
+void serve_uring(int listen_sock, int persistent) {
+
+	uring_loop *l;
+	struct iovec iov[URING_BUFS];
+	struct io_uring_cqe *cqe;
+	int i, ret;
+	unsigned long long ud;
+
+	l = calloc(1, sizeof *l);
+	if (l == NULL || (ret = uring_init(&l->ring, URING_ENTRIES)) < 0) {
+		printf("ERROR: io_uring unavailable (%s)\n", strerror(l == NULL ? ENOMEM : -ret));
+		exit(1);
+	}
+
+	l->bufs = aligned_alloc(4096, (size_t)URING_BUFS * URING_BUF);
+	if (l->bufs == NULL) {
+		printf("ERROR: failed allocating the io_uring buffers\n");
+		exit(1);
+	}
+
+	for (i = 0; i < URING_BUFS; i++) {
+		iov[i].iov_base = l->bufs + (size_t)i * URING_BUF;
+		iov[i].iov_len = URING_BUF;
+		l->free_bufs[i] = i;
+	}
+	l->num_free = URING_BUFS;
+
+	if ((ret = uring_register_buffers(&l->ring, iov, URING_BUFS)) < 0) {
+		printf("ERROR: failed registering the io_uring buffers (%s)\n", strerror(-ret));
+		exit(1);
+	}
+
+	l->listen_sock = listen_sock;
+	l->persistent = persistent;
+	l->multishot = persistent;
+	uring_arm_accept(l);
+
+	printf("Serving uploads with io_uring...\n");
+
+	while (persistent || l->accepted == 0 || l->live > 0) {
+
+		ret = uring_submit(&l->ring, 1);
+		if (ret < 0 && ret != -EINTR && ret != -EBUSY) {
+			printf("ERROR: io_uring_enter failed (%s)\n", strerror(-ret));
+			exit(1);
+		}
+
+		while ((cqe = uring_peek(&l->ring)) != NULL) {
+
+			ud = cqe->user_data;
+			ret = cqe->res;
+			i = cqe->flags;
+			uring_cqe_seen(&l->ring);
+
+			if ((ud & 7) == OP_ACCEPT) {
+				uring_on_accept(l, ret, i);
+			}
+			else {
+				uring_on_completion(l, (conn *)(uintptr_t)(ud & ~7ULL), ud & 7, ret);
+			}
+		}
+	}
+
+	uring_exit(&l->ring);
+	free(l->bufs);
+	free(l);
+
+}
+
+
+
+// body of a sharded acceptor thread
+
+void *worker_main(void *arg) {
+
+	worker *w = arg;
+	cpu_set_t cpus;
+	int listen_sock;
+
+	if (w->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(w->cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus) != 0) {
+			printf("Worker %d: failed pinning to CPU %d\n", w->id, w->cpu);
+		}
+	}
+
+	listen_sock = open_listener(w->port_num, EVENT_BACKLOG, 1);
+
+	if (backend == BACKEND_URING) {
+		serve_uring(listen_sock, 1);
+	}
+	else {
+		serve_events(listen_sock);
+	}
+
+	close(listen_sock);
+	return NULL;
+
+}
+
+
+
+// start the sharded acceptors and wait for them (they only return on fatal errors)
+
+void serve_workers(int port_num, int num_workers, int pin) {
+
+	static worker workers[MAX_WORKERS];
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+	for (i = 0; i < num_workers; i++) {
+		workers[i].id = i;
+		workers[i].port_num = port_num;
+		workers[i].cpu = (pin && num_cpus > 0) ? (int)(i % num_cpus) : -1;
+
+		if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+			printf("ERROR: failed starting worker %d\n", i);
+			exit(1);
+		}
+	}
+
+	printf("%d workers started\n", num_workers);
+
+	for (i = 0; i < num_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+}
+
+
+
+// allow as many open descriptors as the hard limit permits
+
+void raise_fd_limit(void) {
+
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+}
+
+
+
+int main(int argc, char *argv[]) {
+
+	// set up variables
+
+	int port_num;
+	int new_sock; 
+	int persistent = 0;
+	int num_workers = 0;
+	int pin = 0;
+	int opt;
+	const char *metrics_log = NULL, *metrics_addr = NULL;
+
+
+	// examine the user input (a port, -e for the persistent event-driven server,
+	// -w for sharded acceptor threads, -c to pin them to CPUs, -r for the receive path,
+	// -b for the plain or io_uring backend, -l to log the metrics as JSON lines to a file,
+	// -m to serve them on a port or Unix socket, -o for how the files are written)
+
+	metrics_init("tcp_server", counter_defs, M_COUNT, hist_defs, H_COUNT, M_BYTES);
+
+	while ((opt = getopt(argc, argv, "ew:cr:b:l:m:o:")) != -1) {
+		switch (opt) {
+		case 'e':
+			persistent = 1;
+			break;
+		case 'w':
+			num_workers = atoi(optarg);
+			if (num_workers < 1 || num_workers > MAX_WORKERS) {
+				printf("ERROR: worker count must be between 1 and %d\n", MAX_WORKERS);
+				exit(1);
+			}
+			persistent = 1;
+			break;
+		case 'c':
+			pin = 1;
+			break;
+		case 'r':
+			if (strcmp(optarg, "splice") == 0) {
+				rx_default = RX_SPLICE;
+			}
+			else if (strcmp(optarg, "buffer") == 0) {
+				rx_default = RX_BUFFER;
+			}
+			else {
+				printf("ERROR: receive path must be splice or buffer\n");
+				exit(1);
+			}
+			break;
+		case 'b':
+			if (strcmp(optarg, "plain") == 0) {
+				backend = BACKEND_PLAIN;
+			}
+			else if (strcmp(optarg, "uring") == 0) {
+				backend = BACKEND_URING;
+			}
+			else {
+				printf("ERROR: backend must be plain or uring\n");
+				exit(1);
+			}
+			break;
+		case 'l':
+			metrics_log = optarg;
+			break;
+		case 'm':
+			metrics_addr = optarg;
+			break;
+		case 'o':
+			if (outfile_parse(&output, optarg) < 0) {
+				exit(1);
+			}
+			break;
+		default:
+			printf("usage: %s [-e] [-w workers] [-c] [-r splice|buffer] [-b plain|uring] [-l metrics_log] [-m metrics_port|path] [-o output_mode] <port#>\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	if (optind >= argc) {
+		printf("ERROR: no port number input\n");
+		exit(1);
+	}
+	else if (argc - optind != 1) {
+		printf("ERROR: wrong input\n");
+		exit(1);
+	}
+	else {
+		port_num = atoi(argv[optind]);
+	}
+
+
+	if (persistent) {
+
+		// a client vanishing mid-transfer must not kill the server
+		signal(SIGPIPE, SIG_IGN);
+		raise_fd_limit();
+
+		// keep the log readable when it is redirected while the server runs
+		setvbuf(stdout, NULL, _IOLBF, 0);
+	}
+
+	metrics_start(metrics_log, metrics_addr);
+
+	if (num_workers > 0) {
+		serve_workers(port_num, num_workers, pin);
+		metrics_stop();
+		return 0;
+	}
+
+	if (backend == BACKEND_URING) {
+		new_sock = open_listener(port_num, persistent ? EVENT_BACKLOG : BACKLOG, 0);
+		serve_uring(new_sock, persistent);
+	}
+	else if (persistent) {
+		new_sock = open_listener(port_num, EVENT_BACKLOG, 0);
+		serve_events(new_sock);
+	}
+	else {
+		new_sock = open_listener(port_num, BACKLOG, 0);
+		serve_once(new_sock);
+	}
+
+
+	close(new_sock);
+
+	metrics_stop();
 
 	return 0;
 
@@ -0,0 +1,259 @@
+/*
+ * File name: uring.h
+ * Description: A minimal io_uring wrapper for the TCP server and client, talking to the kernel through
+ * the raw io_uring_setup/io_uring_enter/io_uring_register system calls (no liburing needed). It maps
+ * the submission and completion rings and hands out SQEs; callers fill them in directly.
+ *
+ * Referencer:
+ * https://kernel.dk/io_uring.pdf
+ * http://man7.org/linux/man-pages/man7/io_uring.7.html
+ *
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+
+typedef struct uring {
+	int fd;
+
+	// submission ring
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	unsigned sqe_tail; // SQEs handed out, published to the kernel on submit
+	struct io_uring_sqe *sqes;
+
+	// completion ring
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+} uring;
+
+
+
+// create a ring with room for entries submissions, returns 0 or -errno
+
+static inline int uring_init(uring *r, unsigned entries) {
+
+	struct io_uring_params p;
+	int single_mmap;
+
+	memset(r, 0, sizeof *r);
+	memset(&p, 0, sizeof p);
+
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0) {
+		return -errno;
+	}
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap && r->cq_ring_size > r->sq_ring_size) {
+		r->sq_ring_size = r->cq_ring_size;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		goto fail;
+	}
+
+	r->cq_ring = single_mmap ? r->sq_ring :
+		mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	if (r->cq_ring == MAP_FAILED) {
+		goto fail;
+	}
+
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		goto fail;
+	}
+
+	r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+	r->sq_entries = p.sq_entries;
+	r->sqe_tail = *r->sq_tail;
+
+	r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+	return 0;
+
+fail:
+	close(r->fd);
+	return -ENOMEM;
+
+}
+
+
+
+// publish the prepared SQEs and optionally wait for wait_nr completions
+// returns the number submitted or -errno
+
+static inline int uring_submit(uring *r, unsigned wait_nr) {
+
+	unsigned tail = *r->sq_tail;
+	unsigned to_submit = r->sqe_tail - tail;
+	int ret;
+
+	for (; tail != r->sqe_tail; tail++) {
+		r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+	}
+	__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR && wait_nr == 0);
+
+	return ret < 0 ? -errno : ret;
+
+}
+
+
+
+// make room for n SQEs, submitting the queued ones first when fewer are free, so that a linked chain
+// of n goes to the kernel in one submission; returns 0, or -1 when they do not fit
+
+static inline int uring_reserve(uring *r, unsigned n) {
+
+	if (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) + n > r->sq_entries) {
+		if (uring_submit(r, 0) < 0 || r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) + n > r->sq_entries) {
+			return -1;
+		}
+	}
+
+	return 0;
+
+}
+
+
+
+// hand out a zeroed SQE, submitting the queued ones first when the ring is full
+
+static inline struct io_uring_sqe *uring_get_sqe(uring *r) {
+
+	struct io_uring_sqe *sqe;
+
+	if (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+		if (uring_submit(r, 0) < 0 || r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+			return NULL;
+		}
+	}
+
+	sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	r->sqe_tail++;
+
+	return sqe;
+
+}
+
+
+
+// next completion or NULL when the ring is empty
+
+static inline struct io_uring_cqe *uring_peek(uring *r) {
+
+	unsigned head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	return &r->cqes[head & *r->cq_mask];
+
+}
+
+
+
+static inline void uring_cqe_seen(uring *r) {
+
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+
+}
+
+
+
+// pin buffers in the kernel for READ_FIXED/WRITE_FIXED, returns 0 or -errno
+
+static inline int uring_register_buffers(uring *r, struct iovec *iov, unsigned n) {
+
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, n) < 0) {
+		return -errno;
+	}
+
+	return 0;
+
+}
+
+
+
+static inline void uring_exit(uring *r) {
+
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring != r->sq_ring) {
+		munmap(r->cq_ring, r->cq_ring_size);
+	}
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+
+}
+
+
+
+// SQE preparation helpers
+
+static inline void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, const void *addr, unsigned len, unsigned long long offset) {
+
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long long)(uintptr_t)addr;
+	sqe->len = len;
+	sqe->off = offset;
+
+}
+
+
+static inline void uring_prep_recv(struct io_uring_sqe *sqe, int sock, void *buf, unsigned len, int flags) {
+
+	uring_prep_rw(sqe, IORING_OP_RECV, sock, buf, len, 0);
+	sqe->msg_flags = flags;
+
+}
+
+
+static inline void uring_prep_send(struct io_uring_sqe *sqe, int sock, const void *buf, unsigned len, int flags) {
+
+	uring_prep_rw(sqe, IORING_OP_SEND, sock, buf, len, 0);
+	sqe->msg_flags = flags;
+
+}
+
+
+static inline void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int listen_sock, int flags) {
+
+	uring_prep_rw(sqe, IORING_OP_ACCEPT, listen_sock, NULL, 0, 0);
+	sqe->accept_flags = flags;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+
+}
+
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * File name: bench_checksum.c
+ * Description: Checks and times the checksum kernels of checksum.h on this CPU. Every kernel the CPU
+ * supports is first compared with the scalar reference of its kind on random and all-ones buffers of
+ * every length up to a few packets, at every alignment; a mismatch stops the program with an error.
+ * Then each kernel checksums buffers of each size over and over for a while, and the rate is printed
+ * in GB/s. The kernels the programs pick at run time are marked.
+ *
+ * Build and run: gcc -O2 -o bench_checksum bench_checksum.c && ./bench_checksum [size ...]
+ *
+ * Referencer:
+ * http://man7.org/linux/man-pages/man2/clock_gettime.2.html
+ *
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "checksum.h"
+
+
+
+#define CHECK_LEN 2048 /* every length up to this is cross-checked */
+#define CHECK_OFFSETS 16 /* at every offset up to this from an aligned buffer */
+#define CHECK_ALIGN 64
+#define BIG_LEN (1 << 20)
+#define BENCH_TIME 0.2 /* seconds per kernel and size */
+#define BENCH_BURST 64 /* calls between two looks at the clock */
+
+
+
+double now_seconds(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+
+
+// the scalar kernel of the same kind
+const checksum_kernel *reference(int kind) {
+
+	unsigned i;
+
+	for (i = 0; i < CHECKSUM_KERNELS; i++) {
+		if (checksum_kernels[i].kind == kind && checksum_kernels[i].cpu == NULL) {
+			return &checksum_kernels[i];
+		}
+	}
+
+	return NULL;
+
+}
+
+
+
+// compare a kernel with the reference on len bytes at buf; returns 0 when they agree
+
+int cross_check(const checksum_kernel *k, const unsigned char *buf, size_t len) {
+
+	uint32_t want = reference(k->kind)->fn(buf, len), got = k->fn(buf, len);
+
+	if (want != got) {
+		printf("ERROR: %s gives %08x instead of %08x for %zu bytes at offset %zu\n",
+			k->name, got, want, len, (size_t)((uintptr_t)buf % CHECK_ALIGN));
+		return 1;
+	}
+
+	return 0;
+
+}
+
+
+
+int main(int argc, char *argv[]) {
+
+	size_t default_sizes[] = { 64, 576, 1500, 9000, 65507, BIG_LEN };
+	size_t *sizes = default_sizes;
+	int nsizes = sizeof default_sizes / sizeof default_sizes[0];
+	unsigned char *buf, *ones;
+	const checksum_kernel *k;
+	size_t len, off;
+	unsigned i;
+	int s, r, errors = 0;
+	double started, elapsed;
+	unsigned long long rounds;
+	volatile uint32_t sink = 0;
+
+	if (argc > 1) {
+		nsizes = argc - 1;
+		sizes = calloc(nsizes, sizeof *sizes);
+		if (sizes == NULL) {
+			printf("ERROR: out of memory\n");
+			exit(1);
+		}
+		for (s = 0; s < nsizes; s++) {
+			sizes[s] = strtoul(argv[s + 1], NULL, 10);
+			if (sizes[s] < 1 || sizes[s] > BIG_LEN) {
+				printf("ERROR: sizes must be between 1 and %d bytes\n", BIG_LEN);
+				exit(1);
+			}
+		}
+	}
+
+	buf = aligned_alloc(CHECK_ALIGN, BIG_LEN + CHECK_ALIGN);
+	ones = aligned_alloc(CHECK_ALIGN, BIG_LEN + CHECK_ALIGN);
+	if (buf == NULL || ones == NULL) {
+		printf("ERROR: out of memory\n");
+		exit(1);
+	}
+
+	srand(1);
+	for (len = 0; len < BIG_LEN + CHECK_ALIGN; len++) {
+		buf[len] = rand();
+	}
+	memset(ones, 0xff, BIG_LEN + CHECK_ALIGN);
+
+	checksum_init();
+
+
+	// every kernel against its reference first: random data and all ones (the most carries)
+
+	for (i = 0; i < CHECKSUM_KERNELS; i++) {
+
+		k = &checksum_kernels[i];
+
+		if (!checksum_supported(k)) {
+			printf("%-14s not supported by this CPU\n", k->name);
+			continue;
+		}
+
+		for (off = 0; off < CHECK_OFFSETS; off++) {
+			for (len = 0; len <= CHECK_LEN; len++) {
+				errors += cross_check(k, buf + off, len) + cross_check(k, ones + off, len);
+				if (errors > 10) {
+					exit(1);
+				}
+			}
+		}
+		errors += cross_check(k, buf, BIG_LEN) + cross_check(k, ones + 1, BIG_LEN - 1);
+
+		printf("%-14s matches %s\n", k->name, reference(k->kind)->name);
+	}
+
+	if (errors > 0) {
+		exit(1);
+	}
+
+
+	// then the rates
+
+	printf("\n%-14s", "GB/s");
+	for (s = 0; s < nsizes; s++) {
+		printf(" %9zu", sizes[s]);
+	}
+	printf("\n");
+
+	for (i = 0; i < CHECKSUM_KERNELS; i++) {
+
+		k = &checksum_kernels[i];
+
+		if (!checksum_supported(k)) {
+			continue;
+		}
+
+		printf("%-14s", k->name);
+
+		for (s = 0; s < nsizes; s++) {
+			rounds = 0;
+			started = now_seconds();
+			do {
+				for (r = 0; r < BENCH_BURST; r++) {
+					sink += k->fn(buf, sizes[s]);
+				}
+				rounds += BENCH_BURST;
+			} while ((elapsed = now_seconds() - started) < BENCH_TIME);
+
+			printf(" %9.2f", rounds * sizes[s] / elapsed / 1e9);
+		}
+
+		printf("%s\n", k->fn == inet_sum_fn || k->fn == crc32c_fn ? "  (in use)" : "");
+	}
+
+	return 0;
+
+}
@@ -0,0 +1,66 @@
+#!/bin/bash
+#
+# File name: bench_udp.sh
+# Description: Compares the UDP send paths over loopback: one datagram per system call (-b 1),
+# sendmmsg/recvmmsg batches (-b 32) and GSO/GRO (-b 32 -g). Each run starts a server and sends one
+# file with the matching client, and the script prints the client's wall time, the CPU time
+# (user + sys) spent by the server and the client, and how many system calls the datagrams took.
+# The server lingers after each transfer to answer late retransmits, so runs take a while.
+#
+# Loopback carries 64 KB datagrams, so the client's payload is capped (1400 bytes by default, an
+# Ethernet-sized packet) to give the batches something to batch.
+#
+# usage: ./bench_udp.sh [size_KB] [runs] [port] [payload]
+#
+
+SIZE_KB=${1:-16}
+RUNS=${2:-3}
+PORT=${3:-9600}
+PAYLOAD=${4:-1400}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+gcc -O2 -pthread -o "$DIR/server" server.c || exit 1
+gcc -O2 -pthread -o "$DIR/client" client.c || exit 1
+
+head -c $((SIZE_KB * 1024)) /dev/urandom > "$DIR/input.bin"
+
+TIMEFORMAT="%R %U %S"
+
+# run <name> <options for both sides>
+run() {
+
+	local name=$1 opts=$2 i srv cli wall calls
+
+	for i in $(seq 1 "$RUNS"); do
+
+		(cd "$DIR" && { time ./server -n 1 $opts "$PORT" > server.log; } 2> server.time) &
+		sleep 0.2
+
+		cli=$( { time "$DIR/client" $opts -p "$PAYLOAD" "$DIR/input.bin" output 127.0.0.1 "$PORT" > "$DIR/client.log"; } 2>&1 )
+		wait
+		srv=$(cat "$DIR/server.time")
+
+		if ! cmp -s "$DIR/input.bin" "$DIR/output"; then
+			echo "$name: run $i produced a different file" >&2
+			exit 1
+		fi
+
+		wall=$(echo "$cli" | awk '{ print $1 }')
+		calls=$(grep "datagrams in" "$DIR/client.log" | awk '{ print $1 "/" $4 }')
+
+		printf "%-8s run %d: %7ss  server cpu %6ss  client cpu %6ss  datagrams/calls %s\n" "$name" "$i" "$wall" \
+			"$(echo "$srv" | awk '{ print $2 + $3 }')" "$(echo "$cli" | awk '{ print $2 + $3 }')" "$calls"
+
+		rm -f "$DIR/output"
+		PORT=$((PORT + 1))
+	done
+
+}
+
+echo "Sending $SIZE_KB KB over loopback in $PAYLOAD-byte packets, $RUNS runs per path"
+
+run single "-b 1"
+run mmsg "-b 32"
+run gso "-b 32 -g"
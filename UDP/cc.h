@@ -0,0 +1,512 @@
+/*
+ * File name: cc.h
+ * Description: Congestion control and pacing for the UDP client. A controller decides how many packets
+ * may be in flight (cwnd) and how fast they go out (the pacing rate); the client tells it about every
+ * packet it sends, every ACK and every packet whose retransmit timer expires. Controllers are picked by
+ * name from cc_algos[], and all of them work in packets, since every packet but the last is full.
+ *
+ *   fixed    no congestion control: the whole window, unpaced (the behaviour before this module)
+ *   newreno  AIMD as in RFC 5681: slow start, one packet per round trip in congestion avoidance, cwnd
+ *            halved once per window of data on loss
+ *   bbr      model-based as in BBR v1: estimates the bottleneck bandwidth (windowed max of delivery
+ *            rate samples) and the minimum RTT, paces at a gain cycle around their product, and does
+ *            not treat random loss as congestion
+ *
+ * The pacer is a token bucket filled at the pacing rate. It holds at most a millisecond worth of
+ * packets (two at least), so sends are spread over time instead of leaving in window-sized bursts,
+ * but a batch can still fill up between two system calls.
+ *
+ * Referencer:
+ * https://tools.ietf.org/html/rfc5681
+ * https://tools.ietf.org/html/rfc6582
+ * https://tools.ietf.org/html/draft-cheng-iccrg-delivery-rate-estimation-01
+ * https://queue.acm.org/detail.cfm?id=3022184
+ * https://tools.ietf.org/html/draft-cardwell-iccrg-bbr-congestion-control-00
+ *
+ */
+
+#ifndef CC_H
+#define CC_H
+
+#include <stdint.h>
+#include <string.h>
+
+
+#define CC_INITIAL_CWND 10 /* packets, RFC 6928 */
+#define CC_MIN_CWND 2
+#define CC_PACING_QUANTUM 0.001 /* seconds of packets the pacer lets out at once */
+
+#define BBR_BW_ROUNDS 10 /* round trips of the bandwidth max filter */
+#define BBR_MIN_RTT_WINDOW 10.0 /* seconds a min RTT sample stays valid */
+#define BBR_PROBE_RTT_TIME 0.2 /* seconds at BBR_MIN_CWND to refresh the min RTT */
+#define BBR_MIN_CWND 4
+#define BBR_HIGH_GAIN 2.885 /* 2/ln(2), doubles the delivery rate every round in startup */
+#define BBR_CYCLE 8
+
+enum bbr_mode {
+	BBR_STARTUP,
+	BBR_DRAIN,
+	BBR_PROBE_BW,
+	BBR_PROBE_RTT
+};
+
+// what the controller remembers about each packet it was told about, kept with the packet
+typedef struct cc_packet {
+	double sent_at;
+	double delivered; // packets delivered when it was sent
+	double delivered_at; // when that count was last raised
+} cc_packet;
+
+typedef struct cc_state cc_state;
+
+typedef struct cc_algo {
+	const char *name;
+	void (*init)(cc_state *cc);
+	void (*on_ack)(cc_state *cc, const cc_packet *p, double rtt, double now); // rtt 0 for a retransmitted packet
+	void (*on_loss)(cc_state *cc, uint32_t seq, uint32_t next_seq, double now); // seq timed out
+} cc_algo;
+
+struct cc_state {
+	const cc_algo *algo;
+
+	double cwnd; // packets allowed in flight
+	double max_cwnd; // the receiver's window, no use growing past it
+	double pacing_rate; // packets per second, 0 for unpaced
+	unsigned inflight; // sent and not yet acknowledged
+	double srtt;
+
+	// delivery rate estimation
+	double delivered;
+	double delivered_at;
+
+	// events, for the reports
+	unsigned long long losses; // packets whose timer expired
+	unsigned long long loss_events; // reductions of cwnd
+
+	// newreno
+	double ssthresh;
+	uint32_t recovery_end; // losses of packets before it belong to the last reduction
+
+	// bbr
+	int mode;
+	double bw[BBR_BW_ROUNDS]; // max delivery rate of each of the last rounds, packets per second
+	double btl_bw;
+	double min_rtt, min_rtt_at;
+	unsigned long long rounds;
+	double next_round_delivered;
+	double full_bw;
+	int full_bw_rounds;
+	int cycle;
+	double cycle_at;
+	double probe_rtt_done;
+	double pacing_gain, cwnd_gain;
+};
+
+// token bucket that spreads sends at the pacing rate
+typedef struct pacer {
+	double tokens; // packets that may go now
+	double last; // when the tokens were last refilled
+} pacer;
+
+
+
+static inline double cc_bdp(const cc_state *cc) {
+
+	return cc->btl_bw * cc->min_rtt;
+
+}
+
+
+
+// keep cwnd at min_cwnd or above, but never beyond the receiver's window
+
+static inline void cc_clamp(cc_state *cc, double min_cwnd) {
+
+	if (cc->cwnd < min_cwnd) {
+		cc->cwnd = min_cwnd;
+	}
+	if (cc->cwnd > cc->max_cwnd) {
+		cc->cwnd = cc->max_cwnd;
+	}
+
+}
+
+
+
+// fixed: the receiver's window, unpaced
+
+static void fixed_init(cc_state *cc) {
+
+	cc->cwnd = cc->max_cwnd;
+	cc->pacing_rate = 0;
+
+}
+
+static void fixed_on_ack(cc_state *cc, const cc_packet *p, double rtt, double now) {
+
+	(void)cc; (void)p; (void)rtt; (void)now;
+
+}
+
+static void fixed_on_loss(cc_state *cc, uint32_t seq, uint32_t next_seq, double now) {
+
+	(void)cc; (void)seq; (void)next_seq; (void)now;
+
+}
+
+
+
+// newreno: slow start, congestion avoidance, multiplicative decrease once per window
+
+static void newreno_pace(cc_state *cc) {
+
+	// twice the current rate in slow start so that it can double, a little above it later (as Linux does)
+	if (cc->srtt > 0) {
+		cc->pacing_rate = (cc->cwnd < cc->ssthresh ? 2.0 : 1.2) * cc->cwnd / cc->srtt;
+	}
+
+}
+
+static void newreno_init(cc_state *cc) {
+
+	cc->cwnd = CC_INITIAL_CWND;
+	cc->ssthresh = 1e9;
+	cc->recovery_end = 0;
+	cc_clamp(cc, 1);
+
+}
+
+static void newreno_on_ack(cc_state *cc, const cc_packet *p, double rtt, double now) {
+
+	(void)p; (void)rtt; (void)now;
+
+	if (cc->cwnd < cc->ssthresh) {
+		cc->cwnd += 1;
+	}
+	else {
+		cc->cwnd += 1 / cc->cwnd;
+	}
+
+	cc_clamp(cc, 1);
+	newreno_pace(cc);
+
+}
+
+static void newreno_on_loss(cc_state *cc, uint32_t seq, uint32_t next_seq, double now) {
+
+	(void)now;
+
+	// the packets lost from one window are one congestion event (RFC 6582)
+	if ((int32_t)(seq - cc->recovery_end) < 0) {
+		return;
+	}
+
+	cc->ssthresh = cc->inflight / 2.0 > CC_MIN_CWND ? cc->inflight / 2.0 : CC_MIN_CWND;
+	cc->cwnd = cc->ssthresh;
+	cc->recovery_end = next_seq;
+	cc->loss_events++;
+
+	cc_clamp(cc, CC_MIN_CWND);
+	newreno_pace(cc);
+
+}
+
+
+
+// bbr: pace at the estimated bottleneck bandwidth, keep about one bandwidth-delay product in flight
+
+static const double bbr_cycle_gain[BBR_CYCLE] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+static void bbr_set(cc_state *cc) {
+
+	if (cc->btl_bw > 0 && cc->min_rtt > 0) {
+		cc->pacing_rate = cc->pacing_gain * cc->btl_bw;
+		cc->cwnd = cc->cwnd_gain * cc_bdp(cc);
+	}
+	else if (cc->srtt > 0) {
+		cc->pacing_rate = cc->pacing_gain * cc->cwnd / cc->srtt;
+	}
+
+	// probe_rtt drains the queue so that the next RTT samples see the bare path
+	if (cc->mode == BBR_PROBE_RTT) {
+		cc->cwnd = BBR_MIN_CWND;
+	}
+
+	cc_clamp(cc, BBR_MIN_CWND);
+
+}
+
+static void bbr_init(cc_state *cc) {
+
+	cc->cwnd = CC_INITIAL_CWND;
+	cc->mode = BBR_STARTUP;
+	cc->pacing_gain = BBR_HIGH_GAIN;
+	cc->cwnd_gain = BBR_HIGH_GAIN;
+	cc->min_rtt = 0;
+	cc->btl_bw = 0;
+	cc_clamp(cc, 1);
+
+}
+
+static void bbr_on_ack(cc_state *cc, const cc_packet *p, double rtt, double now) {
+
+	double interval, rate;
+	int i;
+
+	// a new round trip starts with the ACK of the first packet sent in the current one
+	if (p->delivered >= cc->next_round_delivered) {
+		cc->next_round_delivered = cc->delivered;
+		cc->rounds++;
+		cc->bw[cc->rounds % BBR_BW_ROUNDS] = 0;
+
+		// startup ends when three rounds in a row did not raise the bandwidth by a quarter
+		if (cc->mode == BBR_STARTUP && cc->btl_bw > 0) {
+			if (cc->btl_bw >= cc->full_bw * 1.25) {
+				cc->full_bw = cc->btl_bw;
+				cc->full_bw_rounds = 0;
+			}
+			else if (++cc->full_bw_rounds >= 3) {
+				cc->mode = BBR_DRAIN;
+				cc->pacing_gain = 1 / BBR_HIGH_GAIN;
+				cc->cwnd_gain = BBR_HIGH_GAIN;
+			}
+		}
+	}
+
+	// delivery rate sample: packets delivered between this packet's send and its ACK
+	interval = now - p->delivered_at;
+	if (now - p->sent_at > interval) {
+		interval = now - p->sent_at;
+	}
+	if (interval > 0) {
+		rate = (cc->delivered - p->delivered) / interval;
+		if (rate > cc->bw[cc->rounds % BBR_BW_ROUNDS]) {
+			cc->bw[cc->rounds % BBR_BW_ROUNDS] = rate;
+		}
+	}
+
+	cc->btl_bw = 0;
+	for (i = 0; i < BBR_BW_ROUNDS; i++) {
+		if (cc->bw[i] > cc->btl_bw) {
+			cc->btl_bw = cc->bw[i];
+		}
+	}
+
+	// min RTT, refreshed through probe_rtt once it is too old to trust
+	if (rtt > 0 && (cc->min_rtt == 0 || rtt <= cc->min_rtt || now - cc->min_rtt_at > BBR_MIN_RTT_WINDOW)) {
+		cc->min_rtt = rtt;
+		cc->min_rtt_at = now;
+	}
+
+	// drain ends once the queue startup built is gone (a path shorter than a few packets never gets below them)
+	if (cc->mode == BBR_DRAIN && (cc->inflight <= cc_bdp(cc) || cc->inflight <= BBR_MIN_CWND)) {
+		cc->mode = BBR_PROBE_BW;
+		cc->cycle = 0;
+		cc->cycle_at = now;
+	}
+
+	if (cc->mode == BBR_PROBE_BW && cc->min_rtt > 0 && now - cc->cycle_at > cc->min_rtt) {
+		cc->cycle = (cc->cycle + 1) % BBR_CYCLE;
+		cc->cycle_at = now;
+	}
+
+	if (cc->mode != BBR_PROBE_RTT && cc->mode != BBR_STARTUP && cc->min_rtt > 0 &&
+		now - cc->min_rtt_at > BBR_MIN_RTT_WINDOW) {
+		cc->mode = BBR_PROBE_RTT;
+		cc->probe_rtt_done = now + BBR_PROBE_RTT_TIME;
+	}
+
+	if (cc->mode == BBR_PROBE_RTT && now > cc->probe_rtt_done) {
+		cc->min_rtt_at = now;
+		cc->mode = BBR_PROBE_BW;
+		cc->cycle = 0;
+		cc->cycle_at = now;
+	}
+
+	if (cc->mode == BBR_PROBE_BW) {
+		cc->pacing_gain = bbr_cycle_gain[cc->cycle];
+		cc->cwnd_gain = 2;
+	}
+	else if (cc->mode == BBR_PROBE_RTT) {
+		cc->pacing_gain = 1;
+	}
+
+	bbr_set(cc);
+
+}
+
+static void bbr_on_loss(cc_state *cc, uint32_t seq, uint32_t next_seq, double now) {
+
+	(void)seq; (void)now;
+
+	// the model already reflects what the path delivers, loss only counts once per window
+	if ((int32_t)(seq - cc->recovery_end) >= 0) {
+		cc->recovery_end = next_seq;
+		cc->loss_events++;
+	}
+
+}
+
+
+
+static const cc_algo cc_algos[] = {
+	{ "fixed", fixed_init, fixed_on_ack, fixed_on_loss },
+	{ "newreno", newreno_init, newreno_on_ack, newreno_on_loss },
+	{ "bbr", bbr_init, bbr_on_ack, bbr_on_loss },
+};
+
+#define CC_ALGOS (sizeof cc_algos / sizeof cc_algos[0])
+
+
+
+// set up the controller called name for a receiver window of max_cwnd packets
+// returns -1 for an unknown name
+
+static inline int cc_init(cc_state *cc, const char *name, double max_cwnd, double now) {
+
+	unsigned i;
+
+	memset(cc, 0, sizeof *cc);
+	cc->max_cwnd = max_cwnd;
+	cc->delivered_at = now;
+
+	for (i = 0; i < CC_ALGOS; i++) {
+		if (strcmp(cc_algos[i].name, name) == 0) {
+			cc->algo = &cc_algos[i];
+			cc->algo->init(cc);
+			return 0;
+		}
+	}
+
+	return -1;
+
+}
+
+
+
+// whether one more new packet fits in the congestion window
+
+static inline int cc_can_send(const cc_state *cc) {
+
+	return cc->inflight < cc->cwnd;
+
+}
+
+
+
+// a packet goes out; a retransmit is already counted in flight
+
+static inline void cc_sent(cc_state *cc, cc_packet *p, int retransmit, double now) {
+
+	if (!retransmit) {
+		cc->inflight++;
+	}
+
+	// nothing in flight: the delivery rate clock restarts instead of counting the idle time
+	if (cc->inflight == 1 && !retransmit) {
+		cc->delivered_at = now;
+	}
+
+	p->sent_at = now;
+	p->delivered = cc->delivered;
+	p->delivered_at = cc->delivered_at;
+
+}
+
+
+
+// a packet is acknowledged for the first time, rtt is its sample (0 when Karn's rule rules it out)
+
+static inline void cc_acked(cc_state *cc, const cc_packet *p, double rtt, double srtt, double now) {
+
+	cc->inflight--;
+	cc->delivered++;
+	cc->delivered_at = now;
+	cc->srtt = srtt;
+
+	cc->algo->on_ack(cc, p, rtt, now);
+
+}
+
+
+
+// the retransmit timer of packet seq expired, next_seq is the first packet not sent yet
+
+static inline void cc_lost(cc_state *cc, uint32_t seq, uint32_t next_seq, double now) {
+
+	cc->losses++;
+
+	cc->algo->on_loss(cc, seq, next_seq, now);
+
+}
+
+
+
+static inline const char *cc_mode(const cc_state *cc) {
+
+	static const char *modes[] = { "startup", "drain", "probe_bw", "probe_rtt" };
+
+	if (cc->algo->on_ack == bbr_on_ack) {
+		return modes[cc->mode];
+	}
+	if (cc->algo->on_ack == newreno_on_ack) {
+		return cc->cwnd < cc->ssthresh ? "slow start" : "congestion avoidance";
+	}
+
+	return "-";
+
+}
+
+
+
+// refill the bucket; returns 1 when a packet may go now
+
+static inline int pacer_ready(pacer *pc, const cc_state *cc, double now) {
+
+	double burst;
+
+	if (cc->pacing_rate <= 0) {
+		return 1;
+	}
+
+	burst = cc->pacing_rate * CC_PACING_QUANTUM;
+	if (burst < 2) {
+		burst = 2;
+	}
+
+	pc->tokens += (now - pc->last) * cc->pacing_rate;
+	if (pc->tokens > burst) {
+		pc->tokens = burst;
+	}
+	pc->last = now;
+
+	return pc->tokens >= 1;
+
+}
+
+
+
+static inline void pacer_sent(pacer *pc, const cc_state *cc) {
+
+	if (cc->pacing_rate > 0) {
+		pc->tokens -= 1;
+	}
+
+}
+
+
+
+// when the next packet may go, now if it already may
+
+static inline double pacer_next(const pacer *pc, const cc_state *cc, double now) {
+
+	if (cc->pacing_rate <= 0 || pc->tokens >= 1) {
+		return now;
+	}
+
+	return now + (1 - pc->tokens) / cc->pacing_rate;
+
+}
+
+
+#endif
@@ -0,0 +1,479 @@
+/*
+ * File name: checksum.h
+ * Description: The packet checksums shared by the UDP client and server, with kernels picked at run time
+ * for the CPU the program runs on.
+ *
+ *   inet    the Internet checksum (RFC 1071): the ones' complement of the ones' complement sum of the
+ *           16-bit words of the buffer, in host byte order as the original checksum() added them
+ *   crc32c  CRC-32C (Castagnoli), as in iSCSI and SCTP: catches every burst of up to 32 flipped bits and
+ *           the reordered words that a ones' complement sum cannot see
+ *
+ * The ones' complement sum does not care in which order or in which word size the data is added, as long
+ * as the carries are folded back in at the end (2^16 = 1 modulo 0xffff). The vector kernels add the buffer
+ * as 32-bit words into 64-bit lanes, 16, 32 or 64 bytes per instruction with SSE2, AVX2 or AVX-512, which
+ * cannot overflow for any buffer the programs handle, and fold the lanes to 16 bits once at the end; what
+ * is left after the last full loop goes to the next narrower kernel. The CRC kernel uses the SSE4.2 crc32
+ * instruction, 8 bytes at a time. Each one has a portable scalar version that gives the same result.
+ *
+ * Every kernel is compiled with its own target attribute, so the programs build with plain gcc and no
+ * -m flags; checksum_init() asks the CPU which ones it can run and picks the fastest of each kind.
+ *
+ * A packet whose header and data are apart in memory (the client sends the data from the mapped file)
+ * is summed in two pieces: the two ones' complement sums simply add, as the header is an even number of
+ * bytes, and the CRC of the whole is made from the CRCs of the pieces as zlib's crc32_combine() does,
+ * by shifting the first one over the length of the second (multiplying by x^(8 * length)).
+ *
+ * Referencer:
+ * https://tools.ietf.org/html/rfc1071
+ * https://locklessinc.com/articles/tcp_checksum/
+ * https://tools.ietf.org/html/rfc3720#appendix-B.4
+ * https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html
+ * https://gcc.gnu.org/onlinedocs/gcc/x86-Built-in-Functions.html
+ * https://github.com/madler/zlib/blob/master/crc32.c
+ *
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86 1
+#endif
+
+
+#define CRC32C_POLY 0x82f63b78 /* reflected Castagnoli polynomial */
+
+enum checksum_kind {
+	CHECKSUM_INET,
+	CHECKSUM_CRC32C
+};
+
+// a kernel returns the ones' complement sum folded to 16 bits (inet) or the finished CRC (crc32c)
+typedef uint32_t (*checksum_fn)(const void *buf, size_t size);
+
+typedef struct checksum_kernel {
+	const char *name;
+	int kind;
+	checksum_fn fn;
+	const char *cpu; // feature it needs (for __builtin_cpu_supports), NULL for the scalar ones
+} checksum_kernel;
+
+static uint32_t crc32c_table[256];
+static uint32_t crc32c_x2n_table[32]; // x^(2^n) modulo the polynomial, for crc32c_combine()
+
+// the kernels in use, set by checksum_init()
+static checksum_fn inet_sum_fn, crc32c_fn;
+
+
+
+// fold a 64-bit sum of 16- or 32-bit words to a 16-bit ones' complement sum
+
+static inline uint32_t inet_fold(uint64_t sum) {
+
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+
+	return (uint32_t)sum;
+
+}
+
+
+
+// the last few bytes, as the reference adds them: 16-bit words, then an odd byte on its own
+
+static inline uint64_t inet_tail(const unsigned char *p, size_t size) {
+
+	uint64_t sum = 0;
+	uint16_t word16;
+
+	for (; size >= 2; p += 2, size -= 2) {
+		memcpy(&word16, p, 2);
+		sum += word16;
+	}
+	if (size) {
+		sum += *p;
+	}
+
+	return sum;
+
+}
+
+
+
+// the reference: one 16-bit word at a time (memcpy instead of an unaligned pointer cast)
+
+static uint32_t inet_sum_scalar(const void *buf, size_t size) {
+
+	return inet_fold(inet_tail(buf, size));
+
+}
+
+
+
+// 32-bit words into a 64-bit sum, without vectors
+
+static uint32_t inet_sum_word64(const void *buf, size_t size) {
+
+	const unsigned char *p = buf;
+	uint64_t sum = 0;
+	uint32_t word32;
+
+	for (; size >= 4; p += 4, size -= 4) {
+		memcpy(&word32, p, 4);
+		sum += word32;
+	}
+
+	return inet_fold(sum + inet_tail(p, size));
+
+}
+
+
+#ifdef CHECKSUM_X86
+
+// the 64-bit lanes of a vector sum
+#define INET_LANES(type, v, lanes, sum) do { \
+	uint64_t lane_[lanes]; \
+	int l_; \
+	memcpy(lane_, &(v), sizeof(type)); \
+	for (l_ = 0; l_ < (lanes); l_++) { \
+		(sum) += lane_[l_]; \
+	} \
+} while (0)
+
+__attribute__((target("sse2")))
+static uint32_t inet_sum_sse2(const void *buf, size_t size) {
+
+	const unsigned char *p = buf;
+	__m128i zero = _mm_setzero_si128(), a = zero, b = zero, v;
+	uint64_t sum = 0;
+
+	// the 32-bit words of 16 bytes, zero-extended into two 64-bit lanes each
+	for (; size >= 32; p += 32, size -= 32) {
+		v = _mm_loadu_si128((const __m128i *)p);
+		a = _mm_add_epi64(a, _mm_unpacklo_epi32(v, zero));
+		b = _mm_add_epi64(b, _mm_unpackhi_epi32(v, zero));
+		v = _mm_loadu_si128((const __m128i *)(p + 16));
+		a = _mm_add_epi64(a, _mm_unpacklo_epi32(v, zero));
+		b = _mm_add_epi64(b, _mm_unpackhi_epi32(v, zero));
+	}
+
+	a = _mm_add_epi64(a, b);
+	INET_LANES(__m128i, a, 2, sum);
+
+	return inet_fold(sum + inet_sum_word64(p, size));
+
+}
+
+
+
+__attribute__((target("avx2")))
+static uint32_t inet_sum_avx2(const void *buf, size_t size) {
+
+	const unsigned char *p = buf;
+	__m256i zero = _mm256_setzero_si256(), a = zero, b = zero, v;
+	uint64_t sum = 0;
+
+	for (; size >= 64; p += 64, size -= 64) {
+		v = _mm256_loadu_si256((const __m256i *)p);
+		a = _mm256_add_epi64(a, _mm256_unpacklo_epi32(v, zero));
+		b = _mm256_add_epi64(b, _mm256_unpackhi_epi32(v, zero));
+		v = _mm256_loadu_si256((const __m256i *)(p + 32));
+		a = _mm256_add_epi64(a, _mm256_unpacklo_epi32(v, zero));
+		b = _mm256_add_epi64(b, _mm256_unpackhi_epi32(v, zero));
+	}
+
+	a = _mm256_add_epi64(a, b);
+	INET_LANES(__m256i, a, 4, sum);
+
+	// gcc leaves out the vzeroupper of target("avx") functions, and the SSE code after them stalls
+	_mm256_zeroupper();
+
+	// less than a loop's worth left for the narrower kernel
+	return inet_fold(sum + inet_sum_sse2(p, size));
+
+}
+
+
+
+__attribute__((target("avx512f")))
+static uint32_t inet_sum_avx512(const void *buf, size_t size) {
+
+	const unsigned char *p = buf;
+	__m512i zero = _mm512_setzero_si512(), a = zero, b = zero, v;
+	uint64_t sum = 0;
+
+	for (; size >= 128; p += 128, size -= 128) {
+		v = _mm512_loadu_si512((const void *)p);
+		a = _mm512_add_epi64(a, _mm512_unpacklo_epi32(v, zero));
+		b = _mm512_add_epi64(b, _mm512_unpackhi_epi32(v, zero));
+		v = _mm512_loadu_si512((const void *)(p + 64));
+		a = _mm512_add_epi64(a, _mm512_unpacklo_epi32(v, zero));
+		b = _mm512_add_epi64(b, _mm512_unpackhi_epi32(v, zero));
+	}
+
+	a = _mm512_add_epi64(a, b);
+	INET_LANES(__m512i, a, 8, sum);
+	_mm256_zeroupper();
+
+	return inet_fold(sum + inet_sum_avx2(p, size));
+
+}
+
+#endif
+
+
+
+// the reference CRC: one byte at a time through a table
+
+static uint32_t crc32c_scalar(const void *buf, size_t size) {
+
+	const unsigned char *p = buf;
+	uint32_t crc = 0xffffffff;
+
+	while (size--) {
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+
+	return ~crc;
+
+}
+
+
+#ifdef CHECKSUM_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(const void *buf, size_t size) {
+
+	const unsigned char *p = buf;
+	uint64_t crc = 0xffffffff, word64;
+
+	for (; size >= 8; p += 8, size -= 8) {
+		memcpy(&word64, p, 8);
+		crc = _mm_crc32_u64(crc, word64);
+	}
+	while (size--) {
+		crc = _mm_crc32_u8((uint32_t)crc, *p++);
+	}
+
+	return ~(uint32_t)crc;
+
+}
+
+#endif
+
+
+// fastest last within each kind; checksum_init() takes the last one the CPU supports
+static const checksum_kernel checksum_kernels[] = {
+	{ "inet scalar", CHECKSUM_INET, inet_sum_scalar, NULL },
+	{ "inet word64", CHECKSUM_INET, inet_sum_word64, NULL },
+#ifdef CHECKSUM_X86
+	{ "inet sse2", CHECKSUM_INET, inet_sum_sse2, "sse2" },
+	{ "inet avx2", CHECKSUM_INET, inet_sum_avx2, "avx2" },
+	{ "inet avx512", CHECKSUM_INET, inet_sum_avx512, "avx512f" },
+#endif
+	{ "crc32c scalar", CHECKSUM_CRC32C, crc32c_scalar, NULL },
+#ifdef CHECKSUM_X86
+	{ "crc32c sse4.2", CHECKSUM_CRC32C, crc32c_sse42, "sse4.2" },
+#endif
+};
+
+#define CHECKSUM_KERNELS (sizeof checksum_kernels / sizeof checksum_kernels[0])
+
+
+
+// a times b modulo the polynomial, both reflected
+
+static inline uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+
+	uint32_t m = (uint32_t)1 << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+
+	return p;
+
+}
+
+
+
+// the CRC of a buffer of size1 bytes followed by one of size2 bytes, from the CRCs of the two
+
+static inline uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t size2) {
+
+	uint32_t p = (uint32_t)1 << 31; // x^0
+	unsigned k = 3; // x^(8 * size2) = x^(2^3 * size2)
+
+	for (; size2 > 0; size2 >>= 1, k++) {
+		if (size2 & 1) {
+			p = crc32c_multmodp(crc32c_x2n_table[k & 31], p);
+		}
+	}
+
+	return crc32c_multmodp(p, crc1) ^ crc2;
+
+}
+
+
+
+// whether this CPU runs a kernel (__builtin_cpu_supports only takes string literals)
+
+static inline int checksum_supported(const checksum_kernel *k) {
+
+	if (k->cpu == NULL) {
+		return 1;
+	}
+
+#ifdef CHECKSUM_X86
+	__builtin_cpu_init();
+
+	if (strcmp(k->cpu, "sse2") == 0) {
+		return __builtin_cpu_supports("sse2");
+	}
+	if (strcmp(k->cpu, "avx2") == 0) {
+		return __builtin_cpu_supports("avx2");
+	}
+	if (strcmp(k->cpu, "avx512f") == 0) {
+		return __builtin_cpu_supports("avx512f");
+	}
+	if (strcmp(k->cpu, "sse4.2") == 0) {
+		return __builtin_cpu_supports("sse4.2");
+	}
+#endif
+
+	return 0;
+
+}
+
+
+
+// build the CRC tables and pick the kernels
+
+static void checksum_setup(void) {
+
+	uint32_t crc;
+	unsigned i, b;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (b = 0; b < 8; b++) {
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32c_table[i] = crc;
+	}
+
+	crc = (uint32_t)1 << 30; // x^1
+	crc32c_x2n_table[0] = crc;
+	for (i = 1; i < 32; i++) {
+		crc32c_x2n_table[i] = crc = crc32c_multmodp(crc, crc);
+	}
+
+	for (i = 0; i < CHECKSUM_KERNELS; i++) {
+		if (!checksum_supported(&checksum_kernels[i])) {
+			continue;
+		}
+		if (checksum_kernels[i].kind == CHECKSUM_INET) {
+			inet_sum_fn = checksum_kernels[i].fn;
+		}
+		else {
+			crc32c_fn = checksum_kernels[i].fn;
+		}
+	}
+
+}
+
+
+
+// set up once, whichever thread gets here first; the server's workers checksum from several threads,
+// and none of them may see a kernel picked before the tables are built
+
+static inline void checksum_init(void) {
+
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, checksum_setup);
+
+}
+
+
+
+// name of the kernel in use for a kind
+
+static inline const char *checksum_kernel_name(int kind) {
+
+	unsigned i;
+
+	checksum_init();
+
+	for (i = 0; i < CHECKSUM_KERNELS; i++) {
+		if (checksum_kernels[i].fn == (kind == CHECKSUM_INET ? inet_sum_fn : crc32c_fn)) {
+			return checksum_kernels[i].name;
+		}
+	}
+
+	return "none";
+
+}
+
+
+
+// the Internet checksum of a buffer, in host byte order like the words it adds
+
+static inline uint16_t inet_checksum(const void *buf, size_t size) {
+
+	checksum_init();
+
+	return (uint16_t)~inet_sum_fn(buf, size);
+
+}
+
+
+
+static inline uint32_t crc32c(const void *buf, size_t size) {
+
+	checksum_init();
+
+	return crc32c_fn(buf, size);
+
+}
+
+
+
+// the same over a header of an even number of bytes and the data after it, wherever the two are
+
+static inline uint16_t inet_checksum_split(const void *head, size_t head_size, const void *data, size_t size) {
+
+	checksum_init();
+
+	return (uint16_t)~inet_fold((uint64_t)inet_sum_fn(head, head_size) + inet_sum_fn(data, size));
+
+}
+
+
+
+static inline uint32_t crc32c_split(const void *head, size_t head_size, const void *data, size_t size) {
+
+	checksum_init();
+
+	return crc32c_combine(crc32c_fn(head, head_size), crc32c_fn(data, size), size);
+
+}
+
+
+#endif
@@ -1,13 +1,67 @@
-/* 
+/*
  * Author: Chi Zhang (czhang2@scu.edu)
  * File name: client.c
  * Description: The file builds the client side of UDP (User Datagram Protocol). The client reads a text
- * file and sends the file content to the server in chunks of 10 bytes. After every chunk is sent, the client
- * waits for an acknowledgement from the server. If the ackowledge received is not correct, the client repeats
- * sending the chunk until it's correct.
+ * file and sends the file content to the server in packets as large as the path carries.
  *
- * Random functions are used to create the scenarios where the data is lost, erred, or duplicated
- * in order to test the program's ability to resolve these situations and sends a correct file.
+ * Before the transfer the client looks for the largest datagram that crosses the path without being
+ * fragmented (packetization layer path MTU discovery): the route MTU the kernel knows is the upper
+ * bound, and probes with the don't-fragment bit set, echoed by the server, search down from there to
+ * a size that every IPv4 path carries. -p lowers the upper bound. Packet 0 then proposes the payload
+ * size and the window to the server, which answers with the values both sides use. Packets are
+ * variable-length, so the last one carries only what is left of the file.
+ *
+ * The transfer uses selective repeat: every packet carries a 32-bit sequence number (0 opens the
+ * session, then the data, then an empty end packet), and up to a window of packets (-w, 32 by default) are
+ * in flight at once. The server's selective ACKs carry a cumulative ACK and a bitmap of the packets
+ * it holds beyond it; every unacknowledged packet has its own retransmit timer, and only the holes
+ * are sent again. A hole is resent before its timer expires once a packet sent a quarter of an RTT
+ * after it has been acknowledged (the RACK rule), since the copy in the hole was lost or is no longer
+ * worth waiting for.
+ *
+ * The retransmit timeout follows the measured round trip time (RFC 6298): every ACK of a packet that
+ * was sent only once is an RTT sample (Karn's rule skips retransmitted ones), feeding a smoothed RTT
+ * and RTT variance from which RTO = SRTT + 4 * RTTVAR, clamped to [RTO_MIN, RTO_MAX]. Each timeout
+ * of a packet doubles the timer of that packet only, so a few unlucky packets do not stall the
+ * whole window. The current values are reported once a second.
+ *
+ * A congestion controller (cc.h, picked with -c, newreno by default) limits the packets in flight to
+ * its congestion window within the agreed window, and a pacer spreads the sends at the controller's
+ * pacing rate instead of sending a whole window at once. An expired retransmit timer is a loss event
+ * for the controller. Its window, pacing rate and losses are reported with the RTT.
+ *
+ * Datagrams move in batches: the packets that fill the window and the retransmits that fall due
+ * together go out with one sendmmsg() call, and the ACKs that have arrived are taken with one
+ * recvmmsg() call, up to -b datagrams (32 by default) per system call. With -g a batch is instead
+ * handed to the kernel as one buffer with UDP_SEGMENT (GSO), which cuts it into one datagram per
+ * packet; every segment is a whole packet with its own header. Without kernel support the client
+ * stays with sendmmsg().
+ *
+ * The file is not copied into the packets: it is mapped (../common/reader.h), a packet in the window
+ * is only its header and a pointer to its data in the mapping, and every datagram goes to the kernel as
+ * two pieces, header and data, also in a GSO send. A retransmit sends the same two pieces again. The
+ * mapping advances in windows as the packets are acknowledged, so a file larger than memory takes no
+ * more than the windows the send window spans. Only a packet that goes through -i is copied, to be
+ * damaged on its own.
+ *
+ * With -f K:M every block of K data packets is followed by M parity packets (fec.h): XOR parity with
+ * M = 1, Reed-Solomon parity beyond, from which the server rebuilds up to M lost packets of the block
+ * without waiting for a retransmit. The parity packets are paced but stay out of the window and the
+ * congestion window, and are never resent. The server decides whether FEC is used.
+ *
+ * To test the program's ability to resolve lost, damaged, duplicated, reordered and late packets and
+ * still deliver a correct file, -i sends the packets through a simulated unreliable channel (impair.h)
+ * with the loss, corruption, duplication, reordering and delay it describes, drawn from a seeded
+ * generator so that a run can be repeated. Without -i the packets go to the socket as they are.
+ *
+ * The transfer is counted as it goes (../common/metrics.h): datagrams and bytes sent, data packets,
+ * acknowledged bytes (the goodput), retransmits on a timeout and on a SACK, ACKs, parity packets and
+ * a histogram of the RTT samples. With -l they go to a JSON line log once a second and at the end.
+ *
+ * The transfer prints through ../common/log.h, which copies the arguments of a log site into a ring
+ * and leaves the formatting and printing to a background thread. Every packet sent and ACK taken is
+ * traced at the trace level, rejected ACKs and retransmits at debug, and the RTT and congestion
+ * reports at info, the default of -v.
  *
  * Referencer:
  * Socket Programming in C
@@ -15,61 +69,769 @@
  * http://stackoverflow.com/questions/10527187/reading-and-writing-in-chunks-on-linux-using-c
  * http://stackoverflow.com/questions/13837868/getting-or-symbol-when-reading-from-text-file-with-fread
  * http://stackoverflow.com/questions/13547721/udp-socket-set-timeout
+ * http://man7.org/linux/man-pages/man2/sendmmsg.2.html
+ * https://lwn.net/Articles/752184/
+ * https://tools.ietf.org/html/rfc8899
+ * https://tools.ietf.org/html/rfc5681
+ * https://tools.ietf.org/html/rfc2018
+ * https://tools.ietf.org/html/rfc8985
+ * http://man7.org/linux/man-pages/man7/ip.7.html
+ * https://tools.ietf.org/html/rfc5510
+ * https://man7.org/linux/man-pages/man8/tc-netem.8.html
+ * https://man7.org/linux/man-pages/man2/mmap.2.html
+ * https://jsonlines.org/
  *
  */
 
 
+#define _GNU_SOURCE /* sendmmsg, recvmmsg */
 
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/select.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/random.h>
+
+#include "proto.h"
+#include "cc.h"
+#include "fec.h"
+#include "impair.h"
+#include "../common/metrics.h"
+#include "../common/log.h"
+#include "../common/reader.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 /* linux/udp.h, missing from older libc headers */
+#endif
+
+
+#define DEFAULT_WINDOW 32 /* packets in flight */
+#define DEFAULT_CC "newreno"
+#define MAX_WINDOW 4096
+#define MAX_SENDS 50 /* give up on a packet after this many tries */
+
+#define DEFAULT_BATCH 32 /* datagrams per sendmmsg/recvmmsg call */
+#define MAX_BATCH 1024
+#define MAX_SEGMENTS 64 /* datagrams the kernel cuts out of one GSO send (UDP_MAX_SEGMENTS) */
+
+#define RTO_INITIAL 1.0 /* seconds before an unacknowledged packet is sent again, until the first RTT sample */
+#define RTO_MIN 0.005 /* a LAN round trip is far below a millisecond, leave room for scheduling delays */
+#define RTO_MAX 2.0 /* keeps the backed-off retries of the end packet within the server's linger time */
+#define RTO_GRANULARITY 0.0001 /* clock granularity G of RFC 6298 */
+
+#define PROBE_TRIES 3 /* a probe size that is not echoed after this many tries does not cross the path */
+#define ACK_BUF (PACK_HDR + SAFE_PAYLOAD) /* receive room for any acknowledgment */
+
+// a packet in the send window, kept until it is acknowledged
+typedef struct tx_slot
+{
+	udp_pack *packet; // its header as sent, ready for a retransmit
+	const char *data; // its len bytes of data, in the mapped file
+	double sent_at; // last transmission, for the RTT sample
+	double deadline; // when to send it again
+	int sends;
+	int acked;
+	int fast; // marked for a resend by a SACK, before its timer expired
+	cc_packet cc; // what the congestion controller noted when it was last sent
+}tx_slot;
+
+// round trip time estimate and the retransmit timeout derived from it (seconds)
+typedef struct rtt_estimator
+{
+	double srtt;
+	double rttvar;
+	double rto;
+	double last; // latest sample
+	unsigned long long samples;
+}rtt_estimator;
 
 
-#define CHUNK 10 /* read 10 bytes at a time */
-
-typedef struct udp_pack
+// datagrams for one sendmmsg() or recvmmsg() call, allocated once and reused
+typedef struct dgram_batch
 {
-	int seq_num;
-	short checksum;
-	char data[CHUNK];
-}udp_pack;
+	char *bufs; // one buffer of buf_size bytes per datagram, back to back
+	size_t buf_size;
+	struct sockaddr_in *addrs;
+	struct iovec *iov; // two per datagram: its buffer (or a packet header) and the data of the file, if apart
+	struct mmsghdr *msgs;
+	int count; // datagrams queued
+	int size; // datagrams per call
+	int gso; // send through UDP_SEGMENT instead of sendmmsg()
+	unsigned long long calls, datagrams; // system calls made and datagrams moved
+}dgram_batch;
+
+// what the transfer counts (metrics.h)
+enum {
+	M_DATAGRAMS, M_BYTES, M_PACKETS, M_ACKED, M_RETRANSMITS, M_TIMEOUTS, M_SACK_RETRANSMITS, M_ACKS,
+	M_BAD_ACKS, M_PARITY, M_PROBES, M_COUNT
+};
+enum { H_RTT, H_COUNT };
+
+const metric_def counter_defs[M_COUNT] = {
+	[M_DATAGRAMS] = { "datagrams_sent_total", "Packets handed to the socket, before any impairment" },
+	[M_BYTES] = { "sent_bytes_total", "Bytes of the packets sent, headers included" },
+	[M_PACKETS] = { "data_packets_sent_total", "Data packets sent for the first time" },
+	[M_ACKED] = { "acked_bytes_total", "File bytes acknowledged by the server (goodput)" },
+	[M_RETRANSMITS] = { "retransmits_total", "Packets sent again" },
+	[M_TIMEOUTS] = { "rto_timeouts_total", "Retransmits after the packet's timer expired" },
+	[M_SACK_RETRANSMITS] = { "sack_retransmits_total", "Holes resent early on a SACK (RACK)" },
+	[M_ACKS] = { "acks_received_total", "ACKs received" },
+	[M_BAD_ACKS] = { "bad_acks_total", "ACKs with a wrong length, checksum, session or type" },
+	[M_PARITY] = { "parity_packets_sent_total", "FEC parity packets sent" },
+	[M_PROBES] = { "probes_sent_total", "Path MTU probes sent" },
+};
+
+const metric_def hist_defs[H_COUNT] = {
+	[H_RTT] = { "rtt_seconds", "Round trip time samples" },
+};
+
+
+
+double now_seconds(void) {
+
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1e6;
+
+}
 
 
-// https://locklessinc.com/articles/tcp_checksum/
-unsigned short checksum(const char *buf, unsigned size)
-{
-	unsigned sum = 0;
+
+// feed one RTT sample into the estimator (RFC 6298 section 2)
+
+void rtt_sample(rtt_estimator *e, double r) {
+
+	double err;
+
+	if (e->samples == 0) {
+		e->srtt = r;
+		e->rttvar = r / 2;
+	}
+	else {
+		err = e->srtt - r;
+		e->rttvar = 0.75 * e->rttvar + 0.25 * (err < 0 ? -err : err);
+		e->srtt = 0.875 * e->srtt + 0.125 * r;
+	}
+
+	e->last = r;
+	e->samples++;
+	metric_observe(H_RTT, r);
+
+	e->rto = e->srtt + (4 * e->rttvar > RTO_GRANULARITY ? 4 * e->rttvar : RTO_GRANULARITY);
+
+	if (e->rto < RTO_MIN) {
+		e->rto = RTO_MIN;
+	}
+	if (e->rto > RTO_MAX) {
+		e->rto = RTO_MAX;
+	}
+
+}
+
+
+
+// timer of a packet that has been sent 'sends' times: the RTO doubled for every timeout (RFC 6298 section 5.5)
+
+double rtt_timeout(const rtt_estimator *e, int sends) {
+
+	double rto = e->rto;
+
+	while (--sends > 0 && rto < RTO_MAX) {
+		rto *= 2;
+	}
+
+	return rto < RTO_MAX ? rto : RTO_MAX;
+
+}
+
+
+
+// allocate a batch of size datagrams of up to buf_size bytes (plus room for a duplicate on top of a full batch)
+
+void batch_init(dgram_batch *b, int size, size_t buf_size) {
+
 	int i;
 
-	/* Accumulate checksum */
-	for (i = 0; i < size - 1; i += 2)
-	{
-		unsigned short word16 = *(unsigned short *) &buf[i];
-		sum += word16;
+	bzero(b, sizeof *b);
+	b->size = size;
+	b->buf_size = buf_size;
+	b->bufs = calloc(size + 1, buf_size);
+	b->addrs = calloc(size + 1, sizeof *b->addrs);
+	b->iov = calloc(2 * (size + 1), sizeof *b->iov);
+	b->msgs = calloc(size + 1, sizeof *b->msgs);
+
+	if (b->bufs == NULL || b->addrs == NULL || b->iov == NULL || b->msgs == NULL) {
+		printf("ERROR: out of memory\n");
+		exit(1);
 	}
 
-	/* Handle odd-sized case */
-	if (size & 1)
-	{
-		unsigned short word16 = (unsigned char) buf[i];
-		sum += word16;
+	for (i = 0; i <= size; i++) {
+		b->iov[2 * i].iov_base = b->bufs + i * buf_size;
+		b->iov[2 * i].iov_len = buf_size;
+		b->msgs[i].msg_hdr.msg_iov = &b->iov[2 * i];
+		b->msgs[i].msg_hdr.msg_iovlen = 2;
+		b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+		b->msgs[i].msg_hdr.msg_namelen = sizeof b->addrs[i];
 	}
 
-	/* Fold to get the ones-complement result */
-	while (sum >> 16) sum = (sum & 0xFFFF)+(sum >> 16);
+}
+
+
+
+// bytes of queued datagram i
+
+static inline size_t batch_len(const dgram_batch *b, int i) {
+
+	return b->iov[2 * i].iov_len + b->iov[2 * i + 1].iov_len;
 
-	/* Invert to get the negative in ones-complement arithmetic */
-	return ~sum;
 }
 
 
+
+// send datagrams [first, first + n) as one buffer that the kernel cuts into packets (GSO)
+// all but the last fill a segment of the buffer size, so their iovecs, headers and data in
+// turn, simply make up the buffer, and the segment size is the buffer size
+
+int batch_send_gso(dgram_batch *b, int sock, int first, int n) {
+
+	struct msghdr msg;
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+	struct cmsghdr *cmsg;
+
+	bzero(&msg, sizeof msg);
+	bzero(control, sizeof control);
+	msg.msg_name = &b->addrs[first];
+	msg.msg_namelen = sizeof b->addrs[first];
+	msg.msg_iov = &b->iov[2 * first];
+	msg.msg_iovlen = 2 * n;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	*(uint16_t *)CMSG_DATA(cmsg) = b->buf_size;
+
+	return sendmsg(sock, &msg, 0) < 0 ? -1 : 0;
+
+}
+
+
+
+// whether the kernel can segment UDP sends of seg bytes on this socket
+
+int gso_supported(int sock, int seg) {
+
+	int off = 0;
+
+	if (setsockopt(sock, SOL_UDP, UDP_SEGMENT, &seg, sizeof seg) < 0) {
+		return 0;
+	}
+
+	// the size goes with every send instead, so that the sendmmsg() fallback is not segmented
+	setsockopt(sock, SOL_UDP, UDP_SEGMENT, &off, sizeof off);
+
+	return 1;
+
+}
+
+
+
+// send every queued datagram, as few sendmmsg() or GSO calls as the kernel allows
+
+int batch_flush(dgram_batch *b, int sock) {
+
+	int sent = 0, n, max_segments;
+
+	// one GSO send is at most one IPv4 datagram long
+	max_segments = MAX_DATAGRAM / b->buf_size;
+	if (max_segments > MAX_SEGMENTS) {
+		max_segments = MAX_SEGMENTS;
+	}
+	if (max_segments < 1) {
+		max_segments = 1;
+	}
+
+	while (sent < b->count) {
+
+		if (b->gso) {
+			// a run of full packets, a shorter one can only end it
+			n = 1;
+			while (sent + n < b->count && n < max_segments && batch_len(b, sent + n - 1) == b->buf_size) {
+				n++;
+			}
+
+			if (batch_send_gso(b, sock, sent, n) < 0) {
+				// a pending ICMP error of the connected socket, the send itself did not happen
+				if (errno == ECONNREFUSED) {
+					continue;
+				}
+
+				// a device without checksum offload rejects segmentation, stay with sendmmsg()
+				log_msg(LOG_WARN, "GSO send failed (%s), falling back to sendmmsg\n", strerror(errno));
+				b->gso = 0;
+				continue;
+			}
+		}
+		else {
+			n = sendmmsg(sock, &b->msgs[sent], b->count - sent, 0);
+			if (n < 0 && errno == ECONNREFUSED) {
+				continue;
+			}
+			if (n < 0) {
+				return -1;
+			}
+		}
+
+		sent += n;
+		b->calls++;
+	}
+
+	b->datagrams += b->count;
+	b->count = 0;
+
+	return 0;
+
+}
+
+
+
+// take up to a batch of datagrams that have arrived (flags MSG_DONTWAIT or MSG_WAITFORONE)
+// returns the number received, msgs[i].msg_len holds the length of datagram i
+
+int batch_recv(dgram_batch *b, int sock, int flags) {
+
+	int i, n;
+
+	for (i = 0; i < b->size; i++) {
+		b->msgs[i].msg_hdr.msg_namelen = sizeof b->addrs[i];
+		b->msgs[i].msg_len = 0;
+	}
+
+	n = recvmmsg(sock, b->msgs, b->size, flags, NULL);
+	if (n > 0) {
+		b->calls++;
+		b->datagrams += n;
+	}
+
+	return n;
+
+}
+
+
+
+// queue a packet to des_addr, through the impairment when there is one; its data is at data (in the
+// mapped file, where the window points), or in the packet itself when data is NULL
+
+int queue_packet(dgram_batch *b, int des_sock, udp_pack *packet, const char *data, struct sockaddr_in *des_addr,
+	impairment *im) {
+
+	char *wire = b->bufs + b->count * b->buf_size;
+	size_t size = PACK_SIZE(packet);
+	int copies = 1, i;
+
+	log_msg(LOG_TRACE, "sending packages!\n");
+
+	metric_add(M_DATAGRAMS, 1);
+	metric_add(M_BYTES, size);
+
+	// the kernel takes the header from the window and the data from the page cache, nothing is copied;
+	// the window and the file stay as they are until the batch goes out
+	if (data != NULL && !im->on) {
+		b->iov[2 * b->count].iov_base = packet;
+		b->iov[2 * b->count].iov_len = PACK_HDR;
+		b->iov[2 * b->count + 1].iov_base = (void *)data;
+		b->iov[2 * b->count + 1].iov_len = size - PACK_HDR;
+		b->addrs[b->count++] = *des_addr;
+	}
+	else {
+		// a packet that does not last (the parity), or one the impairment damages: work on a copy in
+		// the batch, the window keeps the correct packet for the retransmits
+		memcpy(wire, packet, PACK_HDR);
+		memcpy(wire + PACK_HDR, data != NULL ? data : packet->data, size - PACK_HDR);
+
+		if (im->on) {
+			copies = impair_datagram(im, wire, size, des_addr, now_seconds());
+		}
+
+		// queue the packet, twice for a duplicate
+		for (i = 0; i < copies; i++) {
+			if (i > 0) {
+				memcpy(b->bufs + b->count * b->buf_size, wire, size);
+			}
+			b->iov[2 * b->count].iov_base = b->bufs + b->count * b->buf_size;
+			b->iov[2 * b->count].iov_len = size;
+			b->iov[2 * b->count + 1].iov_len = 0;
+			b->addrs[b->count++] = *des_addr;
+		}
+	}
+
+	if (copies == 0) {
+		return 0;
+	}
+
+	log_msg(LOG_TRACE, "Package %u sent (%u bytes)\n", ntohl(packet->seq_num), ntohs(packet->len));
+
+	// a full batch goes out at once
+	if (b->count >= b->size) {
+		return batch_flush(b, des_sock);
+	}
+
+	return 0;
+
+}
+
+
+
+// queue the datagrams the impairment held back that are due by now
+
+int queue_held(dgram_batch *b, int des_sock, impairment *im, double now) {
+
+	size_t size;
+
+	while ((size = impair_take(im, now, b->bufs + b->count * b->buf_size, b->buf_size, &b->addrs[b->count])) > 0) {
+		b->iov[2 * b->count].iov_base = b->bufs + b->count * b->buf_size;
+		b->iov[2 * b->count].iov_len = size;
+		b->iov[2 * b->count + 1].iov_len = 0;
+		b->count++;
+		if (b->count >= b->size && batch_flush(b, des_sock) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+
+}
+
+
+
+// wait until deadline for a packet of session id with a valid checksum
+// returns its type, or -1 when the time runs out
+
+int recv_packet(int sock, udp_pack *p, uint32_t id, double deadline) {
+
+	fd_set select_fds;
+	struct timeval timeout;
+	ssize_t got;
+	double now;
+
+	while ((now = now_seconds()) < deadline) {
+
+		timeout.tv_sec = (long)(deadline - now);
+		timeout.tv_usec = (long)((deadline - now - timeout.tv_sec) * 1e6);
+
+		FD_ZERO(&select_fds);
+		FD_SET(sock, &select_fds);
+
+		if (select(sock + 1, &select_fds, NULL, NULL, &timeout) < 0) {
+			perror("Error in waiting for ACKs");
+			exit(1);
+		}
+
+		// nothing yet, or the ICMP error of a server that is not up (yet)
+		got = recv(sock, p, sizeof *p, MSG_DONTWAIT);
+		if (got < 0) {
+			continue;
+		}
+
+		if (got < PACK_HDR || (size_t)got != PACK_SIZE(p) || p->checksum != packet_checksum(p) || ntohl(p->session) != id) {
+			log_msg(LOG_DEBUG, "**************************************\nWRONG ACK ... ignore ...\n**************************************\n");
+			continue;
+		}
+
+		return p->type;
+	}
+
+	return -1;
+
+}
+
+
+
+// send a probe with size bytes of data and wait for its echo, a few times
+// returns 1 when it came back, 0 when the path does not carry it
+
+int probe_once(int sock, udp_pack *probe, udp_pack *reply, unsigned size, uint32_t id, uint32_t seq, rtt_estimator *rtt) {
+
+	double sent_at;
+	int tries;
+
+	bzero(probe, PACK_HDR);
+	probe->seq_num = htonl(seq);
+	probe->session = htonl(id);
+	probe->len = htons(size);
+	probe->type = PACK_PROBE;
+	probe->checksum = packet_checksum(probe);
+
+	// probes test the path, not the program: they do not go through the impairment
+	for (tries = 1; tries <= PROBE_TRIES; tries++) {
+
+		metric_add(M_PROBES, 1);
+		if (send(sock, probe, PACK_SIZE(probe), 0) < 0) {
+			// larger than the MTU the kernel already knows for the route
+			if (errno == EMSGSIZE) {
+				return 0;
+			}
+			if (errno != ECONNREFUSED) {
+				printf("ERROR: failed sending a probe\n");
+				exit(1);
+			}
+		}
+
+		sent_at = now_seconds();
+
+		while (recv_packet(sock, reply, id, sent_at + rtt_timeout(rtt, tries)) >= 0) {
+			if (reply->type == PACK_PROBE_ACK && ntohl(reply->seq_num) == seq) {
+				if (tries == 1) {
+					rtt_sample(rtt, now_seconds() - sent_at);
+				}
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+
+}
+
+
+
+// find the largest payload, up to max, whose packets cross the path without fragmentation (RFC 8899)
+// the socket must be connected to the server
+
+unsigned probe_payload(int sock, unsigned max, uint32_t id, rtt_estimator *rtt) {
+
+	udp_pack *probe, *reply;
+	unsigned lo = SAFE_PAYLOAD, hi, mid;
+	uint32_t seq = 0;
+	int mtu, pmtud;
+	socklen_t len = sizeof mtu;
+
+	if (max <= SAFE_PAYLOAD) {
+		return max;
+	}
+
+	// the MTU of the route is the upper bound, the probes find out whether the whole path carries it
+	if (getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &len) < 0) {
+		printf("ERROR: failed reading the path MTU\n");
+		exit(1);
+	}
+
+	hi = mtu - IP_UDP_HDR - PACK_HDR;
+	if (hi > max) {
+		hi = max;
+	}
+	if (hi <= lo) {
+		return hi;
+	}
+
+	// don't fragment, and let probes above the MTU the kernel has cached go out anyway
+	pmtud = IP_PMTUDISC_PROBE;
+	setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtud, sizeof pmtud);
+
+	probe = calloc(1, sizeof *probe);
+	reply = calloc(1, sizeof *reply);
+	if (probe == NULL || reply == NULL) {
+		printf("ERROR: out of memory\n");
+		exit(1);
+	}
+
+	printf("Probing the path for %u to %u bytes of data per packet\n", lo, hi);
+
+	// the largest size first, on most paths it is the only probe needed;
+	// otherwise a binary search between lo (fits every path) and hi (did not come back)
+	if (!probe_once(sock, probe, reply, hi, id, seq++, rtt)) {
+		hi--;
+		while (lo < hi) {
+			mid = lo + (hi - lo + 1) / 2;
+			if (probe_once(sock, probe, reply, mid, id, seq++, rtt)) {
+				lo = mid;
+			}
+			else {
+				hi = mid - 1;
+			}
+		}
+	}
+
+	printf("The path carries %u bytes of data per packet (%u probes)\n", hi, seq);
+
+	// from now on the kernel's path MTU holds: a route that shrinks fails the send instead of fragmenting
+	pmtud = IP_PMTUDISC_DO;
+	setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtud, sizeof pmtud);
+
+	free(probe);
+	free(reply);
+
+	return hi;
+
+}
+
+
+
+// send packet 0 (the proposed payload size and window, then the new file name) until it is acknowledged
+// returns the session parameters the server agreed to, in host order
+
+session_params open_session(int sock, const char *name, uint32_t id, session_params proposed, int check,
+	rtt_estimator *rtt, impairment *im, unsigned long long *retransmits) {
+
+	udp_pack *open, *reply;
+	char wire[PACK_HDR + sizeof(session_params) + NAME_MAX_LEN];
+	session_params params;
+	size_t name_len = strlen(name);
+	struct sockaddr_in peer;
+	socklen_t peer_len;
+	double sent_at, deadline, wait;
+	size_t size;
+	int sends, copies, i;
+
+	open = calloc(1, sizeof *open);
+	reply = calloc(1, sizeof *reply);
+	if (open == NULL || reply == NULL) {
+		printf("ERROR: out of memory\n");
+		exit(1);
+	}
+
+	// copies held back past the ACK go out with the other packets, to the server's address
+	peer_len = sizeof peer;
+	bzero(&peer, sizeof peer);
+	getpeername(sock, (struct sockaddr *)&peer, &peer_len);
+
+	params.payload = htonl(proposed.payload);
+	params.window = htonl(proposed.window);
+	params.fec_k = proposed.fec_k;
+	params.fec_m = proposed.fec_m;
+	params.reserved = 0;
+	params.size_hi = htonl(proposed.size_hi);
+	params.size_lo = htonl(proposed.size_lo);
+	memcpy(open->data, &params, sizeof params);
+	memcpy(open->data + sizeof params, name, name_len);
+
+	open->seq_num = htonl(0);
+	open->session = htonl(id);
+	open->len = htons(sizeof params + name_len);
+	open->type = PACK_DATA;
+	open->check = check;
+	open->checksum = packet_checksum(open);
+
+	for (sends = 1; sends <= MAX_SENDS; sends++) {
+
+		if (sends > 1) {
+			log_msg(LOG_DEBUG, "**************************************\nNO ACK RECEIVED FOR 0 ... resend ...\n**************************************\n");
+			(*retransmits)++;
+			metric_add(M_RETRANSMITS, 1);
+			metric_add(M_TIMEOUTS, 1);
+		}
+
+		log_msg(LOG_TRACE, "sending packages!\n");
+		metric_add(M_DATAGRAMS, 1);
+		metric_add(M_BYTES, PACK_SIZE(open));
+
+		memcpy(wire, open, PACK_SIZE(open));
+		copies = im->on ? impair_datagram(im, wire, PACK_SIZE(open), &peer, now_seconds()) : 1;
+
+		for (i = 0; i < copies; i++) {
+			if (send(sock, wire, PACK_SIZE(open), 0) < 0 && errno != ECONNREFUSED) {
+				printf("Error in sending the file\n");
+				exit(1);
+			}
+		}
+		if (copies > 0) {
+			log_msg(LOG_TRACE, "Package 0 sent (%u bytes)\n", ntohs(open->len));
+		}
+
+		sent_at = now_seconds();
+		deadline = sent_at + rtt_timeout(rtt, sends);
+
+		for (;;) {
+
+			// copies the impairment held back go out while waiting
+			wait = im->nheld > 0 && impair_next_due(im) < deadline ? impair_next_due(im) : deadline;
+
+			if (recv_packet(sock, reply, id, wait) < 0) {
+				if (now_seconds() >= deadline) {
+					break;
+				}
+				while ((size = impair_take(im, now_seconds(), wire, sizeof wire, &peer)) > 0) {
+					if (send(sock, wire, size, 0) < 0 && errno != ECONNREFUSED) {
+						printf("Error in sending the file\n");
+						exit(1);
+					}
+				}
+				continue;
+			}
+
+			if (reply->type != PACK_ACK || reply->check != check || ntohl(reply->seq_num) != 0 || ntohs(reply->len) != sizeof params) {
+				continue;
+			}
+
+			if (sends == 1) {
+				rtt_sample(rtt, now_seconds() - sent_at);
+			}
+
+			memcpy(&params, reply->data, sizeof params);
+			params.payload = ntohl(params.payload);
+			params.window = ntohl(params.window);
+
+			if (params.payload < 1 || params.payload > proposed.payload || params.window < 1 || params.window > proposed.window) {
+				printf("ERROR: the server answered with a payload of %u bytes and a window of %u packets\n",
+					params.payload, params.window);
+				exit(1);
+			}
+			if ((params.fec_k != 0 || params.fec_m != 0) && (params.fec_k != proposed.fec_k || params.fec_m != proposed.fec_m)) {
+				printf("ERROR: the server answered with FEC %u:%u\n", params.fec_k, params.fec_m);
+				exit(1);
+			}
+
+			free(open);
+			free(reply);
+
+			return params;
+		}
+	}
+
+	printf("\nERROR: no ACK for package 0 after %d tries\n", MAX_SENDS);
+	exit(1);
+
+}
+
+
+
+// a packet is acknowledged for the first time: tell the RTT estimator (if the ACK answers this very
+// packet and it was sent only once, Karn's rule) and the congestion controller
+
+void packet_acked(tx_slot *slot, int answered, rtt_estimator *rtt, cc_state *cc, double now) {
+
+	int sample = answered && slot->sends == 1;
+
+	slot->acked = 1;
+	metric_add(M_ACKED, ntohs(slot->packet->len));
+
+	if (sample) {
+		rtt_sample(rtt, now - slot->sent_at);
+	}
+
+	cc_acked(cc, &slot->cc, sample ? now - slot->sent_at : 0, rtt->srtt, now);
+
+}
+
+
+
 int main(int argc, char *argv[]) {
 
 	// set up variables
@@ -79,30 +841,168 @@ int main(int argc, char *argv[]) {
 	char *newfile_name;
 	char *ip_addr;
 	int port_num;
+	int window = DEFAULT_WINDOW;
+	int batch = DEFAULT_BATCH;
+	int gso = 0;
+	unsigned max_payload = MAX_PAYLOAD;
+	int opt;
 
 	// socket variable
-	int des_sock; 
-	struct sockaddr_in sock_addr, des_addr;
-	socklen_t size;
-
-	// file reading variables
-	FILE *oldfile;
-	char buf[CHUNK+1];
-	char buf_ack[CHUNK+1];
-
-	// udp packet for sending and acknowledgment
-	udp_pack packet;
-	udp_pack packet_ack;
+	int des_sock;
+	struct sockaddr_in des_addr;
+
+	// file reading variables: the packets point into the mapped file
+	int oldfile;
+	reader input;
+	struct stat st;
+	off_t file_size = 0;
+	size_t n;
+
+	// session: payload bytes per packet and packets in flight, as agreed with the server
+	session_params proposed, session;
+	uint32_t session_id;
+
+	// send window: packets [base, next_seq) are in flight, slot seq % window holds packet seq
+	char *slab;
+	tx_slot *slots;
+	tx_slot *slot;
+	uint32_t base = 1, next_seq = 1, end_seq = 0, seq;
+	int have_end = 0;
+	unsigned long long packets = 1, retransmits = 0;
+
+	// retransmit timeout, adapted to the measured round trip time
+	rtt_estimator rtt = { 0, 0, RTO_INITIAL, 0, 0 };
+	double next_report;
+
+	// congestion window and pacing
+	const char *cc_name = DEFAULT_CC;
+	cc_state cc;
+	pacer pc = { 0, 0 };
+	unsigned k;
+
+	// batches of outgoing packets and incoming acknowledgments
+	dgram_batch tx, rx;
+	udp_pack *packet_ack;
+	int i, acks;
+
+	// selective acknowledgements, and the send time of the latest packet they acknowledged
+	sack_info sack;
+	uint32_t cum, words, bit;
+	double newest_sent;
+	unsigned long long fast_retransmits = 0;
+
+	// forward error correction: parity packets after every block of data packets
+	int fec_k = 0, fec_m = 0, j;
+	fec_encoder fec;
+	udp_pack *parity = NULL;
+	unsigned long long parity_sent = 0;
+
+	// kind of checksum the packets carry
+	int check = CHECKSUM_INET;
+
+	// the simulated channel the packets go through, none by default
+	impairment imp;
+
+	// JSON line log of the metrics, none by default
+	const char *metrics_log = NULL;
+
+	// what the transfer prints
+	int level = LOG_DEFAULT_LEVEL;
 
 
 	// time out
 	fd_set select_fds;
 	struct timeval timeout;
-	timeout.tv_sec = 1;
-	timeout.tv_usec = 500;
+	double now, earliest, ready, started;
+
 
+	// examine the use input (-w sets the number of packets in flight, -b the datagrams per system call,
+	// -g sends them with segmentation offload, -p caps the bytes of data per packet, -c picks the congestion control,
+	// -f adds M parity packets to every K data packets, -k picks the checksum, -i impairs the packets,
+	// -l logs the metrics as JSON lines to a file, -v sets the log level)
 
-	// examine the use input
+	metrics_init("udp_client", counter_defs, M_COUNT, hist_defs, H_COUNT, M_ACKED);
+	bzero(&imp, sizeof imp);
+
+	while ((opt = getopt(argc, argv, "w:b:gp:c:f:k:i:l:v:")) != -1) {
+		switch (opt) {
+		case 'w':
+			window = atoi(optarg);
+			if (window < 1 || window > MAX_WINDOW) {
+				printf("ERROR: window must be between 1 and %d packets\n", MAX_WINDOW);
+				exit(1);
+			}
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			if (batch < 1 || batch > MAX_BATCH) {
+				printf("ERROR: batch must be between 1 and %d datagrams\n", MAX_BATCH);
+				exit(1);
+			}
+			break;
+		case 'g':
+			gso = 1;
+			break;
+		case 'p':
+			max_payload = atoi(optarg);
+			if (max_payload < 1 || max_payload > MAX_PAYLOAD) {
+				printf("ERROR: payload must be between 1 and %d bytes\n", MAX_PAYLOAD);
+				exit(1);
+			}
+			break;
+		case 'c':
+			cc_name = optarg;
+			if (cc_init(&cc, cc_name, 1, 0) < 0) {
+				printf("ERROR: unknown congestion control %s, pick one of:", cc_name);
+				for (k = 0; k < CC_ALGOS; k++) {
+					printf(" %s", cc_algos[k].name);
+				}
+				printf("\n");
+				exit(1);
+			}
+			break;
+		case 'f':
+			if (sscanf(optarg, "%d:%d", &fec_k, &fec_m) != 2 || fec_k < 1 || fec_k > FEC_MAX_K ||
+				fec_m < 1 || fec_m > FEC_MAX_M) {
+				printf("ERROR: FEC must be K:M with 1 to %d data packets and 1 to %d parity packets\n", FEC_MAX_K, FEC_MAX_M);
+				exit(1);
+			}
+			break;
+		case 'k':
+			if (strcmp(optarg, "inet") == 0) {
+				check = CHECKSUM_INET;
+			}
+			else if (strcmp(optarg, "crc32c") == 0) {
+				check = CHECKSUM_CRC32C;
+			}
+			else {
+				printf("ERROR: unknown checksum %s, pick inet or crc32c\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'i':
+			if (impair_parse(&imp, optarg) < 0) {
+				exit(1);
+			}
+			break;
+		case 'l':
+			metrics_log = optarg;
+			break;
+		case 'v':
+			level = log_parse_level(optarg);
+			if (level < 0) {
+				printf("ERROR: unknown log level %s, pick error, warn, info, debug or trace\n", optarg);
+				exit(1);
+			}
+			break;
+		default:
+			printf("usage: %s [-w window] [-b batch] [-g] [-p max_payload] [-c newreno|bbr|fixed] [-f K:M] [-k inet|crc32c] [-i impairment] [-l metrics_log] [-v level] <input_filename> <output_filename> <server_ip_address> <server_port>\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc < 2) {
 		printf("ERROR: no input\n");
@@ -120,6 +1020,12 @@ int main(int argc, char *argv[]) {
 		port_num = atoi(argv[4]);
 	}
 
+	// the new file name travels in packet 0
+	if (strlen(newfile_name) == 0 || strlen(newfile_name) > NAME_MAX_LEN) {
+		printf("ERROR: the new file name must have 1 to %d characters\n", NAME_MAX_LEN);
+		exit(1);
+	}
+
 
 	// create a socket that connects to the server
 
@@ -135,193 +1041,429 @@ int main(int argc, char *argv[]) {
 	printf("Client socket created\n");
 
 
-	/*
-	// set local sock address // U
-	bzero(&sock_addr, sizeof sock_addr);
-	sock_addr.sin_family = AF_INET; 
-	sock_addr.sin_port = htons(port_num);
-	sock_addr.sin_addr.s_addr = inet_addr(ip_addr);
-	memset(sock_addr.sin_zero, '\0', sizeof sock_addr.sin_zero);  
-	*/
-
-
 	// set destination sock address
 	bzero(&des_addr, sizeof des_addr);
-	des_addr.sin_family = AF_INET; 
+	des_addr.sin_family = AF_INET;
 	des_addr.sin_port = htons(port_num);
 	des_addr.sin_addr.s_addr = inet_addr(ip_addr);
-	memset(des_addr.sin_zero, '\0', sizeof des_addr.sin_zero);  
-
-
-	socklen_t addrlen = sizeof(sock_addr);
+	memset(des_addr.sin_zero, '\0', sizeof des_addr.sin_zero);
 
+	// connected, so that the kernel tracks the path MTU to the server and only its packets come back
+	if (connect(des_sock, (struct sockaddr *)&des_addr, sizeof des_addr) < 0) {
+		printf("ERROR: failed connecting the socket\n");
+		close(des_sock);
+		exit(1);
+	}
 
-	// send the newfile name
-	printf("\n", newfile_name);
 
-	// packet the newfile name packet
-	packet.seq_num = 0;
-	bzero(packet.data, sizeof packet.data);
-	strncpy(packet.data, newfile_name, sizeof newfile_name + 1); //assume the new file name has a length less than 10
+	// reading file
+	printf("\nRead file...\n");
 
-	if (sendto(des_sock, &packet, sizeof(packet)+1, 0, (struct sockaddr *)&des_addr, sizeof(des_addr)) == -1) {
-		printf("\nERROR: failed sending the newfile name\n");
+	oldfile = open(oldfile_name, O_RDONLY);
+	if (oldfile < 0) {
+		printf("Error in opening the file\n");
 		close(des_sock);
 		exit(1);
 	}
 
-	printf("New file name sent\n");
+	// announced in packet 0, so that the server can preallocate the file
+	if (fstat(oldfile, &st) == 0 && S_ISREG(st.st_mode)) {
+		file_size = st.st_size;
+	}
 
+	started = now_seconds();
+	metrics_start(metrics_log, NULL);
+	log_init(level);
 
 
-	// reading file
-	printf("\nRead file...\n");
+	// size the packets to the path, then agree on the session with the server
 
-	oldfile = fopen(oldfile_name, "rb");
-	if (oldfile == NULL) {
-		printf("Error in opening the file\n");
-		close(des_sock);
+	// a new session ID for every transfer, so the server does not mix it up with an earlier one from the same port
+	if (getrandom(&session_id, sizeof session_id, 0) != sizeof session_id) {
+		session_id = (uint32_t)(now_seconds() * 1e6) ^ (uint32_t)getpid() << 16;
+	}
+
+	proposed.payload = probe_payload(des_sock, max_payload, session_id, &rtt);
+	proposed.window = window;
+	proposed.fec_k = fec_k;
+	proposed.fec_m = fec_m;
+	proposed.size_hi = (uint64_t)file_size >> 32;
+	proposed.size_lo = (uint32_t)file_size;
+
+	printf("Checksum: %s\n", checksum_kernel_name(check));
+
+	if (imp.on) {
+		impair_print(&imp, "Client");
+	}
+
+	session = open_session(des_sock, newfile_name, session_id, proposed, check, &rtt, &imp, &retransmits);
+	window = session.window;
+
+	log_flush();
+	printf("Session %08x open: %u bytes of data per packet, window of %u packets\n", session_id, session.payload, session.window);
+
+	if (fec_k > 0 && session.fec_k == 0) {
+		printf("The server does not take FEC, sending without parity\n");
+	}
+	fec_k = session.fec_k;
+	fec_m = session.fec_m;
+
+	if (fec_k > 0) {
+		printf("FEC: %d parity packets after every %d data packets\n", fec_m, fec_k);
+		parity = malloc(sizeof *parity);
+		if (parity == NULL || fec_encoder_init(&fec, fec_k, fec_m, session.payload) < 0) {
+			printf("ERROR: out of memory\n");
+			exit(1);
+		}
+	}
+
+
+	// the window keeps only the packet headers, the data of packet seq stays in the file at
+	// (seq - 1) * payload, where a packet is never split between two windows of the mapping
+	reader_open(&input, oldfile, session.payload);
+
+	slab = malloc(window * PACK_HDR);
+	slots = calloc(window, sizeof *slots);
+	if (slab == NULL || slots == NULL) {
+		printf("ERROR: out of memory\n");
 		exit(1);
 	}
+	for (i = 0; i < window; i++) {
+		slots[i].packet = (udp_pack *)(slab + i * PACK_HDR);
+	}
 
+	batch_init(&tx, batch, PACK_HDR + session.payload);
+	batch_init(&rx, batch, ACK_BUF);
 
-	// set time out
-	if (setsockopt(des_sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout)) < 0) {
-    	perror("Error in setting time out");
+	if (gso) {
+		tx.gso = gso_supported(des_sock, tx.buf_size);
+		if (tx.gso) {
+			printf("Sending with UDP GSO\n");
+		}
+		else {
+			printf("UDP GSO not supported, sending with sendmmsg\n");
+		}
 	}
 
+	cc_init(&cc, cc_name, window, now_seconds());
 
-	// reading the file in chunks and send it over to the server
+	next_report = now_seconds() + 1;
 
-	bzero(packet.data, sizeof packet.data);
 
-	while (fread(&packet.data, 1, sizeof packet.data - 1, oldfile) > 0) {
+	// keep the window full and retransmit packets whose timer ran out, until the end packet is acknowledged
 
-		// set up packet header information
-		int real_seq_num = packet.seq_num ^ 1;
-		short real_checksum = checksum(packet.data, sizeof packet.data);
+	while (!have_end || base <= end_seq) {
 
-		// start sending this parcket repeatly until receiving the desired ACK
-		while (1) {
+		// fill the window: the file in packets of the agreed payload, then the end packet,
+		// as far as the congestion window and the pacer allow
 
-			// absorb duplicated ACK from the previous
-			while (1) {
-				if (recvfrom(des_sock, &packet_ack, sizeof(packet_ack), 0, (struct sockaddr *)&sock_addr, &addrlen) > 0)  {
-					continue;
+		now = now_seconds();
+
+		while (next_seq - base < (uint32_t)window && !(have_end && next_seq > end_seq) &&
+			cc_can_send(&cc) && pacer_ready(&pc, &cc, now)) {
+
+			slot = &slots[next_seq % window];
+			bzero(slot->packet, PACK_HDR);
+
+			slot->data = reader_at(&input, (off_t)(next_seq - 1) * session.payload, session.payload, &n);
+			if (slot->data == NULL) {
+				printf("Error in reading the file\n");
+				exit(1);
+			}
+			if (n == 0) {
+				have_end = 1;
+				end_seq = next_seq;
+			}
+
+			slot->packet->seq_num = htonl(next_seq);
+			slot->packet->session = htonl(session_id);
+			slot->packet->len = htons(n);
+			slot->packet->type = PACK_DATA;
+			slot->packet->check = check;
+			slot->packet->checksum = packet_checksum_data(slot->packet, slot->data);
+			slot->acked = 0;
+			slot->fast = 0;
+			slot->sends = 1;
+			slot->sent_at = now;
+			slot->deadline = slot->sent_at + rtt_timeout(&rtt, 1);
+			cc_sent(&cc, &slot->cc, 0, now);
+			pacer_sent(&pc, &cc);
+
+			if (queue_packet(&tx, des_sock, slot->packet, slot->data, &des_addr, &imp) < 0) {
+				printf("Error in sending the file\n");
+				exit(1);
+			}
+
+			packets++;
+			metric_add(M_PACKETS, 1);
+			next_seq++;
+
+			// a completed block is followed by its parity, paced like the data
+			if (fec_k > 0 && fec_encode(&fec, slot->packet, slot->data)) {
+				for (j = 0; j < fec_m; j++) {
+					fec_parity(&fec, j, parity);
+					parity->session = htonl(session_id);
+					parity->check = check;
+					parity->checksum = packet_checksum(parity);
+					pacer_sent(&pc, &cc);
+
+					if (queue_packet(&tx, des_sock, parity, NULL, &des_addr, &imp) < 0) {
+						printf("Error in sending the file\n");
+						exit(1);
+					}
+
+					parity_sent++;
+					metric_add(M_PARITY, 1);
 				}
-				break;
+				fec_next_block(&fec);
 			}
+		}
 
-			printf("sending packages!\n");
+		if ((imp.on && queue_held(&tx, des_sock, &imp, now_seconds()) < 0) || batch_flush(&tx, des_sock) < 0) {
+			printf("Error in sending the file\n");
+			exit(1);
+		}
 
 
-			// random functions that cause "accidents" if the transfer
-			// in order to test the program's ability to solve data loss & error
-			int rand_1 = rand() % 10;
-			int rand_2 = rand() % 10;
-			int rand_3 = rand() % 10;
-			int rand_4 = rand() % 10;
+		// wait for ACKs until the earliest retransmit timer in the window runs out, or until the
+		// pacer lets the next packet go when one is waiting for it
 
-			// random function to decide whether to send the right sequence number
-			if (rand_1 < 8) {
-				packet.seq_num = real_seq_num;
-			}
-			else {
-				packet.seq_num = 0;
+		now = now_seconds();
+		earliest = now + rtt.rto;
+		pacer_ready(&pc, &cc, now);
+		ready = pacer_next(&pc, &cc, now);
+
+		if (next_seq - base < (uint32_t)window && !(have_end && next_seq > end_seq) && cc_can_send(&cc) && ready < earliest) {
+			earliest = ready;
+		}
+
+		for (seq = base; seq != next_seq; seq++) {
+			slot = &slots[seq % window];
+			if (!slot->acked && (slot->deadline > ready ? slot->deadline : ready) < earliest) {
+				earliest = slot->deadline > ready ? slot->deadline : ready;
 			}
+		}
+
+		// or until a packet the impairment held back is due
+		if (imp.nheld > 0 && impair_next_due(&imp) < earliest) {
+			earliest = impair_next_due(&imp);
+		}
+
+		if (earliest > now) {
+			timeout.tv_sec = (long)(earliest - now);
+			timeout.tv_usec = (long)((earliest - now - timeout.tv_sec) * 1e6);
+
+			FD_ZERO(&select_fds);
+			FD_SET(des_sock, &select_fds);
 
-			// random function to decide whether to send the right checksum
-			if (rand_2 < 8) {
-				packet.checksum = real_checksum;
+			if (select(des_sock + 1, &select_fds, NULL, NULL, &timeout) < 0) {
+				perror("Error in waiting for ACKs");
+				exit(1);
 			}
-			else {
-				packet.checksum = 0;
+		}
+
+
+		// take every ACK that has arrived, duplicates only repeat what is already known
+
+		newest_sent = 0;
+
+		do {
+
+			acks = batch_recv(&rx, des_sock, MSG_DONTWAIT);
+			if (acks > 0) {
+				metric_add(M_ACKS, acks);
 			}
 
+			for (i = 0; i < acks; i++) {
 
-			// random function to decide whether to skip this message
-			if (rand_3 < 3) {
-				printf("**************************************\n");
-    			printf("SKIP ... resend later ...\n");
-    			printf("**************************************\n");
-				continue;
+				packet_ack = (udp_pack *)rx.iov[2 * i].iov_base;
+				seq = ntohl(packet_ack->seq_num);
+
+				if (rx.msgs[i].msg_len < PACK_HDR || rx.msgs[i].msg_len != PACK_SIZE(packet_ack) ||
+					packet_ack->checksum != packet_checksum(packet_ack) || ntohl(packet_ack->session) != session_id ||
+					packet_ack->type != PACK_SACK ||
+					ntohs(packet_ack->len) < sizeof sack.cum_ack || ntohs(packet_ack->len) > sizeof sack ||
+					ntohs(packet_ack->len) % sizeof sack.bitmap[0] != 0) {
+					log_msg(LOG_DEBUG, "**************************************\nWRONG ACK ... ignore ...\n**************************************\n");
+					metric_add(M_BAD_ACKS, 1);
+					continue;
+				}
+
+				memcpy(&sack, packet_ack->data, ntohs(packet_ack->len));
+				cum = ntohl(sack.cum_ack);
+				words = (ntohs(packet_ack->len) - sizeof sack.cum_ack) / sizeof sack.bitmap[0];
+
+				log_msg(LOG_TRACE, "SEQ: %u, cumulative %u, window [%u, %u)\n", seq, cum, base, next_seq);
+
+				// an ACK from before the last slide of the window only repeats what is already known
+				if ((int32_t)(cum - base) < 0 || cum - base > next_seq - base) {
+					continue;
+				}
+
+				now = now_seconds();
+
+				// every packet before the cumulative ACK has arrived
+				for (; base != cum; base++) {
+					slot = &slots[base % window];
+					if (!slot->acked) {
+						packet_acked(slot, base == seq, &rtt, &cc, now);
+						if (slot->sent_at > newest_sent) {
+							newest_sent = slot->sent_at;
+						}
+					}
+				}
+
+				// the server holds the whole file once the cumulative ACK passes the end packet
+				if (have_end && (int32_t)(cum - end_seq) > 0) {
+					break;
+				}
+
+				// and so are the ones in the bitmap; the end packet only counts through the cumulative ACK,
+				// it keeps being resent until the SACK saying the file is complete gets through
+				for (bit = 0; bit < words * 32; bit++) {
+
+					if (!(ntohl(sack.bitmap[bit / 32]) & (1u << (bit % 32)))) {
+						continue;
+					}
+
+					if (cum + 1 + bit - base >= next_seq - base || (have_end && cum + 1 + bit == end_seq)) {
+						continue;
+					}
+
+					slot = &slots[(cum + 1 + bit) % window];
+					if (!slot->acked) {
+						packet_acked(slot, cum + 1 + bit == seq, &rtt, &cc, now);
+						if (slot->sent_at > newest_sent) {
+							newest_sent = slot->sent_at;
+						}
+					}
+				}
 			}
 
+		} while (acks == rx.size && !(have_end && (int32_t)(base - end_seq) > 0));
+
+
+		// a hole sent well before a packet that has been acknowledged since is lost: resend it now
+
+		for (seq = base; newest_sent > 0 && seq != next_seq; seq++) {
 
-			// send the file
-			if (sendto(des_sock, &packet, sizeof(packet)+1, 0, (struct sockaddr *)&des_addr, sizeof(sock_addr)) < 0) {
-    			printf("Error in sending the file\n");
-    			exit(1);
-    		}
+			slot = &slots[seq % window];
 
-    		// random function to decide whether to send a false duplicate
-    		if (rand_4 < 3) {
-    			if (sendto(des_sock, &packet, sizeof(packet)+1, 0, (struct sockaddr *)&des_addr, sizeof(sock_addr)) < 0) {
-    				printf("Error in sending the file\n");
-    				exit(1);
-    			}
-    			printf("DUPLICATE: %s\n", packet.data);
+			if (!slot->acked && slot->sent_at + rtt.srtt / 4 < newest_sent && slot->deadline > now) {
+				slot->deadline = now;
+				slot->fast = 1;
+				fast_retransmits++;
+				metric_add(M_SACK_RETRANSMITS, 1);
 			}
+		}
+
 
+		// slide the window past the acknowledged packets at its start
 
+		while (base != next_seq && slots[base % window].acked) {
+			base++;
+		}
 
-    		printf("Package %d sent %s \n", packet.seq_num, packet.data);
+		// every batch has gone out, nothing points into the file before base any more
+		reader_release(&input, (off_t)(base - 1) * session.payload);
 
 
-    		// prepare to receive an ack
-    		bzero(packet_ack.data, sizeof packet_ack.data);
+		// selective repeat: resend only the packets whose own timer has expired
 
-			// try to receive an ACK
-    		if (recvfrom(des_sock, &packet_ack, sizeof(packet_ack), 0, (struct sockaddr *)&sock_addr, &addrlen) > 0) {
+		now = now_seconds();
 
-    			printf("SEQ: %d, %d\n", real_seq_num, packet_ack.seq_num);
+		for (seq = base; seq != next_seq; seq++) {
 
-    			// no need to resend if correct ACK is received
-    			if (packet_ack.seq_num == real_seq_num && packet_ack.checksum == real_checksum) {
-    				break;
-    			}
+			slot = &slots[seq % window];
 
-    			printf("**************************************\n");
-    			printf("WRONG ACK ... resend ...\n");
-    			printf("**************************************\n");
-    			
-    		} 
+			if (slot->acked || slot->deadline > now) {
+				continue;
+			}
+
+			if (slot->sends == MAX_SENDS) {
+				printf("\nERROR: no ACK for package %u after %d tries\n", seq, MAX_SENDS);
+				exit(1);
+			}
 
-    		// if failed to receive an ack
-    		else {
-    			printf("**************************************\n");
-    			printf("NO ACK RECEIVED ... resend ...\n");
-    			printf("**************************************\n");
-    			continue;
-    		}
+			// the rest waits for the pacer
+			if (!pacer_ready(&pc, &cc, now)) {
+				break;
+			}
+
+			cc_lost(&cc, seq, next_seq, now);
+			pacer_sent(&pc, &cc);
+
+			log_msg(LOG_DEBUG, "**************************************\nNO ACK RECEIVED FOR %u ... resend ...\n**************************************\n", seq);
+
+			if (queue_packet(&tx, des_sock, slot->packet, slot->data, &des_addr, &imp) < 0) {
+				printf("Error in sending the file\n");
+				exit(1);
+			}
 
+			slot->sends++;
+			slot->sent_at = now;
+			slot->deadline = now + rtt_timeout(&rtt, slot->sends);
+			cc_sent(&cc, &slot->cc, 1, now);
+			retransmits++;
+			metric_add(M_RETRANSMITS, 1);
+			if (!slot->fast) {
+				metric_add(M_TIMEOUTS, 1);
+			}
+			slot->fast = 0;
 		}
 
-		// clean up to read the next chunk
-		bzero(packet.data, sizeof packet.data);
+		if ((imp.on && queue_held(&tx, des_sock, &imp, now) < 0) || batch_flush(&tx, des_sock) < 0) {
+			printf("Error in sending the file\n");
+			exit(1);
+		}
 
-	}
 
-	
-	char *end;
-	end = "***End***";
+		// report the live round trip estimate and the congestion state
 
-	bzero(packet.data, sizeof packet.data);
-	strncpy(packet.data, end, sizeof end + 1);
+		if (now >= next_report) {
+			log_msg(LOG_INFO, "RTT: last %.3f ms, srtt %.3f ms, rttvar %.3f ms, rto %.3f ms\n",
+				rtt.last * 1e3, rtt.srtt * 1e3, rtt.rttvar * 1e3, rtt.rto * 1e3);
+			log_msg(LOG_INFO, "CC %s (%s): cwnd %.1f, %u in flight, pacing %.0f packets/s (%.2f MB/s), %llu losses, %llu loss events\n",
+				cc.algo->name, cc_mode(&cc), cc.cwnd, cc.inflight, cc.pacing_rate,
+				cc.pacing_rate * session.payload / 1e6, cc.losses, cc.loss_events);
+			next_report = now + 1;
+		}
 
-	if (sendto(des_sock, &packet, sizeof packet + 1, 0, (struct sockaddr *)&des_addr, sizeof(sock_addr)) == -1) {
-		printf("\nERROR: failed sending the end\n");
-		close(des_sock);
-		exit(1);
 	}
 
 
+	log_stop();
+
 	printf("Finish reading file, close the socket\n");
+	printf("%llu packets sent, %llu retransmits (%llu on SACK), %.3f s\n", packets, retransmits, fast_retransmits,
+		now_seconds() - started);
+	printf("RTT: %llu samples, srtt %.3f ms, rttvar %.3f ms, rto %.3f ms\n", rtt.samples,
+		rtt.srtt * 1e3, rtt.rttvar * 1e3, rtt.rto * 1e3);
+	printf("%llu datagrams in %llu %s calls, %llu ACKs in %llu recvmmsg calls\n",
+		tx.datagrams, tx.calls, tx.gso ? "GSO" : "sendmmsg", rx.datagrams, rx.calls);
+	printf("File %s in %llu windows of %zu MB\n", input.mapped ? "mapped" : "read", input.windows, READER_WINDOW >> 20);
+	printf("CC %s: cwnd %.1f, pacing %.0f packets/s, %llu losses, %llu loss events\n",
+		cc.algo->name, cc.cwnd, cc.pacing_rate, cc.losses, cc.loss_events);
+	if (fec_k > 0) {
+		printf("FEC %d:%d: %llu parity packets, %.1f%% on top of the data packets\n", fec_k, fec_m, parity_sent,
+			100.0 * parity_sent / (packets - 1));
+	}
+	if (imp.on) {
+		impair_report(&imp, "Client");
+		impair_free(&imp);
+	}
 
-	fclose(oldfile);
+	metrics_stop();
+
+	free(parity);
+	free(slots);
+	free(slab);
+
+	reader_close(&input);
+	close(oldfile);
 
 	close(des_sock);
 
 	return 0;
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,520 @@
+/*
+ * File name: fec.h
+ * Description: Forward error correction for the UDP transfer. The data packets are grouped into blocks of
+ * K consecutive packets (packets 1..K, K+1..2K, ...), and after the last packet of a block the client
+ * sends M parity packets. The server rebuilds up to M lost packets of a block from the parity packets
+ * and the packets that did arrive, without waiting a round trip for the retransmits.
+ *
+ * Each packet of a block is one symbol: its 2-byte length field followed by its data, padded with
+ * zeros to the longest packet in the block. Parity packet j is sum over i of C[j][i] * symbol i in
+ * GF(2^8). Row 0 of C is all ones, so with M = 1 the parity is the plain XOR of the block; the other
+ * rows come from a Cauchy matrix (C[j][i] = 1 / (x_j + y_i), each column scaled so that row 0 is all
+ * ones), which makes any K of the K + M packets enough to rebuild the block (Reed-Solomon). The end
+ * packet closes the last block early, which then holds fewer than K packets.
+ *
+ * A parity packet carries the parity of the data in its data and the parity of the length fields in
+ * its header (fec[1], fec[2]), so it is no longer than the longest packet it covers. Its seq_num is
+ * the last packet of its block and fec[0] its row j.
+ *
+ * The server does not keep the packets it received for a later rebuild: each block only keeps M
+ * running sums of C[j][i] * symbol i over the packets that arrived, and the parity packets. The
+ * missing symbols are then the solution of a small linear system over what the sums do not explain.
+ *
+ * Referencer:
+ * https://tools.ietf.org/html/rfc5510
+ * http://web.eecs.utk.edu/~jplank/plank/papers/CS-05-569.pdf
+ * https://www.backblaze.com/blog/reed-solomon/
+ *
+ */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "proto.h"
+
+
+#define FEC_MAX_K 64 /* data packets per block, one bit each in fec_block.have */
+#define FEC_MAX_M 16 /* parity packets per block */
+#define FEC_POLY 0x11d /* x^8 + x^4 + x^3 + x^2 + 1 */
+
+// GF(2^8) log and antilog tables and the coding matrix, filled in by fec_init()
+static uint8_t fec_log[256];
+static uint8_t fec_exp[510];
+static uint8_t fec_coef[FEC_MAX_M][FEC_MAX_K];
+
+// client side: the parity of the block being sent
+typedef struct fec_encoder {
+	int k, m;
+	int count; // packets of the block so far
+	uint32_t last; // the latest of them
+	unsigned len; // longest symbol so far
+	size_t symbol_size; // 2 + payload
+	uint8_t *parity; // m symbols
+	uint8_t *scratch; // the symbol of the packet being added
+} fec_encoder;
+
+// server side: one block that may still need a rebuild
+typedef struct fec_block {
+	long long index; // block number, -1 for a free slot
+	uint64_t have; // bit i: packet i of the block arrived
+	uint32_t parity_have; // bit j: parity packet j arrived
+	int k; // packets in the block (fewer than K in the last one, told by its parity)
+	int done;
+	unsigned len; // symbol length, told by the parity
+	uint8_t *sum; // m running sums of C[j][i] * symbol i over the packets that arrived
+	uint8_t *parity; // m parity symbols as received
+} fec_block;
+
+typedef struct fec_decoder {
+	int k, m;
+	size_t symbol_size;
+	uint8_t *scratch;
+	int nblocks; // enough blocks to span the receive window
+	fec_block *blocks;
+	char *rebuilt; // packets rebuilt and not taken yet, rebuilt_size bytes each
+	size_t rebuilt_size;
+	int nrebuilt, taken, max_rebuilt;
+	unsigned long long parity_received, rebuilt_total;
+} fec_decoder;
+
+
+
+static inline uint8_t fec_mul(uint8_t a, uint8_t b) {
+
+	if (a == 0 || b == 0) {
+		return 0;
+	}
+
+	return fec_exp[fec_log[a] + fec_log[b]];
+
+}
+
+
+
+static inline uint8_t fec_inv(uint8_t a) {
+
+	return fec_exp[255 - fec_log[a]];
+
+}
+
+
+
+// build the tables
+
+static void fec_setup(void) {
+
+	unsigned x = 1, i, j;
+
+	for (i = 0; i < 255; i++) {
+		fec_exp[i] = fec_exp[i + 255] = x;
+		fec_log[x] = i;
+		x <<= 1;
+		if (x & 0x100) {
+			x ^= FEC_POLY;
+		}
+	}
+
+	// Cauchy rows x_j = 255 - j, columns y_i = i, then every column divided by its row 0 entry
+	for (j = 0; j < FEC_MAX_M; j++) {
+		for (i = 0; i < FEC_MAX_K; i++) {
+			fec_coef[j][i] = fec_mul(fec_inv((255 - j) ^ i), (255 - 0) ^ i);
+		}
+	}
+
+}
+
+
+
+// build them once, whichever thread gets here first; the server's workers open sessions at the same time
+
+static inline void fec_init(void) {
+
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, fec_setup);
+
+}
+
+
+
+// dst += c * src over n bytes
+
+static inline void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, unsigned n) {
+
+	unsigned i;
+	unsigned lc;
+
+	if (c == 1) {
+		for (i = 0; i < n; i++) {
+			dst[i] ^= src[i];
+		}
+		return;
+	}
+
+	lc = fec_log[c];
+	for (i = 0; i < n; i++) {
+		if (src[i] != 0) {
+			dst[i] ^= fec_exp[lc + fec_log[src[i]]];
+		}
+	}
+
+}
+
+
+
+// the symbol of a packet: its length field, then its data (at data, in the packet or elsewhere)
+
+static inline unsigned fec_symbol(const udp_pack *p, const char *data, uint8_t *sym) {
+
+	memcpy(sym, &p->len, 2);
+	memcpy(sym + 2, data, ntohs(p->len));
+
+	return 2 + ntohs(p->len);
+
+}
+
+
+
+// returns -1 for K, M or a payload the code cannot take
+
+static inline int fec_encoder_init(fec_encoder *e, int k, int m, unsigned payload) {
+
+	fec_init();
+
+	bzero(e, sizeof *e);
+	e->k = k;
+	e->m = m;
+	e->len = 2;
+	e->symbol_size = 2 + payload;
+	e->parity = calloc(m, e->symbol_size);
+	e->scratch = malloc(e->symbol_size);
+
+	return e->parity == NULL || e->scratch == NULL ? -1 : 0;
+
+}
+
+
+
+// add a newly sent data packet (packets come in sequence from 1) with its data at data; returns 1 when
+// it completes its block
+
+static inline int fec_encode(fec_encoder *e, const udp_pack *p, const char *data) {
+
+	uint32_t seq = ntohl(p->seq_num);
+	unsigned n = fec_symbol(p, data, e->scratch), i = (seq - 1) % e->k;
+	int j;
+
+	for (j = 0; j < e->m; j++) {
+		fec_mul_add(e->parity + j * e->symbol_size, e->scratch, fec_coef[j][i], n);
+	}
+
+	if (n > e->len) {
+		e->len = n;
+	}
+	e->count++;
+	e->last = seq;
+
+	// the empty end packet closes the last block early
+	return (int)i == e->k - 1 || p->len == 0;
+
+}
+
+
+
+// parity packet j of the completed block (the checksum is left to the caller)
+
+static inline void fec_parity(const fec_encoder *e, int j, udp_pack *out) {
+
+	const uint8_t *sym = e->parity + j * e->symbol_size;
+
+	bzero(out, PACK_HDR);
+	out->seq_num = htonl(e->last);
+	out->len = htons(e->len - 2);
+	out->type = PACK_PARITY;
+	out->fec[0] = j;
+	out->fec[1] = sym[0];
+	out->fec[2] = sym[1];
+	memcpy(out->data, sym + 2, e->len - 2);
+
+}
+
+
+
+// start the next block
+
+static inline void fec_next_block(fec_encoder *e) {
+
+	memset(e->parity, 0, e->m * e->symbol_size);
+	e->count = 0;
+	e->len = 2;
+
+}
+
+
+
+// window is the receive window, in packets
+
+static inline int fec_decoder_init(fec_decoder *d, int k, int m, unsigned payload, unsigned window) {
+
+	int b;
+
+	fec_init();
+
+	bzero(d, sizeof *d);
+	d->k = k;
+	d->m = m;
+	d->symbol_size = 2 + payload;
+	d->rebuilt_size = (PACK_HDR + payload + 3) & ~(size_t)3;
+
+	// from the block of the next packet to be written to the block of the last one the window takes
+	d->nblocks = window / k + 2;
+	d->max_rebuilt = d->nblocks * m;
+
+	d->blocks = calloc(d->nblocks, sizeof *d->blocks);
+	d->rebuilt = malloc(d->max_rebuilt * d->rebuilt_size);
+	d->scratch = malloc(d->symbol_size);
+	if (d->blocks == NULL || d->rebuilt == NULL || d->scratch == NULL) {
+		return -1;
+	}
+
+	for (b = 0; b < d->nblocks; b++) {
+		d->blocks[b].index = -1;
+		d->blocks[b].sum = calloc(m, d->symbol_size);
+		d->blocks[b].parity = calloc(m, d->symbol_size);
+		if (d->blocks[b].sum == NULL || d->blocks[b].parity == NULL) {
+			return -1;
+		}
+	}
+
+	return 0;
+
+}
+
+
+
+// the slot of block index, cleared when it held an older block; NULL for a block that is already gone
+
+static inline fec_block *fec_get_block(fec_decoder *d, long long index) {
+
+	fec_block *blk = &d->blocks[index % d->nblocks];
+
+	if (blk->index > index) {
+		return NULL;
+	}
+
+	if (blk->index < index) {
+		blk->index = index;
+		blk->have = 0;
+		blk->parity_have = 0;
+		blk->k = d->k;
+		blk->done = 0;
+		blk->len = 0;
+		memset(blk->sum, 0, d->m * d->symbol_size);
+		memset(blk->parity, 0, d->m * d->symbol_size);
+	}
+
+	return blk;
+
+}
+
+
+
+// rebuild the missing packets of a block once enough parity has arrived
+
+static inline void fec_try_rebuild(fec_decoder *d, fec_block *blk) {
+
+	uint8_t a[FEC_MAX_M][2 * FEC_MAX_M];
+	int missing[FEC_MAX_M], rows[FEC_MAX_M];
+	int nmissing = 0, nrows = 0, i, j, r, c;
+	uint8_t *res, *sym, t;
+	udp_pack *p;
+	unsigned len;
+
+	if (blk->done || blk->len == 0) {
+		return;
+	}
+
+	for (i = 0; i < blk->k; i++) {
+		if (!(blk->have & (1ULL << i))) {
+			if (nmissing == d->m) {
+				return;
+			}
+			missing[nmissing++] = i;
+		}
+	}
+	for (j = 0; j < d->m && nrows < nmissing; j++) {
+		if (blk->parity_have & (1u << j)) {
+			rows[nrows++] = j;
+		}
+	}
+
+	if (nmissing == 0) {
+		blk->done = 1;
+		return;
+	}
+	if (nrows < nmissing || d->nrebuilt + nmissing > d->max_rebuilt) {
+		return;
+	}
+
+	// what the packets that arrived do not explain: parity minus the running sum, in place
+	for (r = 0; r < nrows; r++) {
+		fec_mul_add(blk->parity + rows[r] * d->symbol_size, blk->sum + rows[r] * d->symbol_size, 1, blk->len);
+	}
+
+	// invert the rows x missing columns part of the matrix (Gauss-Jordan next to the identity)
+	for (r = 0; r < nmissing; r++) {
+		for (c = 0; c < nmissing; c++) {
+			a[r][c] = fec_coef[rows[r]][missing[c]];
+			a[r][nmissing + c] = r == c;
+		}
+	}
+	for (c = 0; c < nmissing; c++) {
+		for (r = c; r < nmissing && a[r][c] == 0; r++) {
+		}
+		if (r == nmissing) {
+			blk->done = 1;
+			return;
+		}
+		for (i = 0; i < 2 * nmissing; i++) {
+			t = a[c][i]; a[c][i] = a[r][i]; a[r][i] = t;
+		}
+		t = fec_inv(a[c][c]);
+		for (i = 0; i < 2 * nmissing; i++) {
+			a[c][i] = fec_mul(a[c][i], t);
+		}
+		for (r = 0; r < nmissing; r++) {
+			if (r != c && a[r][c] != 0) {
+				t = a[r][c];
+				for (i = 0; i < 2 * nmissing; i++) {
+					a[r][i] ^= fec_mul(t, a[c][i]);
+				}
+			}
+		}
+	}
+
+	// each missing symbol is a combination of the residues, written straight into a rebuilt packet
+	for (c = 0; c < nmissing; c++) {
+
+		// the symbol's length lands in fec[1], fec[2] and its data in place; the header is written after
+		p = (udp_pack *)(d->rebuilt + (d->nrebuilt + c) * d->rebuilt_size);
+		sym = (uint8_t *)p->data - 2;
+
+		memset(sym, 0, blk->len);
+		for (r = 0; r < nmissing; r++) {
+			res = blk->parity + rows[r] * d->symbol_size;
+			fec_mul_add(sym, res, a[c][nmissing + r], blk->len);
+		}
+
+		len = sym[0] << 8 | sym[1];
+		if (len > blk->len - 2) {
+			blk->done = 1;
+			return;
+		}
+
+		memset(p, 0, PACK_HDR);
+		p->seq_num = htonl(1 + blk->index * d->k + missing[c]);
+		p->len = htons(len);
+		p->type = PACK_DATA;
+	}
+
+	d->nrebuilt += nmissing;
+	d->rebuilt_total += nmissing;
+	blk->have |= (1ULL << blk->k) - 1;
+	blk->done = 1;
+
+}
+
+
+
+// a data packet arrived for the first time
+
+static inline void fec_add_data(fec_decoder *d, const udp_pack *p) {
+
+	uint32_t seq = ntohl(p->seq_num);
+	fec_block *blk;
+	unsigned n, i = (seq - 1) % d->k;
+	int j;
+
+	if (seq == 0 || (blk = fec_get_block(d, (seq - 1) / d->k)) == NULL || (blk->have & (1ULL << i))) {
+		return;
+	}
+
+	blk->have |= 1ULL << i;
+
+	// the end packet has the last block's length (its parity says the same)
+	if (p->len == 0) {
+		blk->k = i + 1;
+	}
+
+	if (blk->done) {
+		return;
+	}
+
+	n = fec_symbol(p, p->data, d->scratch);
+	for (j = 0; j < d->m; j++) {
+		fec_mul_add(blk->sum + j * d->symbol_size, d->scratch, fec_coef[j][i], n);
+	}
+
+	fec_try_rebuild(d, blk);
+
+}
+
+
+
+// a parity packet arrived (checksum already checked)
+
+static inline void fec_add_parity(fec_decoder *d, const udp_pack *p) {
+
+	uint32_t last = ntohl(p->seq_num);
+	fec_block *blk;
+	uint8_t *sym;
+	int j = p->fec[0];
+
+	d->parity_received++;
+
+	if (last == 0 || j >= d->m || (size_t)2 + ntohs(p->len) > d->symbol_size) {
+		return;
+	}
+	if ((blk = fec_get_block(d, (last - 1) / d->k)) == NULL || blk->done || (blk->parity_have & (1u << j))) {
+		return;
+	}
+
+	blk->k = (last - 1) % d->k + 1;
+	blk->len = 2 + ntohs(p->len);
+	blk->parity_have |= 1u << j;
+
+	sym = blk->parity + j * d->symbol_size;
+	sym[0] = p->fec[1];
+	sym[1] = p->fec[2];
+	memcpy(sym + 2, p->data, ntohs(p->len));
+
+	fec_try_rebuild(d, blk);
+
+}
+
+
+
+// the next rebuilt packet (without its checksum), NULL when all have been taken
+
+static inline udp_pack *fec_take(fec_decoder *d) {
+
+	udp_pack *p;
+
+	if (d->taken == d->nrebuilt) {
+		d->taken = d->nrebuilt = 0;
+		return NULL;
+	}
+
+	p = (udp_pack *)(d->rebuilt + d->taken++ * d->rebuilt_size);
+
+	return p;
+
+}
+
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * File name: impair.h
+ * Description: A simulated unreliable channel between the programs and their sockets, for testing the
+ * protocol and for measuring it at a known loss rate. Every datagram a program is about to send goes
+ * through the impairment first, which may drop it, flip one of its bits, send it twice, or hold it back
+ * for a while; the datagrams held back go out when their time comes. It is set with one spec string
+ * (-i on the command line) of comma-separated settings, rates in percent and times in milliseconds:
+ *
+ *   loss=P        drop a datagram with probability P
+ *   ge=P:R[:H[:K]]  Gilbert-Elliott burst loss: the channel turns bad with probability P per datagram
+ *                 and good again with R, and drops H percent of the datagrams while bad (100 by default)
+ *                 and K percent while good (0 by default); the mean burst is 100 / R datagrams
+ *   corrupt=P     flip one random bit of a datagram (the receiver's checksum must catch it)
+ *   dup=P         send a datagram twice
+ *   delay=MS      hold every datagram back this long
+ *   jitter=MS     plus or minus up to this much, uniformly, so datagrams may overtake each other
+ *   reorder=P     hold a datagram back gap milliseconds longer than the others, so the next ones overtake it
+ *   gap=MS        the extra time of a reordered datagram (1 ms by default)
+ *   seed=N        seed of the random numbers (1 by default)
+ *
+ * for example -i loss=2,ge=1:25,delay=10,jitter=2,seed=7. The decisions come from a xoshiro256** generator
+ * of their own, so the same seed makes the same decisions for the same sequence of datagrams, independent
+ * of rand() and of the other side. Without -i the programs do not call into the impairment at all.
+ *
+ * Referencer:
+ * https://man7.org/linux/man-pages/man8/tc-netem.8.html
+ * https://prng.di.unimi.it/
+ * https://en.wikipedia.org/wiki/Burst_error#Gilbert%E2%80%93Elliott_model
+ *
+ */
+
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+
+#define IMPAIR_MAX_HELD 65536 /* datagrams held back at once, more are dropped like a full queue */
+#define IMPAIR_DEFAULT_GAP 0.001 /* seconds a reordered datagram is held back beyond the others */
+
+// a datagram held back, due at a time
+typedef struct impair_held {
+	double due;
+	unsigned long long order; // ties go out in the order they came
+	size_t size;
+	struct sockaddr_in addr;
+	char *buf;
+} impair_held;
+
+typedef struct impairment {
+	int on;
+
+	// probabilities (0 to 1) and seconds
+	double loss, corrupt, dup, reorder;
+	double delay, jitter, gap;
+	double ge_p, ge_r, ge_bad_loss, ge_good_loss;
+	int ge, ge_bad;
+
+	uint64_t seed, rng[4];
+
+	// datagrams held back, a min-heap on the due time
+	impair_held *held;
+	int nheld, held_size;
+	unsigned long long order;
+
+	unsigned long long datagrams, lost, corrupted, duplicated, reordered, delayed;
+} impairment;
+
+
+
+// splitmix64, to spread a seed over the generator state
+
+static inline uint64_t impair_splitmix(uint64_t *x) {
+
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return z ^ (z >> 31);
+
+}
+
+
+
+// start the generator over from seed, mixed with salt (a worker number, so every worker draws its own numbers)
+
+static inline void impair_seed(impairment *im, uint64_t salt) {
+
+	uint64_t x = im->seed ^ salt * 0xd1342543de82ef95ULL;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		im->rng[i] = impair_splitmix(&x);
+	}
+	im->ge_bad = 0;
+
+}
+
+
+
+// xoshiro256**
+
+static inline uint64_t impair_next64(impairment *im) {
+
+	uint64_t *s = im->rng;
+	uint64_t result = s[1] * 5, t = s[1] << 17;
+
+	result = (result << 7 | result >> 57) * 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = s[3] << 45 | s[3] >> 19;
+
+	return result;
+
+}
+
+
+
+// uniform in [0, 1)
+
+static inline double impair_uniform(impairment *im) {
+
+	return (impair_next64(im) >> 11) * 0x1.0p-53;
+
+}
+
+
+
+static inline int impair_chance(impairment *im, double p) {
+
+	return p > 0 && impair_uniform(im) < p;
+
+}
+
+
+
+// read a spec such as "loss=2,delay=10,seed=7"; returns 0, or -1 with a message for a setting that makes no sense
+
+static inline int impair_parse(impairment *im, const char *spec) {
+
+	char *copy, *item, *save, *value;
+	double h = 100, k = 0, v;
+	int ok;
+
+	memset(im, 0, sizeof *im);
+	im->gap = IMPAIR_DEFAULT_GAP;
+	im->seed = 1;
+
+	copy = strdup(spec);
+	if (copy == NULL) {
+		return -1;
+	}
+
+	for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+
+		value = strchr(item, '=');
+		if (value == NULL) {
+			printf("ERROR: impairment setting %s has no value\n", item);
+			free(copy);
+			return -1;
+		}
+		*value++ = '\0';
+
+		v = atof(value);
+		ok = v >= 0;
+
+		if (strcmp(item, "loss") == 0) {
+			im->loss = v / 100;
+			ok = ok && v <= 100;
+		}
+		else if (strcmp(item, "corrupt") == 0) {
+			im->corrupt = v / 100;
+			ok = ok && v <= 100;
+		}
+		else if (strcmp(item, "dup") == 0) {
+			im->dup = v / 100;
+			ok = ok && v <= 100;
+		}
+		else if (strcmp(item, "reorder") == 0) {
+			im->reorder = v / 100;
+			ok = ok && v <= 100;
+		}
+		else if (strcmp(item, "delay") == 0) {
+			im->delay = v / 1e3;
+		}
+		else if (strcmp(item, "jitter") == 0) {
+			im->jitter = v / 1e3;
+		}
+		else if (strcmp(item, "gap") == 0) {
+			im->gap = v / 1e3;
+		}
+		else if (strcmp(item, "seed") == 0) {
+			im->seed = strtoull(value, NULL, 0);
+		}
+		else if (strcmp(item, "ge") == 0) {
+			h = 100;
+			k = 0;
+			ok = sscanf(value, "%lf:%lf:%lf:%lf", &im->ge_p, &im->ge_r, &h, &k) >= 2 &&
+				im->ge_p >= 0 && im->ge_p <= 100 && im->ge_r > 0 && im->ge_r <= 100 &&
+				h >= 0 && h <= 100 && k >= 0 && k <= 100;
+			im->ge_p /= 100;
+			im->ge_r /= 100;
+			im->ge_bad_loss = h / 100;
+			im->ge_good_loss = k / 100;
+			im->ge = 1;
+		}
+		else {
+			printf("ERROR: unknown impairment %s, use loss, ge, corrupt, dup, reorder, gap, delay, jitter or seed\n", item);
+			free(copy);
+			return -1;
+		}
+
+		if (!ok) {
+			printf("ERROR: impairment %s=%s is out of range\n", item, value);
+			free(copy);
+			return -1;
+		}
+	}
+
+	free(copy);
+
+	im->on = 1;
+	impair_seed(im, 0);
+
+	return 0;
+
+}
+
+
+
+// the settings, for the programs to print
+
+static inline void impair_print(const impairment *im, const char *who) {
+
+	printf("%s impairment: loss %.2f%%, corrupt %.2f%%, dup %.2f%%, reorder %.2f%% (gap %.1f ms), delay %.1f ms +- %.1f ms",
+		who, im->loss * 100, im->corrupt * 100, im->dup * 100, im->reorder * 100, im->gap * 1e3,
+		im->delay * 1e3, im->jitter * 1e3);
+	if (im->ge) {
+		printf(", Gilbert-Elliott %.2f%%:%.2f%% (loss %.0f%% bad, %.0f%% good)", im->ge_p * 100, im->ge_r * 100,
+			im->ge_bad_loss * 100, im->ge_good_loss * 100);
+	}
+	printf(", seed %llu\n", (unsigned long long)im->seed);
+
+}
+
+
+
+static inline void impair_report(const impairment *im, const char *who) {
+
+	printf("%s impairment: %llu datagrams, %llu lost, %llu corrupted, %llu duplicated, %llu reordered, %llu delayed\n",
+		who, im->datagrams, im->lost, im->corrupted, im->duplicated, im->reordered, im->delayed);
+
+}
+
+
+
+// hold a copy of a datagram back until due; a full queue drops it
+
+static inline void impair_hold(impairment *im, const void *buf, size_t size, const struct sockaddr_in *addr, double due) {
+
+	impair_held h, *grown;
+	int i, parent;
+
+	if (im->nheld == IMPAIR_MAX_HELD) {
+		im->lost++;
+		return;
+	}
+
+	if (im->nheld == im->held_size) {
+		im->held_size = im->held_size ? im->held_size * 2 : 64;
+		grown = realloc(im->held, im->held_size * sizeof *im->held);
+		if (grown == NULL) {
+			printf("ERROR: out of memory\n");
+			exit(1);
+		}
+		im->held = grown;
+	}
+
+	h.due = due;
+	h.order = im->order++;
+	h.size = size;
+	h.addr = *addr;
+	h.buf = malloc(size);
+	if (h.buf == NULL) {
+		printf("ERROR: out of memory\n");
+		exit(1);
+	}
+	memcpy(h.buf, buf, size);
+
+	// sift up
+	for (i = im->nheld++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (im->held[parent].due < h.due || (im->held[parent].due == h.due && im->held[parent].order < h.order)) {
+			break;
+		}
+		im->held[i] = im->held[parent];
+	}
+	im->held[i] = h;
+
+}
+
+
+
+// the fate of a datagram about to be sent from buf (which may be corrupted in place)
+// returns how many copies to send now: 0 when it is lost or held back, 1, or 2 when it is duplicated
+
+static inline int impair_datagram(impairment *im, char *buf, size_t size, const struct sockaddr_in *addr, double now) {
+
+	int copies = 1, i, lost = 0;
+	size_t bit;
+	double hold;
+
+	im->datagrams++;
+
+	// the Gilbert-Elliott channel changes state first, then drops by the loss rate of that state
+	if (im->ge) {
+		if (im->ge_bad ? impair_chance(im, im->ge_r) : impair_chance(im, im->ge_p)) {
+			im->ge_bad = !im->ge_bad;
+		}
+		lost = impair_chance(im, im->ge_bad ? im->ge_bad_loss : im->ge_good_loss);
+	}
+	if (impair_chance(im, im->loss) || lost) {
+		im->lost++;
+		return 0;
+	}
+
+	if (size > 0 && impair_chance(im, im->corrupt)) {
+		bit = impair_next64(im) % (size * 8);
+		buf[bit / 8] ^= 1 << (bit % 8);
+		im->corrupted++;
+	}
+
+	if (impair_chance(im, im->dup)) {
+		copies = 2;
+		im->duplicated++;
+	}
+
+	if (im->delay == 0 && im->jitter == 0 && im->reorder == 0) {
+		return copies;
+	}
+
+	// every copy is held back on its own, as if it took its own way through the network
+	for (i = 0; i < copies; i++) {
+		hold = im->delay;
+		if (im->jitter > 0) {
+			hold += (2 * impair_uniform(im) - 1) * im->jitter;
+		}
+		if (impair_chance(im, im->reorder)) {
+			hold += im->gap;
+			im->reordered++;
+		}
+		if (hold < 0) {
+			hold = 0;
+		}
+		impair_hold(im, buf, size, addr, now + hold);
+		if (hold > 0) {
+			im->delayed++;
+		}
+	}
+
+	return 0;
+
+}
+
+
+
+// when the next datagram held back is due, 0 when none is
+
+static inline double impair_next_due(const impairment *im) {
+
+	return im->nheld > 0 ? im->held[0].due : 0;
+
+}
+
+
+
+// take the next datagram held back that is due by now into buf (room for max bytes)
+// returns its size, or 0 when none is due
+
+static inline size_t impair_take(impairment *im, double now, char *buf, size_t max, struct sockaddr_in *addr) {
+
+	impair_held h, last;
+	size_t size;
+	int i, child;
+
+	if (im->nheld == 0 || im->held[0].due > now) {
+		return 0;
+	}
+
+	h = im->held[0];
+	last = im->held[--im->nheld];
+
+	// sift down
+	for (i = 0; (child = 2 * i + 1) < im->nheld; i = child) {
+		if (child + 1 < im->nheld && (im->held[child + 1].due < im->held[child].due ||
+			(im->held[child + 1].due == im->held[child].due && im->held[child + 1].order < im->held[child].order))) {
+			child++;
+		}
+		if (last.due < im->held[child].due || (last.due == im->held[child].due && last.order < im->held[child].order)) {
+			break;
+		}
+		im->held[i] = im->held[child];
+	}
+	if (im->nheld > 0) {
+		im->held[i] = last;
+	}
+
+	size = h.size < max ? h.size : max;
+	memcpy(buf, h.buf, size);
+	*addr = h.addr;
+	free(h.buf);
+
+	return size;
+
+}
+
+
+
+static inline void impair_free(impairment *im) {
+
+	while (im->nheld > 0) {
+		free(im->held[--im->nheld].buf);
+	}
+	free(im->held);
+	im->held = NULL;
+	im->held_size = 0;
+
+}
+
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * File name: proto.h
+ * Description: The packet format shared by the UDP client and server. Every datagram is one packet:
+ * a 20-byte header followed by len bytes of data, so a packet is only as long as its content.
+ *
+ * A transfer starts with the client probing the path: PACK_PROBE packets of different sizes, each
+ * echoed by a PACK_PROBE_ACK, find the largest datagram that gets through. Packet 0 then proposes
+ * that payload size and the client's window, followed by the new file name, and its ACK carries
+ * the payload size and window the server agreed to. Data packets 1..n follow, and an empty data
+ * packet ends the file. Every packet of a transfer carries the session ID the client picked for it,
+ * so the server tells apart the transfers of several clients, or of one client port reused.
+ *
+ * Data packets are acknowledged with PACK_SACK packets: a cumulative ACK (every packet before it
+ * has arrived) and a bitmap of the packets after it that have arrived too. One SACK covers the
+ * whole receive window, so the server sends one for several packets, and the client learns exactly
+ * which packets are missing. The cumulative ACK passes the end packet only once the file is written.
+ *
+ * With forward error correction the client follows every block of fec_k data packets with fec_m
+ * PACK_PARITY packets, from which the server rebuilds lost packets of the block (fec.h).
+ *
+ * All header fields are in network byte order. The checksum covers the header (with the checksum
+ * field set to zero) and the data, and is of the kind the packet names in its check field: the Internet
+ * checksum or CRC-32C (checksum.h). The client picks the kind, and the server answers in the same kind.
+ *
+ */
+
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "checksum.h"
+
+
+#define PACK_HDR 20 /* bytes of header in front of the data */
+#define IP_UDP_HDR 28 /* IPv4 and UDP headers in front of a packet */
+#define MAX_DATAGRAM 65507 /* largest UDP payload over IPv4 */
+#define MAX_PAYLOAD (MAX_DATAGRAM - PACK_HDR)
+#define SAFE_PAYLOAD 528 /* fits the 576-byte minimum IPv4 MTU, no probe needed */
+#define NAME_MAX_LEN 255 /* longest new file name */
+#define SACK_MAX_WORDS 128 /* bitmap words for a window of 4096 packets */
+
+enum pack_type {
+	PACK_DATA, // packet 0 (session parameters and the file name), the file, an empty end packet
+	PACK_ACK, // acknowledges packet 0 with the agreed session parameters
+	PACK_PROBE, // path MTU probe, the data is padding
+	PACK_PROBE_ACK,
+	PACK_SACK, // acknowledges data packets, seq_num is the packet that triggered it
+	PACK_PARITY // FEC parity of a block of data packets (fec.h), seq_num is the last packet of the block
+};
+
+typedef struct udp_pack {
+	uint32_t seq_num;
+	uint32_t session; // picked at random by the client for each transfer, echoed by the server
+	uint32_t checksum; // over the header (with the checksum zeroed) and the data
+	uint16_t len; // bytes of data after the header
+	uint8_t type;
+	uint8_t check; // enum checksum_kind
+	uint8_t reserved;
+	uint8_t fec[3]; // parity packets: parity row, then the parity of the length fields; zero otherwise
+	char data[MAX_PAYLOAD];
+} udp_pack;
+
+// at the start of the data of packet 0 (proposed, the file name follows) and of its ACK (agreed)
+typedef struct session_params {
+	uint32_t payload; // data bytes per packet
+	uint32_t window; // packets in flight
+	uint8_t fec_k; // data packets per FEC block, 0 without FEC
+	uint8_t fec_m; // parity packets per FEC block
+	uint16_t reserved;
+	uint32_t size_hi, size_lo; // bytes in the file, announced by the client (echoed in the ACK)
+} session_params;
+
+// data of a PACK_SACK: packets before cum_ack have arrived, and so has packet cum_ack + 1 + i for
+// every bit i set in the bitmap (bit i % 32 of word i / 32); trailing zero words are left out
+typedef struct sack_info {
+	uint32_t cum_ack;
+	uint32_t bitmap[SACK_MAX_WORDS];
+} sack_info;
+
+// bytes a packet takes on the wire
+#define PACK_SIZE(p) ((size_t)PACK_HDR + ntohs((p)->len))
+
+
+
+// checksum of a packet as it goes on the wire, of the kind its check field names, in network byte order,
+// with its len bytes of data at data (in the packet, or elsewhere); a kind this side does not know never matches
+
+static inline uint32_t packet_checksum_data(udp_pack *packet, const char *data) {
+
+	uint32_t sent = packet->checksum, sum;
+	size_t size = ntohs(packet->len);
+
+	packet->checksum = 0;
+
+	if (packet->check == CHECKSUM_CRC32C) {
+		sum = htonl(data == packet->data ? crc32c(packet, PACK_HDR + size) : crc32c_split(packet, PACK_HDR, data, size));
+	}
+	else if (packet->check == CHECKSUM_INET) {
+		sum = htonl(data == packet->data ? inet_checksum(packet, PACK_HDR + size) :
+			inet_checksum_split(packet, PACK_HDR, data, size));
+	}
+	else {
+		sum = ~sent;
+	}
+
+	packet->checksum = sent;
+
+	return sum;
+
+}
+
+
+
+static inline uint32_t packet_checksum(udp_pack *packet) {
+
+	return packet_checksum_data(packet, packet->data);
+
+}
+
+
+#endif
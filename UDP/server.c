@@ -1,131 +1,1067 @@
-/* 
+/*
  * Author: Chi Zhang (czhang2@scu.edu)
  * File name: server.c
  * Description: The file builds the server side of UDP (User Datagram Protocol). The server creates
  * a new text file using the file name and data received from the client. The server receives the
- * file data in chunks of 10 bytes and then writes the data into the new file in chunks of 5 bytes.
- * For every chunk of data received, the server sends back an acknowledgement.
- * 
- * Random functions are used to create the scenarios where acknowledgements are lost or duplicated, 
- * in order to test the program's ability to resolve these situations and create a correct file.
+ * file data in packets of the size agreed with the client and writes them into the new file in order.
+ * For every packet of data received, the server sends back an acknowledgement.
+ *
+ * Packet 0 opens the session: it proposes a payload size (found by the client's path MTU probes,
+ * which the server echoes as they come) and a window, and names the new file. The server answers
+ * with the smaller of each proposal and its own limits: the largest packet it takes, its own
+ * window, and the number of packets its socket receive buffer holds.
+ *
+ * The server takes any number of uploads at once. Each packet 0 from a new client address and session
+ * ID (which the client puts in every packet) opens a session of its own: its parameters, sequence
+ * state, reorder buffer, SACK state and new file. A session ends LINGER seconds after its file is
+ * complete, or after -t seconds (120 by default) without a packet from a client that never finished.
+ * The server runs until it is stopped, or until -n sessions are over. With -j N it runs N workers on
+ * their own threads, each with its own SO_REUSEPORT socket on the port and its own sessions; the
+ * kernel hashes every client address to one of the sockets, so the sessions spread across cores and
+ * the workers share nothing.
+ *
+ * The transfer uses selective repeat: packets carry 32-bit sequence numbers and may arrive out of
+ * order. The next packet in sequence goes straight into the file; any other good packet inside the
+ * receive window (-w, 32 by default) is parked in a reorder buffer, allocated for the session when
+ * the first one arrives out of order, until the run of packets before it is complete.
+ *
+ * Acknowledgements are selective (SACK): one ACK holds the cumulative ACK (the next packet to be
+ * written) and a bitmap of the packets held after it, so it covers the whole window and tells the
+ * client exactly which packets are missing. ACKs are delayed and coalesced: one goes out once -a
+ * new packets (2 by default) have arrived or ACK_DELAY after the first of them, whichever comes
+ * first, and at once when a packet arrives out of order, fills a hole, or is a duplicate (its ACK
+ * was lost). The cumulative ACK passes the end packet only once the whole file is written, so that
+ * ACK alone tells the client the transfer is complete.
+ *
+ * Packets are taken up to -b at a time (32 by default) with one recvmmsg() call, and the ACKs for a
+ * whole batch go back with one sendmmsg() call. With -g the socket also turns on UDP_GRO, so the
+ * kernel hands over runs of same-sized datagrams from the client coalesced into one large buffer
+ * that the server cuts back into packets; without kernel support it receives them one by one.
+ *
+ * When packet 0 proposes forward error correction (client -f K:M), the server takes the parity
+ * packets that follow every block of K data packets and rebuilds up to M lost packets of a block
+ * from them (fec.h). A rebuilt packet goes through the reorder buffer like one that arrived, so the
+ * next SACK already covers it and the client does not resend it.
+ *
+ * With -i the ACKs go through a simulated unreliable channel (impair.h) that loses, damages, duplicates,
+ * reorders or delays them as described, to test the client's ability to resolve these situations. Each
+ * worker draws from its own generator, seeded from the seed of the description and its number.
+ *
+ * Every worker counts what it receives, writes and sends into counters and histograms of its own
+ * (../common/metrics.h): datagrams and bytes, packets written, duplicates, packets out of order,
+ * checksum failures, FEC rebuilds, ACKs, sessions, idle timeouts, and how long sessions last and SACKs
+ * wait. With -l the totals go to a JSON line log once a second (and once more at exit), with -m they
+ * are served in the Prometheus text format on 127.0.0.1:<port> or on a Unix socket.
+ *
+ * The workers print through ../common/log.h: a log site only copies its arguments into a ring of the
+ * worker's own and a background thread formats and prints them, so the terminal or a piped log never
+ * holds up the receive loop. Per-packet tracing (checksums, sequence numbers, ACKs) is at the trace
+ * level, bad packets at debug and sessions at info, the default of -v.
+ *
+ * Every worker hands the data of its files to a writer thread of its own (../common/writer.h) through a
+ * bounded ring of large buffers, so a slow disk does not hold up the receives and the ACKs. Packet 0
+ * announces the size of the file; with -o the file is preallocated, written under a temp name and
+ * renamed once complete, with its writeback paced and optionally O_DIRECT (../common/outfile.h).
  *
  * Referencer:
  * Socket Programming in C
  * http://stackoverflow.com/questions/3060950/how-to-get-ip-address-from-sock-structure-in-c
  * http://stackoverflow.com/questions/5850000/how-to-split-array-into-two-arrays-in-c
+ * http://man7.org/linux/man-pages/man2/recvmmsg.2.html
+ * https://lwn.net/Articles/768995/
+ * https://tools.ietf.org/html/rfc8899
+ * https://tools.ietf.org/html/rfc2018
+ * https://tools.ietf.org/html/rfc1122#page-96
+ * https://tools.ietf.org/html/rfc5510
+ * https://lwn.net/Articles/542629/
+ * https://man7.org/linux/man-pages/man8/tc-netem.8.html
+ * https://prometheus.io/docs/instrumenting/exposition_formats/
  *
  */
 
 
 
+#define _GNU_SOURCE /* sendmmsg, recvmmsg */
 
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "proto.h"
+#include "fec.h"
+#include "impair.h"
+#include "../common/metrics.h"
+#include "../common/log.h"
+#include "../common/outfile.h"
+#include "../common/writer.h"
+
+#ifndef UDP_GRO
+#define UDP_GRO 104 /* linux/udp.h, missing from older libc headers */
+#endif
+
+
+
+#define DEFAULT_WINDOW 32 /* packets held in the reorder buffer */
+#define MAX_WINDOW 4096
+#define DEFAULT_BATCH 32 /* datagrams per recvmmsg/sendmmsg call */
+#define MAX_BATCH 1024
+#define GRO_BUF 65536 /* one coalesced receive with UDP_GRO */
+#define MAX_SEGMENTS 64 /* datagrams the kernel coalesces into one GRO receive */
+
+#define ACK_BUF (PACK_HDR + sizeof(sack_info)) /* the longest reply, a SACK of the largest window */
+#define SKB_OVERHEAD 1024 /* rough kernel bookkeeping per datagram in the receive buffer */
+
+#define DEFAULT_ACK_EVERY 2 /* new packets per SACK */
+#define ACK_DELAY 0.001 /* seconds a SACK waits for more packets, well below the client's RTO_MIN */
+
+#define LINGER 10 /* seconds to keep answering retransmits once the file is complete */
+#define DEFAULT_IDLE_TIMEOUT 120 /* seconds without a packet before an unfinished session is dropped */
+#define SWEEP_INTERVAL 1.0 /* seconds between two looks for sessions that are over */
+
+#define MAX_SESSIONS 4096 /* open sessions per worker */
+#define SESSION_BUCKETS 8192 /* hash chains per worker, a power of two */
+#define MAX_WORKERS 256
+
+// one datagram of a received batch, a whole message or a segment of a coalesced one
+typedef struct dgram_seg {
+	char *data;
+	unsigned len;
+	int msg; // the message it came in, for the sender address
+} dgram_seg;
+
+// datagrams for one sendmmsg() or recvmmsg() call, allocated once and reused
+typedef struct dgram_batch {
+	char *bufs; // buf_size bytes per message
+	size_t buf_size;
+	struct sockaddr_in *addrs;
+	struct iovec *iov;
+	struct mmsghdr *msgs;
+	char *control; // ancillary data of each message (the UDP_GRO segment size)
+	dgram_seg *segs; // the datagrams of the last receive
+	int count; // datagrams queued
+	int size; // datagrams per call
+	unsigned long long calls, datagrams; // system calls made and datagrams moved
+} dgram_batch;
+
+#define GRO_CONTROL CMSG_SPACE(sizeof(int))
+
+// a packet waiting in the reorder buffer for the ones before it
+typedef struct rx_slot {
+	udp_pack *packet; // room for the agreed payload
+	int present;
+} rx_slot;
+
+// one upload, from its packet 0 until it is over; packets belong to it by client address and session ID
+typedef struct rx_session {
+	struct sockaddr_in addr;
+	uint32_t id;
+	struct rx_session *next; // hash chain
+	int index; // in the table's list of sessions
+
+	// agreed on with packet 0 (host order), its ACK (network order), the checksum of the replies
+	session_params params, ack;
+	int check;
+
+	writer_file *newfile; // on the worker's writer thread, NULL once handed back to it
+	off_t written;
+	char newfile_name[NAME_MAX_LEN + 1];
+
+	// receive window: packets [expected, expected + window), slot seq % window holds packet seq
+	char *slab; // the packets, allocated with the first one that arrives out of order
+	rx_slot *slots;
+	uint32_t expected;
+	int finished;
+	int failed; // its file could not be written, the session is dropped at the next sweep
+	unsigned long long received, duplicates, reordered;
+
+	// delayed SACK: new packets it covers, whether it must go at once, the packet it answers,
+	// whether the session is on the table's list of sessions owing one
+	int sack_pending, sack_now;
+	uint32_t sack_seq;
+	int acking;
+	double sack_since; // when the first packet it covers arrived
+
+	// forward error correction, when the session agreed on it
+	fec_decoder fec;
+
+	double opened, last_seen;
+} rx_session;
+
+// the sessions of one worker
+typedef struct session_table {
+	rx_session **buckets;
+	rx_session **all;
+	int count;
+	rx_session **acking; // sessions that owe their client a SACK
+	int nacking;
+	int rcv_bytes; // socket receive buffer the open windows take
+	int rcv_granted; // what the kernel granted so far
+} session_table;
+
+// one thread with its own socket on the port (SO_REUSEPORT) and its own sessions
+typedef struct worker {
+	pthread_t thread;
+	int id;
+	int sock;
+	int gro;
+	session_table table;
+	dgram_batch rx, acks;
+	impairment imp; // what the ACKs go through, off without -i
+	writer disk; // writes the files of its sessions, so that the disk never holds up the socket
+	metrics_shard *metrics; // its own counters, for the summary
+} worker;
+
+
+
+// settings from the command line, shared by the workers
+int port_num;
+int window = DEFAULT_WINDOW;
+int batch = DEFAULT_BATCH;
+int gro = 0;
+int ack_every = DEFAULT_ACK_EVERY;
+int workers = 1;
+int max_sessions = 0; // sessions to serve before exiting, 0 for no limit
+double idle_timeout = DEFAULT_IDLE_TIMEOUT;
+impairment impair_spec; // -i, every worker seeds its own copy
+outfile_opts output; // -o, how the files are written
+
+// sessions over, across the workers
+int sessions_done = 0;
+
+// what the workers count (metrics.h), each into its own shard
+enum {
+	M_DATAGRAMS, M_BYTES, M_PACKETS, M_WRITTEN, M_DUPLICATES, M_REORDERED, M_CHECKSUM, M_BAD, M_UNKNOWN,
+	M_PROBES, M_PARITY, M_REBUILT, M_ACKS, M_SESSIONS, M_FILES, M_INCOMPLETE, M_TIMEOUTS, M_DISK_STALLS,
+	M_COUNT
+};
+enum { H_SESSION, H_ACK_DELAY, H_COUNT };
+
+const metric_def counter_defs[M_COUNT] = {
+	[M_DATAGRAMS] = { "datagrams_received_total", "Datagrams received, each segment of a GRO receive counted" },
+	[M_BYTES] = { "received_bytes_total", "Bytes of the datagrams received, headers included" },
+	[M_PACKETS] = { "data_packets_total", "New data packets accepted into a session" },
+	[M_WRITTEN] = { "written_bytes_total", "File bytes written (goodput)" },
+	[M_DUPLICATES] = { "duplicate_packets_total", "Data packets received again" },
+	[M_REORDERED] = { "out_of_order_packets_total", "Data packets parked in the reorder buffer" },
+	[M_CHECKSUM] = { "checksum_failures_total", "Datagrams with a wrong length or checksum" },
+	[M_BAD] = { "bad_packets_total", "Datagrams with a good checksum that made no sense" },
+	[M_UNKNOWN] = { "unknown_session_packets_total", "Packets of sessions not open here" },
+	[M_PROBES] = { "probes_total", "Path MTU probes echoed" },
+	[M_PARITY] = { "parity_packets_total", "FEC parity packets received" },
+	[M_REBUILT] = { "rebuilt_packets_total", "Lost data packets rebuilt by FEC" },
+	[M_ACKS] = { "acks_sent_total", "ACKs and SACKs sent" },
+	[M_SESSIONS] = { "sessions_opened_total", "Sessions opened" },
+	[M_FILES] = { "files_received_total", "Files received whole" },
+	[M_INCOMPLETE] = { "files_incomplete_total", "Sessions that ended before the end of their file" },
+	[M_TIMEOUTS] = { "idle_timeouts_total", "Sessions dropped after the idle timeout" },
+	[M_DISK_STALLS] = { "disk_stalls_total", "Packets that waited for the writer thread to free a buffer" },
+};
+
+const metric_def hist_defs[H_COUNT] = {
+	[H_SESSION] = { "session_duration_seconds", "From packet 0 to the last packet of a session" },
+	[H_ACK_DELAY] = { "ack_delay_seconds", "From the first packet a SACK covers to the SACK" },
+};
+
+
+
+double now_seconds(void) {
+
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1e6;
 
+}
 
 
-#define BACKLOG 10 // how many pending connections queue will hold
 
-#define CHUNK 10 /* read 10 bytes at a time */
+// allocate a batch of size messages of buf_size bytes (plus room for a duplicate on top of a full batch)
+// a receive batch for coalesced GRO buffers passes GRO_BUF and gets room for MAX_SEGMENTS datagrams each
 
-typedef struct udp_pack {
-	int seq_num;
-	short checksum;
-	char data[CHUNK];
-} udp_pack;
+void batch_init(dgram_batch *b, int size, size_t buf_size) {
 
+	int i, max_segs = size * (buf_size >= GRO_BUF ? MAX_SEGMENTS : 1);
 
-// https://locklessinc.com/articles/tcp_checksum/
-unsigned short checksum(const char *buf, unsigned size)
-{
-	unsigned sum = 0;
-	int i;
+	bzero(b, sizeof *b);
+	b->size = size;
+	b->buf_size = buf_size;
+	b->bufs = calloc(size + 1, buf_size);
+	b->addrs = calloc(size + 1, sizeof *b->addrs);
+	b->iov = calloc(size + 1, sizeof *b->iov);
+	b->msgs = calloc(size + 1, sizeof *b->msgs);
+	b->control = calloc(size + 1, GRO_CONTROL);
+	b->segs = calloc(max_segs, sizeof *b->segs);
 
-	/* Accumulate checksum */
-	for (i = 0; i < size - 1; i += 2)
-	{
-		unsigned short word16 = *(unsigned short *) &buf[i];
-		sum += word16;
+	if (b->bufs == NULL || b->addrs == NULL || b->iov == NULL || b->msgs == NULL || b->control == NULL || b->segs == NULL) {
+		printf("ERROR: out of memory\n");
+		exit(1);
 	}
 
-	/* Handle odd-sized case */
-	if (size & 1)
-	{
-		unsigned short word16 = (unsigned char) buf[i];
-		sum += word16;
+	for (i = 0; i <= size; i++) {
+		b->iov[i].iov_base = b->bufs + i * buf_size;
+		b->iov[i].iov_len = buf_size;
+		b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+		b->msgs[i].msg_hdr.msg_namelen = sizeof b->addrs[i];
 	}
 
-	/* Fold to get the ones-complement result */
-	while (sum >> 16) sum = (sum & 0xFFFF)+(sum >> 16);
+}
+
+
+
+// send every queued datagram, as few sendmmsg() calls as the kernel allows
+
+int batch_flush(dgram_batch *b, int sock) {
+
+	int sent = 0, n;
+
+	while (sent < b->count) {
+		n = sendmmsg(sock, &b->msgs[sent], b->count - sent, 0);
+		if (n < 0) {
+			return -1;
+		}
+		sent += n;
+		b->calls++;
+	}
+
+	b->datagrams += b->count;
+	b->count = 0;
+
+	return 0;
 
-	/* Invert to get the negative in ones-complement arithmetic */
-	return ~sum;
 }
 
 
 
-int main(int argc, char *argv[]) {
+// wait for the next datagram and take whatever else has arrived with it, up to a batch
+// returns the number of datagrams received, listed in segs[] (coalesced GRO messages are cut into
+// their segments), or -1 when the receive failed or timed out
 
-	// set up variables
+int batch_recv(dgram_batch *b, int sock, int flags) {
 
-	int port_num;
-	char ip_addr[INET_ADDRSTRLEN];
-	
-	int new_sock; 
-	struct sockaddr_in sock_addr, recv_addr;
-	socklen_t size; 
+	int i, n, nsegs = 0, max_segs = b->size * (b->buf_size >= GRO_BUF ? MAX_SEGMENTS : 1);
+	unsigned seg_size, off;
+	struct cmsghdr *cmsg;
 
-	FILE *newfile;
+	for (i = 0; i < b->size; i++) {
+		b->msgs[i].msg_hdr.msg_namelen = sizeof b->addrs[i];
+		b->msgs[i].msg_hdr.msg_control = b->control + i * GRO_CONTROL;
+		b->msgs[i].msg_hdr.msg_controllen = GRO_CONTROL;
+		b->msgs[i].msg_len = 0;
+	}
 
-	udp_pack packet;
-	udp_pack packet_ack;
+	n = recvmmsg(sock, b->msgs, b->size, flags, NULL);
+	if (n <= 0) {
+		return -1;
+	}
 
+	b->calls++;
 
-	// examine the user input (only need a port here)
+	for (i = 0; i < n; i++) {
 
-	if (argc < 2) {
-		printf("ERROR: no port number input\n");
+		// a coalesced message says how long its segments are, the last one may be shorter
+		seg_size = b->msgs[i].msg_len;
+		for (cmsg = CMSG_FIRSTHDR(&b->msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&b->msgs[i].msg_hdr, cmsg)) {
+			if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+				seg_size = *(int *)CMSG_DATA(cmsg);
+			}
+		}
+
+		off = 0;
+		do {
+			b->segs[nsegs].data = b->bufs + i * b->buf_size + off;
+			b->segs[nsegs].len = b->msgs[i].msg_len - off < seg_size ? b->msgs[i].msg_len - off : seg_size;
+			b->segs[nsegs].msg = i;
+			nsegs++;
+			off += seg_size;
+		} while (off < b->msgs[i].msg_len && seg_size > 0 && nsegs < max_segs);
+	}
+
+	b->datagrams += nsegs;
+
+	return nsegs;
+
+}
+
+
+
+// queue a reply of the given type to packet seq of session id, carrying len bytes of data
+// ACKs go through the impairment when there is one, probe echoes measure the path and do not
+
+int queue_reply(dgram_batch *b, int new_sock, impairment *im, int type, int check, uint32_t id, uint32_t seq, const void *data,
+	unsigned len, struct sockaddr_in *recv_addr) {
+
+	udp_pack *reply = (udp_pack *)(b->bufs + b->count * b->buf_size);
+	int copies = 1, i;
+
+	bzero(reply, PACK_HDR);
+	reply->seq_num = htonl(seq);
+	reply->session = htonl(id);
+	reply->len = htons(len);
+	reply->type = type;
+	reply->check = check;
+	if (len > 0) {
+		memcpy(reply->data, data, len);
+	}
+	reply->checksum = packet_checksum(reply);
+
+	if (im->on && type != PACK_PROBE_ACK) {
+		copies = impair_datagram(im, (char *)reply, PACK_SIZE(reply), recv_addr, now_seconds());
+	}
+
+	// queue the reply, twice for a duplicate
+	for (i = 0; i < copies; i++) {
+		if (i > 0) {
+			memcpy(b->bufs + b->count * b->buf_size, reply, PACK_SIZE(reply));
+		}
+		b->iov[b->count].iov_len = PACK_SIZE(reply);
+		b->addrs[b->count++] = *recv_addr;
+	}
+
+	if (type != PACK_PROBE_ACK) {
+		metric_add(M_ACKS, 1);
+	}
+
+	if (type == PACK_ACK && copies > 0) {
+		log_msg(LOG_TRACE, "**************************************\nACK: %u, %u\n**************************************\n", seq, ntohl(reply->checksum));
+	}
+
+	// a full batch goes out at once
+	if (b->count >= b->size) {
+		return batch_flush(b, new_sock);
+	}
+
+	return 0;
+
+}
+
+
+
+// queue a SACK of everything a session holds so far: the cumulative ACK expected and a bitmap of the
+// window after it, answering packet sack_seq
+
+int queue_sack(dgram_batch *b, int new_sock, impairment *im, const rx_session *s) {
+
+	sack_info sack;
+	unsigned i, words = 0, window = s->params.window;
+
+	bzero(&sack, sizeof sack);
+
+	// packet expected itself is missing, or it would have been written
+	for (i = 0; i + 1 < window; i++) {
+		if (s->slots[(s->expected + 1 + i) % window].present) {
+			sack.bitmap[i / 32] |= 1u << (i % 32);
+			words = i / 32 + 1;
+		}
+	}
+
+	sack.cum_ack = htonl(s->expected);
+	for (i = 0; i < words; i++) {
+		sack.bitmap[i] = htonl(sack.bitmap[i]);
+	}
+
+	return queue_reply(b, new_sock, im, PACK_SACK, s->check, s->id, s->sack_seq, &sack,
+		sizeof sack.cum_ack + words * sizeof sack.bitmap[0], (struct sockaddr_in *)&s->addr);
+
+}
+
+
+
+// queue the ACKs the impairment held back that are due by now
+
+int queue_held(dgram_batch *b, int new_sock, impairment *im, double now) {
+
+	size_t size;
+
+	while ((size = impair_take(im, now, b->bufs + b->count * b->buf_size, b->buf_size, &b->addrs[b->count])) > 0) {
+		b->iov[b->count++].iov_len = size;
+		if (b->count >= b->size && batch_flush(b, new_sock) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+
+}
+
+
+
+// how long a receive waits for the first datagram (0 for ever)
+
+void set_recv_timeout(int sock, double seconds) {
+
+	struct timeval tv;
+
+	tv.tv_sec = (long)seconds;
+	tv.tv_usec = (long)((seconds - tv.tv_sec) * 1e6);
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv));
+
+}
+
+
+
+// agree on the session proposed by packet 0: the smaller of each proposal and the server's limits
+// returns the parameters in host order, the payload 0 for a proposal that makes no sense
+
+session_params agree_session(int new_sock, const udp_pack *open, session_table *t) {
+
+	session_params params;
+	int rcvbuf, fits, per_packet;
+	socklen_t len = sizeof rcvbuf;
+
+	memcpy(&params, open->data, sizeof params);
+	params.payload = ntohl(params.payload);
+	params.window = ntohl(params.window);
+	params.size_hi = ntohl(params.size_hi);
+	params.size_lo = ntohl(params.size_lo);
+
+	if (params.payload < 1 || params.window < 1) {
+		params.payload = 0;
+		return params;
+	}
+
+	if (params.payload > MAX_PAYLOAD) {
+		params.payload = MAX_PAYLOAD;
+	}
+	if (params.window > (uint32_t)window) {
+		params.window = window;
+	}
+
+	// FEC only with a block the decoder takes, otherwise the transfer goes on without it
+	if (params.fec_k < 1 || params.fec_k > FEC_MAX_K || params.fec_m < 1 || params.fec_m > FEC_MAX_M) {
+		params.fec_k = 0;
+		params.fec_m = 0;
+	}
+	params.reserved = 0;
+
+	// a window the socket cannot buffer only turns into drops: ask the kernel for room for this window
+	// on top of the open sessions' (it caps the request at net.core.rmem_max), and give the session no
+	// more than its share of what it granted
+	per_packet = PACK_HDR + params.payload + SKB_OVERHEAD;
+	rcvbuf = t->rcv_bytes + params.window * per_packet;
+	if (rcvbuf > t->rcv_granted) {
+		setsockopt(new_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+		if (getsockopt(new_sock, SOL_SOCKET, SO_RCVBUF, &t->rcv_granted, &len) < 0) {
+			t->rcv_granted = rcvbuf;
+		}
+	}
+
+	fits = t->rcv_granted / (t->count + 1) / per_packet;
+	if (fits < 1) {
+		fits = 1;
+	}
+	if (params.window > (uint32_t)fits) {
+		log_msg(LOG_INFO, "The receive buffer (%d bytes, %d sessions) holds %d packets more, window %u reduced\n",
+			t->rcv_granted, t->count + 1, fits, params.window);
+		params.window = fits;
+	}
+
+	return params;
+
+}
+
+
+
+// the chain of a client address and session ID
+
+rx_session **session_chain(session_table *t, const struct sockaddr_in *addr, uint32_t id) {
+
+	uint32_t h = ntohl(addr->sin_addr.s_addr) * 2654435761u;
+
+	h ^= ntohs(addr->sin_port) * 40503u;
+	h ^= id * 2246822519u;
+	h ^= h >> 15;
+
+	return &t->buckets[h & (SESSION_BUCKETS - 1)];
+
+}
+
+
+
+rx_session *session_find(session_table *t, const struct sockaddr_in *addr, uint32_t id) {
+
+	rx_session *s;
+
+	for (s = *session_chain(t, addr, id); s != NULL; s = s->next) {
+		if (s->id == id && s->addr.sin_addr.s_addr == addr->sin_addr.s_addr && s->addr.sin_port == addr->sin_port) {
+			return s;
+		}
+	}
+
+	return NULL;
+
+}
+
+
+
+// create the file of a session (of the size the client announced), for the worker's writer thread
+
+writer_file *session_file(const char *name, unsigned long long size) {
+
+	outfile file;
+
+	if (outfile_open(&file, name, size, OUTFILE_NEW, 1, &output) < 0) {
+		return NULL;
+	}
+
+	return writer_open(&file);
+
+}
+
+
+
+// open a session for packet 0 from addr: agree on the parameters and create the new file
+// returns NULL for a proposal that makes no sense or when the table is full
+
+rx_session *session_open(worker *w, udp_pack *open, const struct sockaddr_in *addr, double now) {
+
+	session_table *t = &w->table;
+	rx_session *s, **chain;
+	size_t name_len = ntohs(open->len) - sizeof(session_params);
+
+	if (ntohs(open->len) <= sizeof(session_params) || name_len > NAME_MAX_LEN) {
+		return NULL;
+	}
+
+	if (t->count == MAX_SESSIONS) {
+		log_msg(LOG_WARN, "Worker %d: %d sessions open, session %08x from %s:%u refused\n", w->id, MAX_SESSIONS,
+			ntohl(open->session), inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+		return NULL;
+	}
+
+	s = calloc(1, sizeof *s);
+	if (s == NULL) {
+		printf("ERROR: out of memory\n");
 		exit(1);
 	}
-	else if (argc != 2) {
-		printf("ERROR: wrong input\n");
+
+	s->params = agree_session(w->sock, open, t);
+	if (s->params.payload == 0) {
+		free(s);
+		return NULL;
+	}
+
+	s->addr = *addr;
+	s->id = ntohl(open->session);
+	s->check = open->check;
+	s->expected = 1;
+	s->opened = s->last_seen = now;
+
+	memcpy(s->newfile_name, open->data + sizeof(session_params), name_len);
+	s->newfile_name[name_len] = '\0';
+
+	log_msg(LOG_INFO, "received message: \"%s\"\n", s->newfile_name);
+	log_msg(LOG_INFO, "New file name received!\n");
+	log_msg(LOG_INFO, "Session %08x from %s:%u open: %u bytes of data per packet, window of %u packets, %s checksum\n",
+		s->id, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), s->params.payload, s->params.window,
+		checksum_kernel_name(s->check));
+
+	s->newfile = session_file(s->newfile_name, (uint64_t)s->params.size_hi << 32 | s->params.size_lo);
+	if (s->newfile == NULL) {
+		log_msg(LOG_ERROR, "ERROR: failed creating %s (%s)\n", s->newfile_name, strerror(errno));
+		free(s);
+		return NULL;
+	}
+
+	// the reorder buffer itself waits for the first packet that arrives out of order
+	s->slots = calloc(s->params.window, sizeof *s->slots);
+	if (s->slots == NULL) {
+		printf("ERROR: out of memory\n");
 		exit(1);
 	}
+
+	if (s->params.fec_k > 0) {
+		log_msg(LOG_INFO, "FEC: %u parity packets after every %u data packets\n", s->params.fec_m, s->params.fec_k);
+		if (fec_decoder_init(&s->fec, s->params.fec_k, s->params.fec_m, s->params.payload, s->params.window) < 0) {
+			printf("ERROR: out of memory\n");
+			exit(1);
+		}
+	}
+
+	s->ack.payload = htonl(s->params.payload);
+	s->ack.window = htonl(s->params.window);
+	s->ack.fec_k = s->params.fec_k;
+	s->ack.fec_m = s->params.fec_m;
+	s->ack.reserved = 0;
+	s->ack.size_hi = htonl(s->params.size_hi);
+	s->ack.size_lo = htonl(s->params.size_lo);
+
+	chain = session_chain(t, addr, s->id);
+	s->next = *chain;
+	*chain = s;
+	s->index = t->count;
+	t->all[t->count++] = s;
+	t->rcv_bytes += s->params.window * (PACK_HDR + s->params.payload + SKB_OVERHEAD);
+
+	metric_add(M_SESSIONS, 1);
+
+	return s;
+
+}
+
+
+
+// the reorder buffer holds a window of full packets, 4-byte aligned
+
+void session_slab(rx_session *s) {
+
+	size_t stride = (PACK_HDR + s->params.payload + 3) & ~(size_t)3;
+	unsigned j;
+
+	s->slab = malloc(s->params.window * stride);
+	if (s->slab == NULL) {
+		printf("ERROR: out of memory\n");
+		exit(1);
+	}
+	for (j = 0; j < s->params.window; j++) {
+		s->slots[j].packet = (udp_pack *)(s->slab + j * stride);
+	}
+
+}
+
+
+
+// report a session and free it (its SACKs have all been sent)
+
+void session_close(worker *w, rx_session *s, const char *why) {
+
+	session_table *t = &w->table;
+	rx_session **p;
+	unsigned j;
+
+	log_msg(LOG_INFO, "File %s from %s:%u %s: %llu packets, %llu duplicates, %llu out of order in %.3f s\n",
+		s->newfile_name, inet_ntoa(s->addr.sin_addr), ntohs(s->addr.sin_port), why,
+		s->received, s->duplicates, s->reordered, s->last_seen - s->opened);
+	if (s->params.fec_k > 0) {
+		log_msg(LOG_INFO, "FEC %u:%u: %llu packets rebuilt (retransmits avoided) from %llu parity packets\n",
+			s->params.fec_k, s->params.fec_m, s->fec.rebuilt_total, s->fec.parity_received);
+		for (j = 0; j < (unsigned)s->fec.nblocks; j++) {
+			free(s->fec.blocks[j].sum);
+			free(s->fec.blocks[j].parity);
+		}
+		free(s->fec.blocks);
+		free(s->fec.rebuilt);
+		free(s->fec.scratch);
+	}
+
+	if (!s->finished) {
+		writer_close(&w->disk, s->newfile, 0);
+		metric_add(M_INCOMPLETE, 1);
+	}
 	else {
-		port_num = atoi(argv[1]);
+		metric_add(M_FILES, 1);
+	}
+	metric_observe(H_SESSION, s->last_seen - s->opened);
+
+	for (p = session_chain(t, &s->addr, s->id); *p != s; p = &(*p)->next) {
+	}
+	*p = s->next;
+
+	t->all[s->index] = t->all[--t->count];
+	t->all[s->index]->index = s->index;
+	t->rcv_bytes -= s->params.window * (PACK_HDR + s->params.payload + SKB_OVERHEAD);
+
+	free(s->slots);
+	free(s->slab);
+	free(s);
+
+	__atomic_add_fetch(&sessions_done, 1, __ATOMIC_RELAXED);
+
+}
+
+
+
+// the session owes its client a SACK: sent after the batch, or once more packets or ACK_DELAY have passed
+
+void session_sack_later(session_table *t, rx_session *s) {
+
+	if (!s->acking) {
+		s->acking = 1;
+		s->sack_since = s->last_seen;
+		t->acking[t->nacking++] = s;
+	}
+
+}
+
+
+
+// hand the next packet in sequence to the file
+void session_write(worker *w, rx_session *s, const udp_pack *p) {
+
+	unsigned long long stalls;
+
+	// an empty packet ends the file
+	if (p->len == 0) {
+		if (!s->finished) {
+			log_msg(LOG_INFO, "END\n");
+			writer_close(&w->disk, s->newfile, 1);
+			s->newfile = NULL;
+			s->finished = 1;
+
+			// the SACK past it tells the client that every packet has arrived
+			s->sack_now = 1;
+		}
+	}
+
+	// queue the data for the writer thread
+	else {
+		log_msg(LOG_TRACE, "DATA: %u bytes\n", ntohs(p->len));
+		if (s->failed) {
+			return;
+		}
+		// only this session ends, the others on the worker keep their files
+		if (writer_failed(s->newfile)) {
+			log_msg(LOG_ERROR, "ERROR: failed writing %s, dropping session %08x\n", s->newfile_name, s->id);
+			s->failed = 1;
+			return;
+		}
+		stalls = w->disk.stalls;
+		writer_append(&w->disk, s->newfile, s->written, p->data, ntohs(p->len));
+		if (w->disk.stalls != stalls) {
+			metric_add(M_DISK_STALLS, w->disk.stalls - stalls);
+		}
+		s->written += ntohs(p->len);
+		metric_add(M_WRITTEN, ntohs(p->len));
+	}
+
+	s->expected++;
+
+}
+
+
+
+// a data packet of a session, received or rebuilt by FEC: write it when it is next in sequence and the run
+// the reorder buffer holds after it, park it otherwise
+
+void session_data(worker *w, rx_session *s, udp_pack *packet, int rebuilt) {
+
+	session_table *t = &w->table;
+	uint32_t seq = ntohl(packet->seq_num), run = 0;
+	rx_slot *slot;
+
+	// data before packet 0 got through, the client sends it again
+	if (ntohs(packet->len) > s->params.payload) {
+		log_msg(LOG_DEBUG, "Wrong data\n");
+		metric_add(M_BAD, 1);
+		return;
+	}
+
+	// a rebuilt packet is no round trip sample, the SACK keeps answering the last one that arrived
+	if (!rebuilt) {
+		s->sack_seq = seq;
+	}
+	session_sack_later(t, s);
+
+	// already written: the ACK got lost, send it again
+	if ((int32_t)(seq - s->expected) < 0) {
+		s->duplicates++;
+		metric_add(M_DUPLICATES, 1);
+		s->sack_now = 1;
+		return;
+	}
+
+	// beyond the reorder buffer, the client will send it again
+	if (seq - s->expected >= s->params.window) {
+		log_msg(LOG_DEBUG, "Beyond the window\n");
+		return;
+	}
+
+	slot = &s->slots[seq % s->params.window];
+
+	// a duplicate or a packet after a hole is reported at once, so the client can act on it
+	if (slot->present) {
+		s->duplicates++;
+		metric_add(M_DUPLICATES, 1);
+		s->sack_now = 1;
+		return;
+	}
+
+	s->received++;
+	metric_add(M_PACKETS, 1);
+	s->sack_pending++;
+	if (s->params.fec_k > 0) {
+		fec_add_data(&s->fec, packet);
+	}
+
+	// the next packet in sequence goes straight to the file, the others wait in the reorder buffer
+	if (seq == s->expected) {
+		session_write(w, s, packet);
+		run++;
+	}
+	else {
+		if (s->slab == NULL) {
+			session_slab(s);
+		}
+		memcpy(slot->packet, packet, PACK_SIZE(packet));
+		slot->present = 1;
+		s->reordered++;
+		metric_add(M_REORDERED, 1);
+		s->sack_now = 1;
+	}
+
+	// write out the run of packets it completed
+	while (run > 0 && s->slots[s->expected % s->params.window].present) {
+		slot = &s->slots[s->expected % s->params.window];
+		slot->present = 0;
+		session_write(w, s, slot->packet);
+		run++;
+	}
+
+	// a packet that filled a hole released the ones held after it
+	if (run > 1) {
+		s->sack_now = 1;
+	}
+
+}
+
+
+
+// one datagram from addr
+
+void handle_packet(worker *w, udp_pack *packet, size_t len, struct sockaddr_in *addr, double now) {
+
+	session_table *t = &w->table;
+	rx_session *s;
+	udp_pack *rebuilt;
+	uint32_t seq, id;
+
+	// check the data receive
+	if (len < PACK_HDR || len != PACK_SIZE(packet) || packet_checksum(packet) != packet->checksum) {
+		log_msg(LOG_DEBUG, "Wrong data\n");
+		metric_add(M_CHECKSUM, 1);
+		return;
 	}
 
+	seq = ntohl(packet->seq_num);
+	id = ntohl(packet->session);
+
+	// echo a path MTU probe as it is, whatever the state of the transfer
+	if (packet->type == PACK_PROBE) {
+		metric_add(M_PROBES, 1);
+		queue_reply(&w->acks, w->sock, &w->imp, PACK_PROBE_ACK, packet->check, id, seq, NULL, 0, addr);
+		return;
+	}
+
+	if (packet->type != PACK_DATA && packet->type != PACK_PARITY) {
+		log_msg(LOG_DEBUG, "Wrong data\n");
+		metric_add(M_BAD, 1);
+		return;
+	}
+
+	log_msg(LOG_TRACE, "CHECKSUM: %u\n", ntohl(packet->checksum));
+
+	s = session_find(t, addr, id);
+
+	// packet 0 opens the session and names the new file; a copy means the ACK got lost
+	if (seq == 0 && packet->type == PACK_DATA) {
+		if (s == NULL) {
+			s = session_open(w, packet, addr, now);
+			if (s == NULL) {
+				log_msg(LOG_DEBUG, "Wrong data\n");
+				metric_add(M_BAD, 1);
+				return;
+			}
+			s->received++;
+			metric_add(M_PACKETS, 1);
+		}
+		else {
+			s->duplicates++;
+			metric_add(M_DUPLICATES, 1);
+			s->last_seen = now;
+		}
+
+		queue_reply(&w->acks, w->sock, &w->imp, PACK_ACK, s->check, s->id, 0, &s->ack, sizeof s->ack, addr);
+		return;
+	}
+
+	// a session that was never opened here, or that is over already; a failed one no longer answers,
+	// and its client gives up
+	if (s == NULL || s->failed) {
+		metric_add(M_UNKNOWN, 1);
+		return;
+	}
+
+	log_msg(LOG_TRACE, "SEQ_NUM: %u, %u (session %08x)\n", seq, s->expected, s->id);
+
+	s->last_seen = now;
+
+	// parity only counts for the block it covers
+	if (packet->type == PACK_PARITY) {
+		metric_add(M_PARITY, 1);
+		if (s->params.fec_k > 0) {
+			fec_add_parity(&s->fec, packet);
+		}
+	}
+	else {
+		session_data(w, s, packet, 0);
+	}
+
+	// the packets FEC rebuilt from it
+	while (s->params.fec_k > 0 && (rebuilt = fec_take(&s->fec)) != NULL) {
+		log_msg(LOG_DEBUG, "REBUILT: %u\n", ntohl(rebuilt->seq_num));
+		metric_add(M_REBUILT, 1);
+		session_data(w, s, rebuilt, 1);
+	}
+
+}
+
+
+
+// body of a worker: its own socket on the port, its own sessions
+
+void *worker_main(void *arg) {
+
+	worker *w = arg;
+	session_table *t = &w->table;
+	struct sockaddr_in sock_addr;
+	udp_pack *packet;
+	rx_session *s;
+	int i, k, got, on = 1;
+	uint64_t bytes;
+	double now, next_sweep, recv_timeout = 0, timeout, due;
 
 
 	// create a new socket
-	new_sock = socket(AF_INET, SOCK_DGRAM, 0);
-	if (new_sock < 0) {
+	w->sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (w->sock < 0) {
 		printf("ERROR: failed to create a client socket\n");
 		exit(1);
 	}
 
 	printf("\nSocket created...");
 
+	// every worker binds its own socket to the port, the kernel spreads the clients over them
+	if (workers > 1 && setsockopt(w->sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0) {
+		printf("ERROR: SO_REUSEPORT not supported\n");
+		exit(1);
+	}
 
 	// set up server_addr values
-	inet_ntop(AF_INET, &sock_addr, ip_addr, INET_ADDRSTRLEN); // get the current ip address
 	bzero(&sock_addr, sizeof sock_addr);
 	sock_addr.sin_family = AF_INET;
 	sock_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
 	sock_addr.sin_port = htons(port_num);
-	memset(sock_addr.sin_zero, '\0', sizeof sock_addr.sin_zero);  
+	memset(sock_addr.sin_zero, '\0', sizeof sock_addr.sin_zero);
 
 
 
 	// bind
-	if (bind(new_sock, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) < 0) {
+	if (bind(w->sock, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) < 0) {
 		printf("ERROR: failed binding\n");
 		exit(1);
 	}
@@ -133,122 +1069,304 @@ int main(int argc, char *argv[]) {
 	printf("\nBinding success\n");
 
 
-	socklen_t addrlen = sizeof(recv_addr);
-
-	if (recvfrom(new_sock, &packet, sizeof(packet), 0, (struct sockaddr *)&recv_addr, &addrlen) > 0) {
-		printf("received message: \"%s\"\n", packet.data);
-		printf("New file name received!\n");
-	}
-	else {
-		printf("ERROR: failed sending file name\n");
+	packet = malloc(sizeof *packet);
+	t->buckets = calloc(SESSION_BUCKETS, sizeof *t->buckets);
+	t->all = calloc(MAX_SESSIONS, sizeof *t->all);
+	t->acking = calloc(MAX_SESSIONS, sizeof *t->acking);
+	if (packet == NULL || t->buckets == NULL || t->all == NULL || t->acking == NULL) {
+		printf("ERROR: out of memory\n");
 		exit(1);
 	}
 
-	packet_ack.seq_num = 0;
-
-
-	// create a new file
-
-	newfile = fopen(packet.data, "wb+");
-	if (newfile == NULL) {
-		newfile = fopen(packet.data, "wb+");
+	// coalesced receives need room for a whole run of datagrams per message
+	if (gro && setsockopt(w->sock, SOL_UDP, UDP_GRO, &on, sizeof on) < 0) {
+		log_msg(LOG_WARN, "UDP GRO not supported, receiving datagrams one by one\n");
+		w->gro = 0;
+	}
+	else if (gro) {
+		log_msg(LOG_INFO, "Receiving with UDP GRO\n");
+		w->gro = 1;
 	}
 
+	// the payload is not known before packet 0, so every receive buffer takes the largest datagram
+	batch_init(&w->rx, batch, w->gro ? GRO_BUF : PACK_HDR + MAX_PAYLOAD);
+	batch_init(&w->acks, batch, ACK_BUF);
 
+	next_sweep = now_seconds() + SWEEP_INTERVAL;
+	w->metrics = metrics_thread();
+	writer_start(&w->disk);
 
-	// receive info from the client and write to the new file
 
-	char buf_wri[5];
+	// receive from every client and write each file in sequence; sessions end LINGER seconds after their
+	// file is complete (late retransmits still get their SACK), or idle_timeout seconds after the client
+	// went quiet without finishing
 
-	while(recvfrom(new_sock, &packet, sizeof(packet), 0, (struct sockaddr *)&recv_addr, &addrlen) > 0) {
+	while (max_sessions == 0 || __atomic_load_n(&sessions_done, __ATOMIC_RELAXED) < max_sessions) {
 
-		// check when the client finishes sending data
-		char *end;
-		end = "***End***";
+		// a delayed SACK waits a moment for more packets, otherwise wake up now and then for the sweep
+		timeout = t->nacking > 0 ? ACK_DELAY : SWEEP_INTERVAL;
 
-		if (strcmp(end, packet.data) == 0){
-			printf("END\n");
-			break;
+		// or until an ACK the impairment held back is due (never 0, which waits for ever)
+		if (w->imp.nheld > 0) {
+			due = impair_next_due(&w->imp) - now_seconds();
+			if (due < timeout) {
+				timeout = due > 1e-5 ? due : 1e-5;
+			}
+		}
+
+		if (timeout != recv_timeout) {
+			set_recv_timeout(w->sock, timeout);
+			recv_timeout = timeout;
 		}
 
+		got = batch_recv(&w->rx, w->sock, MSG_WAITFORONE);
+		now = now_seconds();
 
-		// check the data receive & make the ack
-		short new_checksum = checksum(packet.data, sizeof packet.data);
-		int new_seq = packet_ack.seq_num ^ 1;
+		for (i = 0, bytes = 0; i < got; i++) {
+			memcpy(packet, w->rx.segs[i].data, w->rx.segs[i].len < sizeof *packet ? w->rx.segs[i].len : sizeof *packet);
+			handle_packet(w, packet, w->rx.segs[i].len, &w->rx.addrs[w->rx.segs[i].msg], now);
+			bytes += w->rx.segs[i].len;
+		}
+		if (got > 0) {
+			metric_add(M_DATAGRAMS, got);
+			metric_add(M_BYTES, bytes);
+		}
 
-		printf("CHECKSUM: %d, %d\n", packet.checksum, new_checksum);
-		printf("SEQ_NUM: %d, %d\n", packet.seq_num, new_seq);
+		// what the batch added to a file goes to the writer now rather than waiting to fill a buffer
+		writer_flush(&w->disk);
 
-		if (new_checksum == packet.checksum && new_seq == packet.seq_num) {
+		// one SACK per session answers the whole batch, or waits for more packets (no more come after a timeout)
+		for (k = 0; k < t->nacking; ) {
 
-			// make new ack
-			packet_ack.seq_num ^= 1;
-			packet_ack.checksum = new_checksum;
-			bzero(packet_ack.data, sizeof packet_ack.data);
-			memcpy(packet_ack.data, "ACK", sizeof(packet_ack.data));
+			s = t->acking[k];
 
-			// write the data into the file
-			// write the file in 5 byte chunks
-			int i, d, c;
-			for (i = 0; i < 2; i++) {
-				bzero(buf_wri, sizeof buf_wri);
-				d = i * 5;
-				memcpy(buf_wri, &packet.data[d], 5 * sizeof(char));
-				fprintf(newfile, "%s", buf_wri);
+			if (got > 0 && !s->sack_now && s->sack_pending < ack_every) {
+				k++;
+				continue;
 			}
-			
-			printf("DATA: %s\n", packet.data);
-			bzero(packet.data, sizeof packet.data);
 
+			if (queue_sack(&w->acks, w->sock, &w->imp, s) < 0) {
+				printf("ERROR: failed sending ACKs\n");
+				exit(1);
+			}
+			metric_observe(H_ACK_DELAY, now - s->sack_since);
+			s->sack_now = 0;
+			s->sack_pending = 0;
+			s->acking = 0;
+			t->acking[k] = t->acking[--t->nacking];
 		}
-		else {
-			printf("Wrong data\n");
+
+		// the ACKs for the whole batch go out together, with those held back that are due
+		if ((w->imp.on && queue_held(&w->acks, w->sock, &w->imp, now_seconds()) < 0) || batch_flush(&w->acks, w->sock) < 0) {
+			printf("ERROR: failed sending ACKs\n");
+			exit(1);
 		}
 
-		// random function to decide whether to send the ack
-		int rand_1 = rand() % 10;
-		if (rand_1 < 3) {
-			printf("NO ACK SENT\n");
-			continue;
+		// end the sessions that are over
+		if (now >= next_sweep) {
+			for (k = 0; k < t->count; ) {
+				s = t->all[k];
+				if (!s->acking && s->failed) {
+					session_close(w, s, "failed");
+				}
+				else if (!s->acking && s->finished && now - s->last_seen >= LINGER) {
+					session_close(w, s, "received");
+				}
+				else if (!s->acking && now - s->last_seen >= idle_timeout) {
+					log_msg(LOG_WARN, "ERROR: session %08x idle for %.0f s before the end of the file\n", s->id, idle_timeout);
+					metric_add(M_TIMEOUTS, 1);
+					session_close(w, s, "incomplete");
+				}
+				else {
+					k++;
+				}
+			}
+			next_sweep = now + SWEEP_INTERVAL;
 		}
+	}
 
+	// the sessions still open when the server stops
+	while (t->count > 0) {
+		session_close(w, t->all[0], t->all[0]->finished ? "received" : "incomplete");
+	}
 
-		// sent the ack
-		if (sendto(new_sock, &packet_ack, sizeof(packet_ack), 0, (struct sockaddr *)&recv_addr, sizeof(recv_addr)) > 0) {
-			printf("**************************************\n");
-			printf("ACK: %d, %d\n", packet_ack.seq_num, packet_ack.checksum);
-			printf("**************************************\n");
-    	}
+	// every file is complete on disk before the worker ends
+	writer_stop(&w->disk);
 
-    	// random function to decide whether to falsely duplicate the ack
-    	int rand_2 = rand() % 10;
-		if (rand_2 < 3) {
-			if (sendto(new_sock, &packet_ack, sizeof(packet_ack), 0, (struct sockaddr *)&recv_addr, sizeof(recv_addr)) > 0) {
-				printf("DUPLICATE ACK\n");
-    		}
-		}
+	close(w->sock);
+	free(packet);
+	impair_free(&w->imp);
 
-	}
-	
+	return NULL;
 
+}
 
-	fclose(newfile); 
 
-	close(new_sock);
 
-	return 0;
+int main(int argc, char *argv[]) {
 
-}
+	static worker pool[MAX_WORKERS];
+	unsigned long long files = 0, failed = 0;
+	const char *metrics_log = NULL, *metrics_addr = NULL;
+	int opt, i, level = LOG_DEFAULT_LEVEL;
 
+	metrics_init("udp_server", counter_defs, M_COUNT, hist_defs, H_COUNT, M_WRITTEN);
 
 
+	// examine the user input (only need a port here, -w sets the reorder buffer size, -b the datagrams
+	// per system call, -g receives them coalesced, -a the packets per delayed SACK, -j the worker
+	// threads, -n the sessions to serve before exiting, -t the idle seconds before a session is dropped,
+	// -i impairs the ACKs, -l logs the metrics as JSON lines to a file, -m serves them on a port or Unix socket,
+	// -v sets the log level, -o writes the files as outfile.h describes)
 
+	while ((opt = getopt(argc, argv, "w:b:ga:j:n:t:i:l:m:v:o:")) != -1) {
+		switch (opt) {
+		case 'w':
+			window = atoi(optarg);
+			if (window < 1 || window > MAX_WINDOW) {
+				printf("ERROR: window must be between 1 and %d packets\n", MAX_WINDOW);
+				exit(1);
+			}
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			if (batch < 1 || batch > MAX_BATCH) {
+				printf("ERROR: batch must be between 1 and %d datagrams\n", MAX_BATCH);
+				exit(1);
+			}
+			break;
+		case 'g':
+			gro = 1;
+			break;
+		case 'a':
+			ack_every = atoi(optarg);
+			if (ack_every < 1 || ack_every > MAX_WINDOW) {
+				printf("ERROR: packets per ACK must be between 1 and %d\n", MAX_WINDOW);
+				exit(1);
+			}
+			break;
+		case 'j':
+			workers = atoi(optarg);
+			if (workers < 1 || workers > MAX_WORKERS) {
+				printf("ERROR: worker count must be between 1 and %d\n", MAX_WORKERS);
+				exit(1);
+			}
+			break;
+		case 'n':
+			max_sessions = atoi(optarg);
+			if (max_sessions < 0) {
+				printf("ERROR: the session count must be 0 (no limit) or more\n");
+				exit(1);
+			}
+			break;
+		case 't':
+			idle_timeout = atof(optarg);
+			if (idle_timeout < LINGER) {
+				printf("ERROR: the idle timeout must be at least %d seconds\n", LINGER);
+				exit(1);
+			}
+			break;
+		case 'i':
+			if (impair_parse(&impair_spec, optarg) < 0) {
+				exit(1);
+			}
+			break;
+		case 'l':
+			metrics_log = optarg;
+			break;
+		case 'm':
+			metrics_addr = optarg;
+			break;
+		case 'v':
+			level = log_parse_level(optarg);
+			if (level < 0) {
+				printf("ERROR: unknown log level %s, pick error, warn, info, debug or trace\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'o':
+			if (outfile_parse(&output, optarg) < 0) {
+				exit(1);
+			}
+			break;
+		default:
+			printf("usage: %s [-w window] [-b batch] [-g] [-a ack_every] [-j workers] [-n sessions] [-t idle_timeout] [-i impairment] [-l metrics_log] [-m metrics_port|path] [-v level] [-o output_mode] <port#>\n", argv[0]);
+			exit(1);
+		}
+	}
 
+	argc -= optind - 1;
+	argv += optind - 1;
 
+	if (argc < 2) {
+		printf("ERROR: no port number input\n");
+		exit(1);
+	}
+	else if (argc != 2) {
+		printf("ERROR: wrong input\n");
+		exit(1);
+	}
+	else {
+		port_num = atoi(argv[1]);
+	}
+
+
+	metrics_start(metrics_log, metrics_addr);
+	log_init(level);
+
+
+	// one worker runs on the main thread, the others on their own
+
+	if (impair_spec.on) {
+		impair_print(&impair_spec, "Server");
+	}
 
+	for (i = 0; i < workers; i++) {
+		pool[i].id = i;
+		pool[i].imp = impair_spec;
+		impair_seed(&pool[i].imp, i);
+		if (i > 0 && pthread_create(&pool[i].thread, NULL, worker_main, &pool[i]) != 0) {
+			printf("ERROR: failed starting worker %d\n", i);
+			exit(1);
+		}
+	}
+	if (workers > 1) {
+		printf("%d workers started\n", workers);
+	}
 
+	worker_main(&pool[0]);
 
+	for (i = 1; i < workers; i++) {
+		pthread_join(pool[i].thread, NULL);
+	}
 
+	metrics_stop();
+	log_stop();
+
+	for (i = 0; i < workers; i++) {
+		printf("Worker %d: %llu files received, %llu incomplete, %llu corrupted, %llu of unknown sessions, %llu probes\n",
+			i, (unsigned long long)metrics_shard_value(pool[i].metrics, M_FILES),
+			(unsigned long long)metrics_shard_value(pool[i].metrics, M_INCOMPLETE),
+			(unsigned long long)(metrics_shard_value(pool[i].metrics, M_CHECKSUM) + metrics_shard_value(pool[i].metrics, M_BAD)),
+			(unsigned long long)metrics_shard_value(pool[i].metrics, M_UNKNOWN),
+			(unsigned long long)metrics_shard_value(pool[i].metrics, M_PROBES));
+		printf("%llu datagrams in %llu %s calls, %llu ACKs in %llu sendmmsg calls\n",
+			pool[i].rx.datagrams, pool[i].rx.calls, pool[i].gro ? "GRO recvmmsg" : "recvmmsg",
+			pool[i].acks.datagrams, pool[i].acks.calls);
+		printf("%llu bytes written in %llu writes, %llu stalls (%.3f s) waiting for the disk\n",
+			pool[i].disk.bytes, pool[i].disk.writes, pool[i].disk.stalls, pool[i].disk.stall_seconds);
+		if (pool[i].imp.on) {
+			impair_report(&pool[i].imp, "Server");
+		}
+		files += metrics_shard_value(pool[i].metrics, M_FILES);
+		failed += metrics_shard_value(pool[i].metrics, M_INCOMPLETE);
+	}
 
+	if (files == 0 || failed > 0) {
+		printf("ERROR: failed receiving %s\n", files == 0 ? "the file" : "some files");
+		exit(1);
+	}
 
+	return 0;
 
+}
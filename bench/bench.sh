@@ -0,0 +1,359 @@
+#!/bin/bash
+#
+# File name: bench.sh
+# Description: Measures the TCP and UDP file transfers over loopback. The script builds both pairs of
+# programs, generates random input files of the sizes asked for, and runs a server with one or more
+# clients for every point of the sweep:
+#
+#   TCP  file size x send path (plain 10-byte send() calls, or fast with sendfile) x concurrent clients
+#   UDP  file size x payload per packet x window x loss rate x concurrent clients
+#
+# Every run records the wall time (from the start of the first client until every output file is
+# complete), the goodput (file bytes delivered per second), the CPU time (user + sys) of the server and
+# of the clients, the system calls that moved the data as the UDP programs count them, and the
+# retransmits (the UDP clients' own count, the kernel's TcpRetransSegs for TCP). Every output file is
+# compared with its input; a transfer that fails or delivers a different file fails the benchmark.
+#
+# Loss only applies to UDP: the clients send through the impairment layer with -i loss=P, seeded
+# with the run number so that the runs of a configuration are repeatable. TCP points with a loss rate
+# above 0 are left out.
+#
+# The results go to <prefix>.csv and <prefix>.json, one row per run. With -B, the median goodput of
+# every configuration is compared with the median of the same configuration in an earlier CSV, and
+# the script exits with 1 when one of them dropped by more than -T percent.
+#
+# usage: ./bench.sh [-t tcp,udp] [-s sizes] [-m plain,fast] [-c payloads] [-w windows] [-l losses]
+#                   [-n clients] [-r runs] [-p port] [-o prefix] [-B baseline.csv] [-T percent]
+#
+#   -t  transports (tcp,udp)
+#   -s  file sizes with K, M or G suffixes, 1K to 10G (1K,1M,16M)
+#   -m  TCP send paths (plain,fast)
+#   -c  UDP payload bytes per packet, 0 lets the client probe the path (1400)
+#   -w  UDP window in packets (32)
+#   -l  UDP loss in percent (0)
+#   -n  concurrent clients (1)
+#   -r  runs per configuration (3)
+#   -p  first port, every run takes the next one (9700)
+#   -o  prefix of the result files (bench_results)
+#   -B  results of an earlier run to compare with
+#   -T  largest goodput drop allowed against -B, in percent (10)
+#
+# for example: ./bench.sh -t udp -s 64M -c 1400,8000 -l 0,1,5 -o udp_loss
+#
+
+TRANSPORTS=tcp,udp
+SIZES=1K,1M,16M
+MODES=plain,fast
+PAYLOADS=1400
+WINDOWS=32
+LOSSES=0
+CLIENTS=1
+RUNS=3
+PORT=9700
+PREFIX=bench_results
+BASELINE=
+THRESHOLD=10
+
+RUN_TIMEOUT=600 # seconds a transfer may take before it counts as failed
+DRAIN_TIMEOUT=60 # seconds the server may take to write the data after the clients are done
+
+while getopts "t:s:m:c:w:l:n:r:p:o:B:T:" opt; do
+	case $opt in
+	t) TRANSPORTS=$OPTARG ;;
+	s) SIZES=$OPTARG ;;
+	m) MODES=$OPTARG ;;
+	c) PAYLOADS=$OPTARG ;;
+	w) WINDOWS=$OPTARG ;;
+	l) LOSSES=$OPTARG ;;
+	n) CLIENTS=$OPTARG ;;
+	r) RUNS=$OPTARG ;;
+	p) PORT=$OPTARG ;;
+	o) PREFIX=$OPTARG ;;
+	B) BASELINE=$OPTARG ;;
+	T) THRESHOLD=$OPTARG ;;
+	*) sed -n '/^# usage/,/^# for example/p' "$0" | sed 's/^# \{0,1\}//'; exit 1 ;;
+	esac
+done
+
+if [ -n "$BASELINE" ] && [ ! -r "$BASELINE" ]; then
+	echo "ERROR: cannot read the baseline $BASELINE" >&2
+	exit 1
+fi
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+DIR=$(mktemp -d)
+SERVER_PID=
+trap '[ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2> /dev/null; rm -rf "$DIR"' EXIT
+
+gcc -O2 -pthread -o "$DIR/tcp-server" "$ROOT/TCP/server.c" || exit 1
+gcc -O2 -pthread -o "$DIR/tcp-client" "$ROOT/TCP/client.c" || exit 1
+gcc -O2 -pthread -o "$DIR/udp-server" "$ROOT/UDP/server.c" || exit 1
+gcc -O2 -pthread -o "$DIR/udp-client" "$ROOT/UDP/client.c" || exit 1
+
+mkdir "$DIR/out"
+
+TIMEFORMAT="%R %U %S"
+CLK_TCK=$(getconf CLK_TCK)
+FAILED=0
+
+CSV="$PREFIX.csv"
+echo "transport,mode,size,payload,window,loss,clients,run,wall_s,goodput_MBps,server_cpu_s,client_cpu_s,syscalls,retransmits,status" > "$CSV"
+
+
+
+# bytes of a size such as 64K, 16M or 2G
+bytes() {
+
+	local n=${1%[KkMmGg]}
+
+	case $1 in
+	*[Kk]) echo $((n * 1024)) ;;
+	*[Mm]) echo $((n * 1024 * 1024)) ;;
+	*[Gg]) echo $((n * 1024 * 1024 * 1024)) ;;
+	*) echo "$n" ;;
+	esac
+
+}
+
+
+
+# the input file of a size, generated once
+input_file() {
+
+	local size=$1 file="$DIR/input_$1.bin"
+
+	if [ ! -f "$file" ]; then
+		head -c "$(bytes "$size")" /dev/urandom > "$file"
+	fi
+
+	echo "$file"
+
+}
+
+
+
+# segments TCP has retransmitted, system-wide
+tcp_retrans() {
+
+	awk '/^Tcp:/ { if (!hdr) { for (i = 1; i <= NF; i++) col[$i] = i; hdr = 1 } else print $col["RetransSegs"] }' /proc/net/snmp
+
+}
+
+
+
+# user + sys seconds a running process has used, all its threads included
+proc_cpu() {
+
+	awk -v tck="$CLK_TCK" '{ sub(/.*\) /, ""); printf "%.3f", ($12 + $13) / tck }' "/proc/$1/stat" 2> /dev/null || echo 0
+
+}
+
+
+
+# run <transport> <mode> <size> <payload> <window> <loss> <clients> <run>
+run() {
+
+	local transport=$1 mode=$2 size=$3 payload=$4 window=$5 loss=$6 clients=$7 n=$8
+	local input bytes srv_opts cli_opts pids i start sent end wall srv_cpu cli_cpu calls retrans before goodput status=ok
+
+	input=$(input_file "$size")
+	bytes=$(bytes "$size")
+
+	if [ "$transport" = tcp ]; then
+		srv_opts="-e"
+		cli_opts=
+		[ "$mode" = fast ] && cli_opts="-f"
+	else
+		srv_opts="-w $window"
+		cli_opts="-w $window"
+		[ "$payload" != 0 ] && cli_opts="$cli_opts -p $payload"
+		[ "$loss" != 0 ] && cli_opts="$cli_opts -i loss=$loss,seed=$n"
+	fi
+
+	rm -f "$DIR"/out/* "$DIR"/client*.log "$DIR"/client*.time
+
+	# the servers keep running (-e, and UDP serves sessions until it is stopped), so the CPU time they
+	# used can be read before they are stopped
+	(cd "$DIR/out" && exec "$DIR/$transport-server" $srv_opts "$PORT" > "$DIR/server.log" 2>&1) &
+	SERVER_PID=$!
+	sleep 0.2
+
+	before=$(tcp_retrans)
+	start=$(date +%s.%N)
+
+	pids=()
+	for ((i = 0; i < clients; i++)); do
+		( { time timeout "$RUN_TIMEOUT" "$DIR/$transport-client" $cli_opts "$input" "output$i.bin" 127.0.0.1 "$PORT" \
+			> "$DIR/client$i.log" 2>&1; } 2> "$DIR/client$i.time" ) &
+		pids+=($!)
+	done
+
+	for i in "${!pids[@]}"; do
+		wait "${pids[$i]}" || status=failed
+	done
+
+	# a TCP client is done once the data is sent, the transfer once the server has written it all
+	sent=$(date +%s)
+	for ((i = 0; i < clients; i++)); do
+		while [ "$status" = ok ] && [ "$(stat -c %s "$DIR/out/output$i.bin" 2> /dev/null || echo 0)" -lt "$bytes" ]; do
+			if [ $(($(date +%s) - sent)) -gt "$DRAIN_TIMEOUT" ]; then
+				status=failed
+			fi
+			sleep 0.005
+		done
+	done
+
+	end=$(date +%s.%N)
+	srv_cpu=$(proc_cpu "$SERVER_PID")
+	kill "$SERVER_PID" 2> /dev/null
+	wait "$SERVER_PID" 2> /dev/null
+	SERVER_PID=
+
+	for ((i = 0; i < clients; i++)); do
+		if [ "$status" = ok ] && ! cmp -s "$input" "$DIR/out/output$i.bin"; then
+			status=corrupt
+		fi
+	done
+
+	wall=$(awk -v s="$start" -v e="$end" 'BEGIN { printf "%.4f", e - s }')
+	goodput=$(awk -v b="$bytes" -v c="$clients" -v t="$wall" 'BEGIN { printf "%.3f", b * c / t / 1e6 }')
+	cli_cpu=$(cat "$DIR"/client*.time | awk '{ cpu += $2 + $3 } END { printf "%.3f", cpu }')
+
+	if [ "$transport" = tcp ]; then
+		calls=
+		retrans=$(($(tcp_retrans) - before))
+	else
+		calls=$(cat "$DIR"/client*.log | awk '/ datagrams in / { n += $4 + $10 } END { print n + 0 }')
+		retrans=$(cat "$DIR"/client*.log | awk '/ packets sent, / { n += $4 } END { print n + 0 }')
+	fi
+
+	echo "$transport,$mode,$bytes,$payload,$window,$loss,$clients,$n,$wall,$goodput,$srv_cpu,$cli_cpu,$calls,$retrans,$status" >> "$CSV"
+
+	printf "%-3s %-5s %10s B  payload %5s  window %4s  loss %4s%%  clients %3s  run %d: %8ss %10s MB/s  server cpu %7ss  client cpu %7ss  calls %8s  retransmits %6s  %s\n" \
+		"$transport" "$mode" "$bytes" "$payload" "$window" "$loss" "$clients" "$n" "$wall" "$goodput" "$srv_cpu" "$cli_cpu" \
+		"${calls:--}" "$retrans" "$status"
+
+	if [ "$status" != ok ]; then
+		FAILED=1
+		cp "$DIR/server.log" "$PREFIX.server.log"
+		cat "$DIR"/client*.log > "$PREFIX.client.log"
+	fi
+
+	PORT=$((PORT + 1))
+
+}
+
+
+
+IFS=, read -ra transports <<< "$TRANSPORTS"
+IFS=, read -ra sizes <<< "$SIZES"
+IFS=, read -ra modes <<< "$MODES"
+IFS=, read -ra payloads <<< "$PAYLOADS"
+IFS=, read -ra windows <<< "$WINDOWS"
+IFS=, read -ra losses <<< "$LOSSES"
+IFS=, read -ra clients <<< "$CLIENTS"
+
+for size in "${sizes[@]}"; do
+	b=$(bytes "$size")
+	if ! [[ $size =~ ^[0-9]+[KkMmGg]?$ ]] || [ "$b" -lt 1024 ] || [ "$b" -gt $((10 * 1024 * 1024 * 1024)) ]; then
+		echo "ERROR: file sizes must be between 1K and 10G, not $size" >&2
+		exit 1
+	fi
+done
+
+for transport in "${transports[@]}"; do
+	for size in "${sizes[@]}"; do
+		for c in "${clients[@]}"; do
+
+			if [ "$transport" = tcp ]; then
+				for mode in "${modes[@]}"; do
+					for ((r = 1; r <= RUNS; r++)); do
+						run tcp "$mode" "$size" - - 0 "$c" "$r"
+					done
+				done
+			elif [ "$transport" = udp ]; then
+				for payload in "${payloads[@]}"; do
+					for window in "${windows[@]}"; do
+						for loss in "${losses[@]}"; do
+							for ((r = 1; r <= RUNS; r++)); do
+								run udp - "$size" "$payload" "$window" "$loss" "$c" "$r"
+							done
+						done
+					done
+				done
+			else
+				echo "ERROR: unknown transport $transport, use tcp or udp" >&2
+				exit 1
+			fi
+
+		done
+	done
+done
+
+
+# the same rows as JSON, an array of objects with numbers as numbers
+
+awk -F, 'NR == 1 { for (i = 1; i <= NF; i++) key[i] = $i; n = NF; print "["; next }
+	{
+		printf "%s  {", (NR > 2 ? ",\n" : "")
+		for (i = 1; i <= n; i++) {
+			v = $i
+			if (v == "" || v == "-") v = "null"
+			else if (v !~ /^-?[0-9.]+$/) v = "\"" v "\""
+			printf "%s\"%s\": %s", (i > 1 ? ", " : ""), key[i], v
+		}
+		printf "}"
+	}
+	END { print "\n]" }' "$CSV" > "$PREFIX.json"
+
+echo "Results in $CSV and $PREFIX.json"
+
+
+# medians of goodput per configuration, against the baseline
+
+if [ -n "$BASELINE" ]; then
+
+	awk -F, -v limit="$THRESHOLD" '
+		function median(list,   v, m, i, j, t) {
+			m = split(list, v, " ")
+			for (i = 2; i <= m; i++) {
+				for (j = i; j > 1 && v[j - 1] + 0 > v[j] + 0; j--) {
+					t = v[j]; v[j] = v[j - 1]; v[j - 1] = t
+				}
+			}
+			return m % 2 ? v[(m + 1) / 2] : (v[m / 2] + v[m / 2 + 1]) / 2
+		}
+		FNR == 1 { file++; next }
+		$15 != "ok" { next }
+		{
+			key = $1 "," $2 "," $3 "," $4 "," $5 "," $6 "," $7
+			if (file == 1) base[key] = base[key] " " $10
+			else now[key] = now[key] " " $10
+		}
+		END {
+			for (key in now) {
+				if (!(key in base)) {
+					continue
+				}
+				b = median(base[key])
+				c = median(now[key])
+				drop = b > 0 ? (b - c) / b * 100 : 0
+				printf "%-40s baseline %10.3f MB/s  now %10.3f MB/s  %+7.1f%%%s\n", key, b, c, -drop,
+					(drop > limit ? "  REGRESSION" : "")
+				if (drop > limit) {
+					bad = 1
+				}
+			}
+			exit bad
+		}' "$BASELINE" "$CSV"
+
+	if [ $? -ne 0 ]; then
+		echo "ERROR: goodput dropped by more than $THRESHOLD% against $BASELINE" >&2
+		exit 1
+	fi
+fi
+
+if [ "$FAILED" -ne 0 ]; then
+	echo "ERROR: some transfers failed, logs in $PREFIX.server.log and $PREFIX.client.log" >&2
+	exit 1
+fi
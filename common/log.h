@@ -0,0 +1,474 @@
+/*
+ * File name: log.h
+ * Description: A leveled logger that keeps formatting off the threads that move the data. A log site
+ *
+ *   log_msg(LOG_TRACE, "Package %u sent (%u bytes)\n", seq, len);
+ *
+ * takes the same format as printf() (and is checked like it), but only copies the format pointer and
+ * the arguments into a record of a ring owned by the calling thread: integers and doubles as 64-bit
+ * words, strings copied into the record, since the buffer behind them may be reused before the record
+ * is printed. A background thread drains every ring, formats the records and writes them to standard
+ * output, each one whole. A thread's records come out in the order it logged them.
+ *
+ * Levels go from LOG_ERROR to LOG_TRACE. A site above LOG_COMPILE_LEVEL (build with, for example,
+ * -DLOG_COMPILE_LEVEL=LOG_INFO) is removed by the compiler; a site above the runtime level (log_level,
+ * set with log_init()) costs one load and a branch. A full ring never blocks the thread that logs: the
+ * record is dropped and counted, and log_stop() reports how many were.
+ *
+ * Formats take the flags, width and precision of printf() with the conversions d i u o x X c e f g E G
+ * s p and %%, and integer, floating point, string or void pointer arguments, at most LOG_MAX_ARGS.
+ *
+ * Referencer:
+ * https://www.kernel.org/doc/html/latest/trace/ring-buffer-design.html
+ * https://gcc.gnu.org/onlinedocs/gcc/_005f_005fatomic-Builtins.html
+ * https://en.cppreference.com/w/c/language/generic
+ *
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+
+enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_TRACE };
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_TRACE /* sites above this level are compiled out */
+#endif
+
+#define LOG_DEFAULT_LEVEL LOG_INFO
+#define LOG_MAX_ARGS 8
+#define LOG_TEXT 96 /* bytes of string arguments a record holds */
+#define LOG_RING 4096 /* records per thread, a power of two */
+#define LOG_MAX_RINGS 1024 /* threads that log, the rest drop their records */
+#define LOG_IDLE_NS 1000000 /* the drainer sleeps this long when every ring is empty */
+
+typedef struct log_record {
+	const char *fmt;
+	uint8_t nargs;
+	uint8_t text_len;
+	uint64_t args[LOG_MAX_ARGS]; // integers, double bits, or offsets into text for strings
+	char text[LOG_TEXT];
+} log_record;
+
+// single producer (the thread it belongs to), single consumer (the drainer)
+typedef struct log_ring {
+	uint64_t head; // next record the thread writes
+	char pad[64 - sizeof(uint64_t)]; // head and tail on cache lines of their own
+	uint64_t tail; // next record the drainer reads
+	uint64_t dropped;
+	log_record records[LOG_RING];
+} log_ring;
+
+typedef struct logger {
+	log_ring *rings[LOG_MAX_RINGS];
+	int nrings;
+	pthread_mutex_t lock; // registration of the rings, never taken on the hot path
+	pthread_t thread;
+	int running, stop;
+	uint64_t lost; // records of threads beyond LOG_MAX_RINGS
+} logger;
+
+static int log_level = LOG_DEFAULT_LEVEL;
+static logger log_reg = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static __thread log_ring *log_local;
+
+static const char *const log_level_names[] = { "error", "warn", "info", "debug", "trace" };
+
+
+
+// the level with that name, -1 for none
+
+static inline int log_parse_level(const char *name) {
+
+	int i;
+
+	for (i = LOG_ERROR; i <= LOG_TRACE; i++) {
+		if (strcmp(name, log_level_names[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+
+}
+
+
+
+// the ring of the calling thread, registered on first use (NULL when there is no room for it)
+
+static inline log_ring *log_thread(void) {
+
+	log_ring *r = NULL;
+
+	if (log_local != NULL) {
+		return log_local;
+	}
+
+	pthread_mutex_lock(&log_reg.lock);
+	if (log_reg.nrings < LOG_MAX_RINGS && (r = calloc(1, sizeof *r)) != NULL) {
+		log_reg.rings[log_reg.nrings] = r;
+		__atomic_store_n(&log_reg.nrings, log_reg.nrings + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&log_reg.lock);
+
+	log_local = r;
+
+	return r;
+
+}
+
+
+
+// claim the next record of the calling thread's ring, NULL when it is full
+
+static inline log_record *log_begin(const char *fmt) {
+
+	log_ring *r = log_thread();
+	log_record *rec;
+
+	if (r == NULL) {
+		__atomic_fetch_add(&log_reg.lost, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING) {
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	rec = &r->records[r->head & (LOG_RING - 1)];
+	rec->fmt = fmt;
+	rec->nargs = 0;
+	rec->text_len = 0;
+
+	return rec;
+
+}
+
+
+
+// hand the record to the drainer
+
+static inline void log_commit(log_record *rec) {
+
+	(void)rec;
+
+	__atomic_store_n(&log_local->head, log_local->head + 1, __ATOMIC_RELEASE);
+
+}
+
+
+
+static inline void log_put_int(log_record *rec, long long v) {
+
+	if (rec->nargs < LOG_MAX_ARGS) {
+		rec->args[rec->nargs++] = (uint64_t)v;
+	}
+
+}
+
+
+
+static inline void log_put_double(log_record *rec, double v) {
+
+	if (rec->nargs < LOG_MAX_ARGS) {
+		memcpy(&rec->args[rec->nargs++], &v, sizeof v);
+	}
+
+}
+
+
+
+static inline void log_put_ptr(log_record *rec, const void *v) {
+
+	log_put_int(rec, (long long)(uintptr_t)v);
+
+}
+
+
+
+// a string is copied (cut short when the record is full), the argument is its offset in the text
+
+static inline void log_put_str(log_record *rec, const char *v) {
+
+	size_t room = LOG_TEXT - rec->text_len - 1, len;
+
+	if (rec->nargs >= LOG_MAX_ARGS) {
+		return;
+	}
+
+	if (v == NULL) {
+		v = "(null)";
+	}
+
+	len = strnlen(v, room);
+	memcpy(rec->text + rec->text_len, v, len);
+	rec->text[rec->text_len + len] = '\0';
+	rec->args[rec->nargs++] = rec->text_len;
+	rec->text_len += len + (rec->text_len + len + 1 < LOG_TEXT);
+
+}
+
+
+
+// pick how an argument is stored from its type
+#define LOG_PUT(rec, x) _Generic((x), \
+	char *: log_put_str, const char *: log_put_str, \
+	float: log_put_double, double: log_put_double, \
+	void *: log_put_ptr, const void *: log_put_ptr, \
+	default: log_put_int)(rec, x);
+
+#define LOG_PUT_0(rec)
+#define LOG_PUT_1(rec, a) LOG_PUT(rec, a)
+#define LOG_PUT_2(rec, a, ...) LOG_PUT(rec, a) LOG_PUT_1(rec, __VA_ARGS__)
+#define LOG_PUT_3(rec, a, ...) LOG_PUT(rec, a) LOG_PUT_2(rec, __VA_ARGS__)
+#define LOG_PUT_4(rec, a, ...) LOG_PUT(rec, a) LOG_PUT_3(rec, __VA_ARGS__)
+#define LOG_PUT_5(rec, a, ...) LOG_PUT(rec, a) LOG_PUT_4(rec, __VA_ARGS__)
+#define LOG_PUT_6(rec, a, ...) LOG_PUT(rec, a) LOG_PUT_5(rec, __VA_ARGS__)
+#define LOG_PUT_7(rec, a, ...) LOG_PUT(rec, a) LOG_PUT_6(rec, __VA_ARGS__)
+#define LOG_PUT_8(rec, a, ...) LOG_PUT(rec, a) LOG_PUT_7(rec, __VA_ARGS__)
+
+#define LOG_NARGS(...) LOG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_CAT_(a, b) a##b
+
+// log a printf()-style message at level (the printf() that never runs only checks the format)
+#define log_msg(level, fmt, ...) do { \
+	if ((level) <= LOG_COMPILE_LEVEL && (level) <= log_level) { \
+		log_record *log_rec_ = log_begin(fmt); \
+		if (log_rec_ != NULL) { \
+			LOG_CAT(LOG_PUT_, LOG_NARGS(__VA_ARGS__))(log_rec_, ##__VA_ARGS__) \
+			log_rec_->nargs = LOG_NARGS(__VA_ARGS__); \
+			log_commit(log_rec_); \
+		} \
+		if (0) { \
+			printf(fmt, ##__VA_ARGS__); \
+		} \
+	} \
+} while (0)
+
+
+
+// format one record the way printf() would have, as one piece of the output
+
+static inline void log_write(FILE *f, const log_record *rec) {
+
+	const char *p = rec->fmt, *start;
+	char spec[32];
+	size_t n;
+	int arg = 0;
+	uint64_t v;
+	double d;
+
+	flockfile(f);
+
+	while (*p != '\0') {
+
+		// the text up to the next conversion
+		start = p;
+		while (*p != '\0' && *p != '%') {
+			p++;
+		}
+		fwrite(start, 1, p - start, f);
+		if (*p == '\0') {
+			break;
+		}
+
+		if (p[1] == '%') {
+			putc('%', f);
+			p += 2;
+			continue;
+		}
+
+		// flags, width and precision as given, the length of every integer is the 64 bits stored
+		n = 0;
+		spec[n++] = *p++;
+		while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL && n < sizeof spec - 4) {
+			spec[n++] = *p++;
+		}
+		while (*p != '\0' && strchr("hlLqjzt", *p) != NULL) {
+			p++;
+		}
+		if (*p == '\0') {
+			break;
+		}
+
+		v = arg < rec->nargs ? rec->args[arg] : 0;
+		arg++;
+
+		switch (*p) {
+		case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+			spec[n++] = 'l';
+			spec[n++] = 'l';
+			spec[n++] = *p;
+			spec[n] = '\0';
+			fprintf(f, spec, (long long)v);
+			break;
+		case 'c':
+			spec[n++] = 'c';
+			spec[n] = '\0';
+			fprintf(f, spec, (int)v);
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+			memcpy(&d, &v, sizeof d);
+			spec[n++] = *p;
+			spec[n] = '\0';
+			fprintf(f, spec, d);
+			break;
+		case 's':
+			spec[n++] = 's';
+			spec[n] = '\0';
+			fprintf(f, spec, v < LOG_TEXT ? rec->text + v : "");
+			break;
+		case 'p':
+			spec[n++] = 'p';
+			spec[n] = '\0';
+			fprintf(f, spec, (void *)(uintptr_t)v);
+			break;
+		default:
+			break;
+		}
+		p++;
+	}
+
+	funlockfile(f);
+
+}
+
+
+
+// print everything the threads have logged so far, returns the number of records
+
+static inline int log_drain(void) {
+
+	int i, n = __atomic_load_n(&log_reg.nrings, __ATOMIC_ACQUIRE), count = 0;
+	uint64_t head;
+	log_ring *r;
+
+	for (i = 0; i < n; i++) {
+		r = log_reg.rings[i];
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		while (r->tail != head) {
+			log_write(stdout, &r->records[r->tail & (LOG_RING - 1)]);
+			__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+			count++;
+		}
+	}
+
+	if (count > 0) {
+		fflush(stdout);
+	}
+
+	return count;
+
+}
+
+
+
+static inline void *log_main(void *arg) {
+
+	struct timespec idle = { 0, LOG_IDLE_NS };
+
+	(void)arg;
+
+	while (!__atomic_load_n(&log_reg.stop, __ATOMIC_ACQUIRE)) {
+		if (log_drain() == 0) {
+			nanosleep(&idle, NULL);
+		}
+	}
+
+	return NULL;
+
+}
+
+
+
+// wait until the drainer has printed every record logged before the call, so that the
+// calling thread can go on with plain printf()
+
+static inline void log_flush(void) {
+
+	struct timespec idle = { 0, LOG_IDLE_NS / 4 };
+	int i, n, busy;
+
+	if (!log_reg.running) {
+		return;
+	}
+
+	do {
+		busy = 0;
+		n = __atomic_load_n(&log_reg.nrings, __ATOMIC_ACQUIRE);
+		for (i = 0; i < n; i++) {
+			busy |= __atomic_load_n(&log_reg.rings[i]->tail, __ATOMIC_ACQUIRE) !=
+				__atomic_load_n(&log_reg.rings[i]->head, __ATOMIC_ACQUIRE);
+		}
+		if (busy) {
+			nanosleep(&idle, NULL);
+		}
+	} while (busy);
+
+}
+
+
+
+// stop the drainer, print what is left and how many records were dropped (also runs at exit)
+
+static inline void log_stop(void) {
+
+	uint64_t dropped;
+	int i;
+
+	if (!log_reg.running) {
+		return;
+	}
+
+	__atomic_store_n(&log_reg.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(log_reg.thread, NULL);
+	log_reg.running = 0;
+
+	log_drain();
+
+	dropped = __atomic_load_n(&log_reg.lost, __ATOMIC_RELAXED);
+	for (i = 0; i < log_reg.nrings; i++) {
+		dropped += __atomic_load_n(&log_reg.rings[i]->dropped, __ATOMIC_RELAXED);
+	}
+	if (dropped > 0) {
+		printf("%llu log records dropped (the log fell behind)\n", (unsigned long long)dropped);
+	}
+
+	fflush(stdout);
+
+}
+
+
+
+// set the runtime level and start the drainer
+
+static inline void log_init(int level) {
+
+	log_level = level;
+
+	if (log_reg.running) {
+		return;
+	}
+
+	if (pthread_create(&log_reg.thread, NULL, log_main, NULL) != 0) {
+		printf("ERROR: failed starting the log thread\n");
+		exit(1);
+	}
+	log_reg.running = 1;
+
+	atexit(log_stop);
+
+}
+
+
+#endif
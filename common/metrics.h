@@ -0,0 +1,597 @@
+/*
+ * File name: metrics.h
+ * Description: Counters and latency histograms for the TCP and UDP programs, and their export. Each
+ * program lists its counters and histograms in tables of metric_def (name and help text) and bumps
+ * them by index with metric_add() and metric_observe(); the names follow the Prometheus conventions
+ * (counters end in _total, histograms measure seconds).
+ *
+ * Every thread counts into a shard of its own, registered the first time it counts, so the hot path
+ * is an add to a cache line no other thread writes: no lock and no atomic read-modify-write. The
+ * values are stored with relaxed atomics, so the exporter can read them at any time and sums the
+ * shards. Histograms have power-of-two buckets of microseconds (1 us up to about 36 minutes).
+ *
+ * metrics_start() starts an exporter thread that can do two things:
+ *
+ *   a JSON line log    every METRICS_INTERVAL seconds, and once more at metrics_stop(), one line with
+ *                      every counter, the goodput since the last line and the count, sum and rough
+ *                      percentiles of every histogram, to a file ("-" for standard output)
+ *   a text endpoint    the Prometheus text format for every counter and histogram, answered to any
+ *                      HTTP request on 127.0.0.1:<port>, or on a Unix socket when the address
+ *                      contains a '/' (curl --unix-socket <path> http://localhost/metrics)
+ *
+ * Referencer:
+ * https://prometheus.io/docs/instrumenting/exposition_formats/
+ * https://prometheus.io/docs/practices/naming/
+ * https://jsonlines.org/
+ * https://gcc.gnu.org/onlinedocs/gcc/_005f_005fatomic-Builtins.html
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+#define METRICS_MAX_SHARDS 1024 /* threads with a shard of their own, the rest share the last one */
+#define METRICS_BUCKETS 32 /* bucket b holds values up to 2^b microseconds, one more for the rest */
+#define METRICS_INTERVAL 1.0 /* seconds between two lines of the JSON log */
+#define METRICS_REQUEST_MAX 4096 /* bytes of an HTTP request read before answering */
+#define METRICS_LINE 64 /* shards start on a cache line of their own */
+
+typedef struct metric_def {
+	const char *name;
+	const char *help;
+} metric_def;
+
+typedef struct metrics_hist {
+	uint64_t buckets[METRICS_BUCKETS + 1];
+	uint64_t count;
+	uint64_t sum_ns;
+} metrics_hist;
+
+// the counters and histograms of one thread
+typedef struct metrics_shard {
+	uint64_t *counters;
+	metrics_hist *hists;
+	int shared; // more threads than shards count here, with atomic adds
+} metrics_shard;
+
+typedef struct metrics {
+	const char *program; // prefix of the exported names
+	const metric_def *counter_defs, *hist_defs;
+	int ncounters, nhists;
+	int goodput; // counter of the bytes delivered, -1 for none
+
+	metrics_shard *shards[METRICS_MAX_SHARDS];
+	int nshards;
+	pthread_mutex_t lock; // registration of the shards, never taken on the hot path
+
+	// exporter
+	double started;
+	FILE *log;
+	int listen_sock;
+	char unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	int wake[2]; // metrics_stop() wakes the exporter through this pipe
+	pthread_t thread;
+	int running;
+	uint64_t last_goodput;
+	double last_time;
+} metrics;
+
+static metrics metrics_reg = { .lock = PTHREAD_MUTEX_INITIALIZER, .listen_sock = -1, .goodput = -1 };
+static __thread metrics_shard *metrics_local;
+
+
+
+static inline double metrics_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+
+
+// name the program and its counters and histograms; goodput is the counter of delivered bytes (or -1)
+
+static inline void metrics_init(const char *program, const metric_def *counters, int ncounters,
+	const metric_def *hists, int nhists, int goodput) {
+
+	metrics_reg.program = program;
+	metrics_reg.counter_defs = counters;
+	metrics_reg.ncounters = ncounters;
+	metrics_reg.hist_defs = hists;
+	metrics_reg.nhists = nhists;
+	metrics_reg.goodput = goodput;
+	metrics_reg.started = metrics_now();
+
+}
+
+
+
+// zeroed memory that starts on a cache line, so no two shards share one
+
+static inline void *metrics_alloc(size_t size) {
+
+	void *p;
+
+	size = (size + METRICS_LINE - 1) & ~(size_t)(METRICS_LINE - 1);
+	if (posix_memalign(&p, METRICS_LINE, size) != 0) {
+		return NULL;
+	}
+	memset(p, 0, size);
+
+	return p;
+
+}
+
+
+
+// the shard of the calling thread, registered on first use
+
+static inline metrics_shard *metrics_thread(void) {
+
+	metrics_shard *s;
+	int n;
+
+	if (metrics_local != NULL) {
+		return metrics_local;
+	}
+
+	pthread_mutex_lock(&metrics_reg.lock);
+
+	n = metrics_reg.nshards;
+	if (n == METRICS_MAX_SHARDS) {
+		s = metrics_reg.shards[n - 1];
+		s->shared = 1;
+	}
+	else {
+		s = metrics_alloc(sizeof *s);
+		if (s != NULL) {
+			s->counters = metrics_alloc((metrics_reg.ncounters + 1) * sizeof *s->counters);
+			s->hists = metrics_alloc((metrics_reg.nhists + 1) * sizeof *s->hists);
+		}
+		if (s == NULL || s->counters == NULL || s->hists == NULL) {
+			printf("ERROR: out of memory\n");
+			exit(1);
+		}
+		metrics_reg.shards[n] = s;
+		__atomic_store_n(&metrics_reg.nshards, n + 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&metrics_reg.lock);
+
+	metrics_local = s;
+
+	return s;
+
+}
+
+
+
+// add to a 64-bit value only this thread writes (a shared shard adds atomically)
+
+static inline void metrics_bump(const metrics_shard *s, uint64_t *v, uint64_t n) {
+
+	if (s->shared) {
+		__atomic_fetch_add(v, n, __ATOMIC_RELAXED);
+	}
+	else {
+		__atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+	}
+
+}
+
+
+
+static inline void metric_add(int counter, uint64_t n) {
+
+	metrics_shard *s = metrics_thread();
+
+	metrics_bump(s, &s->counters[counter], n);
+
+}
+
+
+
+// count a duration in a histogram
+
+static inline void metric_observe(int hist, double seconds) {
+
+	metrics_shard *s = metrics_thread();
+	metrics_hist *h = &s->hists[hist];
+	uint64_t us = seconds > 0 ? (uint64_t)(seconds * 1e6) : 0;
+	int b = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+
+	metrics_bump(s, &h->buckets[b < METRICS_BUCKETS ? b : METRICS_BUCKETS], 1);
+	metrics_bump(s, &h->count, 1);
+	metrics_bump(s, &h->sum_ns, seconds > 0 ? (uint64_t)(seconds * 1e9) : 0);
+
+}
+
+
+
+// the value of a counter in one shard (for the programs' own summaries)
+
+static inline uint64_t metrics_shard_value(const metrics_shard *s, int counter) {
+
+	return __atomic_load_n(&s->counters[counter], __ATOMIC_RELAXED);
+
+}
+
+
+
+// the sum of a counter over every thread
+
+static inline uint64_t metrics_value(int counter) {
+
+	int i, n = __atomic_load_n(&metrics_reg.nshards, __ATOMIC_ACQUIRE);
+	uint64_t sum = 0;
+
+	for (i = 0; i < n; i++) {
+		sum += metrics_shard_value(metrics_reg.shards[i], counter);
+	}
+
+	return sum;
+
+}
+
+
+
+// a histogram summed over every thread
+
+static inline void metrics_hist_sum(int hist, metrics_hist *out) {
+
+	int i, b, n = __atomic_load_n(&metrics_reg.nshards, __ATOMIC_ACQUIRE);
+	const metrics_hist *h;
+
+	memset(out, 0, sizeof *out);
+
+	for (i = 0; i < n; i++) {
+		h = &metrics_reg.shards[i]->hists[hist];
+		for (b = 0; b <= METRICS_BUCKETS; b++) {
+			out->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+		}
+		out->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+		out->sum_ns += __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+	}
+
+}
+
+
+
+// upper bound of bucket b in seconds
+
+static inline double metrics_bucket_le(int b) {
+
+	return (double)(1ULL << b) / 1e6;
+
+}
+
+
+
+// the upper bound of the bucket that holds quantile q, 0 for an empty histogram
+
+static inline double metrics_quantile(const metrics_hist *h, double q) {
+
+	uint64_t seen = 0, rank = (uint64_t)(q * h->count);
+	int b;
+
+	if (h->count == 0) {
+		return 0;
+	}
+
+	for (b = 0; b < METRICS_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen > rank) {
+			return metrics_bucket_le(b);
+		}
+	}
+
+	return metrics_bucket_le(METRICS_BUCKETS);
+
+}
+
+
+
+// one line of the JSON log
+
+static inline void metrics_write_json(FILE *f) {
+
+	metrics_hist h;
+	struct timespec wall;
+	double now = metrics_now(), goodput = 0;
+	uint64_t bytes;
+	int i;
+
+	clock_gettime(CLOCK_REALTIME, &wall);
+
+	fprintf(f, "{\"time\": %.3f, \"program\": \"%s\", \"uptime\": %.3f, \"counters\": {",
+		wall.tv_sec + wall.tv_nsec / 1e9, metrics_reg.program, now - metrics_reg.started);
+
+	for (i = 0; i < metrics_reg.ncounters; i++) {
+		fprintf(f, "%s\"%s\": %llu", i > 0 ? ", " : "", metrics_reg.counter_defs[i].name,
+			(unsigned long long)metrics_value(i));
+	}
+
+	// bytes per second delivered since the previous line
+	if (metrics_reg.goodput >= 0) {
+		bytes = metrics_value(metrics_reg.goodput);
+		if (now > metrics_reg.last_time) {
+			goodput = (bytes - metrics_reg.last_goodput) / (now - metrics_reg.last_time);
+		}
+		metrics_reg.last_goodput = bytes;
+	}
+	metrics_reg.last_time = now;
+
+	fprintf(f, "}, \"goodput_MBps\": %.3f, \"histograms\": {", goodput / 1e6);
+
+	for (i = 0; i < metrics_reg.nhists; i++) {
+		metrics_hist_sum(i, &h);
+		fprintf(f, "%s\"%s\": {\"count\": %llu, \"sum\": %.6f, \"p50\": %g, \"p90\": %g, \"p99\": %g}",
+			i > 0 ? ", " : "", metrics_reg.hist_defs[i].name, (unsigned long long)h.count, h.sum_ns / 1e9,
+			metrics_quantile(&h, 0.5), metrics_quantile(&h, 0.9), metrics_quantile(&h, 0.99));
+	}
+
+	fprintf(f, "}}\n");
+	fflush(f);
+
+}
+
+
+
+// every counter and histogram in the Prometheus text format
+
+static inline void metrics_write_text(FILE *f) {
+
+	const char *p = metrics_reg.program;
+	metrics_hist h;
+	uint64_t cumulative;
+	int i, b;
+
+	for (i = 0; i < metrics_reg.ncounters; i++) {
+		fprintf(f, "# HELP %s_%s %s\n", p, metrics_reg.counter_defs[i].name, metrics_reg.counter_defs[i].help);
+		fprintf(f, "# TYPE %s_%s counter\n", p, metrics_reg.counter_defs[i].name);
+		fprintf(f, "%s_%s %llu\n", p, metrics_reg.counter_defs[i].name, (unsigned long long)metrics_value(i));
+	}
+
+	for (i = 0; i < metrics_reg.nhists; i++) {
+		metrics_hist_sum(i, &h);
+		fprintf(f, "# HELP %s_%s %s\n", p, metrics_reg.hist_defs[i].name, metrics_reg.hist_defs[i].help);
+		fprintf(f, "# TYPE %s_%s histogram\n", p, metrics_reg.hist_defs[i].name);
+		for (b = 0, cumulative = 0; b < METRICS_BUCKETS; b++) {
+			cumulative += h.buckets[b];
+			fprintf(f, "%s_%s_bucket{le=\"%g\"} %llu\n", p, metrics_reg.hist_defs[i].name, metrics_bucket_le(b),
+				(unsigned long long)cumulative);
+		}
+		fprintf(f, "%s_%s_bucket{le=\"+Inf\"} %llu\n", p, metrics_reg.hist_defs[i].name, (unsigned long long)h.count);
+		fprintf(f, "%s_%s_sum %.9f\n", p, metrics_reg.hist_defs[i].name, h.sum_ns / 1e9);
+		fprintf(f, "%s_%s_count %llu\n", p, metrics_reg.hist_defs[i].name, (unsigned long long)h.count);
+	}
+
+}
+
+
+
+// answer one client of the endpoint, whatever it asked for
+
+static inline void metrics_serve(int sock) {
+
+	char request[METRICS_REQUEST_MAX], *body = NULL, header[128];
+	size_t len = 0;
+	struct timeval tv = { 0, 200000 };
+	FILE *f;
+	ssize_t n;
+	size_t off;
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+	if (recv(sock, request, sizeof request, 0) < 0) {
+		return;
+	}
+
+	f = open_memstream(&body, &len);
+	if (f == NULL) {
+		return;
+	}
+	metrics_write_text(f);
+	fclose(f);
+
+	n = snprintf(header, sizeof header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n\r\n", len);
+
+	if (send(sock, header, n, MSG_NOSIGNAL) == n) {
+		for (off = 0; off < len; off += n) {
+			n = send(sock, body + off, len - off, MSG_NOSIGNAL);
+			if (n <= 0) {
+				break;
+			}
+		}
+	}
+
+	free(body);
+
+}
+
+
+
+static inline void *metrics_main(void *arg) {
+
+	struct pollfd fds[2];
+	double next = metrics_now() + METRICS_INTERVAL, now;
+	int sock, timeout;
+
+	(void)arg;
+
+	fds[0].fd = metrics_reg.wake[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = metrics_reg.listen_sock;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+
+		now = metrics_now();
+		// a line that is overdue (after a slow scrape, or a stopped process) is written at once
+		timeout = metrics_reg.log != NULL ? (next > now ? (int)((next - now) * 1e3) + 1 : 0) : -1;
+
+		if (poll(fds, metrics_reg.listen_sock >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR) {
+			break;
+		}
+
+		if (fds[0].revents) {
+			break;
+		}
+
+		if (metrics_reg.listen_sock >= 0 && (fds[1].revents & POLLIN)) {
+			sock = accept(metrics_reg.listen_sock, NULL, NULL);
+			if (sock >= 0) {
+				metrics_serve(sock);
+				close(sock);
+			}
+		}
+
+		if (metrics_reg.log != NULL && metrics_now() >= next) {
+			metrics_write_json(metrics_reg.log);
+			next += METRICS_INTERVAL;
+			// more than an interval behind: take up the schedule from now rather than catch up line by line
+			now = metrics_now();
+			if (next <= now) {
+				next = now + METRICS_INTERVAL;
+			}
+		}
+	}
+
+	return NULL;
+
+}
+
+
+
+// the endpoint's listening socket on 127.0.0.1:port, or on a Unix socket for an address with a '/'
+
+static inline int metrics_listen(const char *addr) {
+
+	struct sockaddr_in in;
+	struct sockaddr_un un;
+	int sock, on = 1;
+
+	if (strchr(addr, '/') != NULL) {
+		if (strlen(addr) >= sizeof un.sun_path) {
+			return -1;
+		}
+		memset(&un, 0, sizeof un);
+		un.sun_family = AF_UNIX;
+		strcpy(un.sun_path, addr);
+		unlink(addr);
+
+		sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (sock < 0 || bind(sock, (struct sockaddr *)&un, sizeof un) < 0 || listen(sock, 16) < 0) {
+			return -1;
+		}
+		strcpy(metrics_reg.unix_path, addr);
+		return sock;
+	}
+
+	memset(&in, 0, sizeof in);
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	in.sin_port = htons(atoi(addr));
+
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0 || setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) < 0 ||
+		bind(sock, (struct sockaddr *)&in, sizeof in) < 0 || listen(sock, 16) < 0) {
+		return -1;
+	}
+
+	return sock;
+
+}
+
+
+
+// start the exporter with a JSON log at log_path and/or an endpoint at addr (either may be NULL)
+
+static inline void metrics_start(const char *log_path, const char *addr) {
+
+	if (log_path == NULL && addr == NULL) {
+		return;
+	}
+
+	if (log_path != NULL) {
+		metrics_reg.log = strcmp(log_path, "-") == 0 ? stdout : fopen(log_path, "a");
+		if (metrics_reg.log == NULL) {
+			printf("ERROR: failed opening the metrics log %s\n", log_path);
+			exit(1);
+		}
+	}
+
+	if (addr != NULL) {
+		metrics_reg.listen_sock = metrics_listen(addr);
+		if (metrics_reg.listen_sock < 0) {
+			printf("ERROR: failed listening for metrics on %s\n", addr);
+			exit(1);
+		}
+		printf("Metrics on %s%s\n", strchr(addr, '/') != NULL ? "" : "127.0.0.1:", addr);
+	}
+
+	metrics_reg.last_time = metrics_now();
+
+	if (pipe(metrics_reg.wake) < 0 || pthread_create(&metrics_reg.thread, NULL, metrics_main, NULL) != 0) {
+		printf("ERROR: failed starting the metrics exporter\n");
+		exit(1);
+	}
+	metrics_reg.running = 1;
+
+}
+
+
+
+// stop the exporter, with a last line of the totals in the log
+
+static inline void metrics_stop(void) {
+
+	if (!metrics_reg.running) {
+		return;
+	}
+
+	if (write(metrics_reg.wake[1], "", 1) == 1) {
+		pthread_join(metrics_reg.thread, NULL);
+	}
+	metrics_reg.running = 0;
+
+	if (metrics_reg.log != NULL) {
+		metrics_write_json(metrics_reg.log);
+		if (metrics_reg.log != stdout) {
+			fclose(metrics_reg.log);
+		}
+		metrics_reg.log = NULL;
+	}
+
+	if (metrics_reg.listen_sock >= 0) {
+		close(metrics_reg.listen_sock);
+		metrics_reg.listen_sock = -1;
+		if (metrics_reg.unix_path[0] != '\0') {
+			unlink(metrics_reg.unix_path);
+		}
+	}
+
+}
+
+
+#endif
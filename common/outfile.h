@@ -0,0 +1,419 @@
+/*
+ * File name: outfile.h
+ * Description: The files a server receives into. By default a file is created (or continued)
+ * under its own name and grows with the writes, as before. With -o the server uses the size the
+ * sender announced:
+ *
+ *   - the file is preallocated with fallocate() (KEEP_SIZE, so its size still follows the data),
+ *     in few extents, and a disk that is too small fails at once instead of half way through;
+ *   - a whole file is written to <name>.part and renamed to <name> only once complete, so a file
+ *     under its own name is always whole (an interrupted one stays under the temp name);
+ *   - every sync=SIZE bytes the writeback of the bytes just written is started with
+ *     sync_file_range(), and the window before it is waited for and dropped from the page cache,
+ *     so the dirty memory stays bounded and the cache is left to the other services;
+ *   - fsync makes each file durable with fdatasync() before the rename (and the rename with an
+ *     fsync() of the directory);
+ *   - direct[=SIZE] opens the files of at least SIZE bytes with O_DIRECT when the data comes from
+ *     the page-aligned buffers of a writer thread (writer.h); the few writes that are not aligned
+ *     (the tail of a file) go through the page cache.
+ *
+ * The spec is a comma-separated list, e.g. -o direct=1G,sync=32M,fsync; -o atomic takes the
+ * defaults (sync every OUTFILE_DEFAULT_SYNC bytes, no fsync, no O_DIRECT).
+ *
+ * Referencer:
+ * https://man7.org/linux/man-pages/man2/fallocate.2.html
+ * https://man7.org/linux/man-pages/man2/sync_file_range.2.html
+ * https://man7.org/linux/man-pages/man2/open.2.html
+ * https://man7.org/linux/man-pages/man2/rename.2.html
+ *
+ */
+
+#ifndef OUTFILE_H
+#define OUTFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+
+#define OUTFILE_ALIGN 4096 /* O_DIRECT offsets, lengths and buffers */
+#define OUTFILE_SUFFIX ".part"
+#define OUTFILE_DEFAULT_SYNC (64ULL << 20)
+
+typedef struct outfile_opts {
+	int on; // preallocate, write under the temp name, rename once complete
+	int direct; // O_DIRECT for files of at least direct_min bytes
+	unsigned long long direct_min;
+	unsigned long long sync_every; // bytes between writeback windows, 0 for none
+	int durable; // fdatasync() before the rename
+} outfile_opts;
+
+// what the data of a file continues
+enum outfile_kind {
+	OUTFILE_NEW, // a whole file from the start
+	OUTFILE_RESUME, // a whole file from where an interrupted one stopped
+	OUTFILE_RANGE // a piece of a file shared with other writers, written in place
+};
+
+typedef struct outfile {
+	int fd;
+	int direct; // O_DIRECT is set on fd
+	int temp; // the data is under path until outfile_finish() renames it
+	char *name; // the name the file ends up with
+	char *path; // where the data goes meanwhile
+	unsigned long long sync_every;
+	int durable;
+	unsigned long long pending; // bytes written since the last writeback window
+	off_t lo, hi; // the range they cover
+	off_t prev_lo, prev_hi; // the range whose writeback is under way
+} outfile;
+
+
+
+// a size with an optional K, M or G suffix
+
+static inline unsigned long long outfile_size(const char *arg) {
+
+	char *end;
+	double v = strtod(arg, &end);
+
+	switch (*end) {
+	case 'k': case 'K': v *= 1024; break;
+	case 'm': case 'M': v *= 1024 * 1024; break;
+	case 'g': case 'G': v *= 1024.0 * 1024 * 1024; break;
+	}
+
+	return v > 0 ? (unsigned long long)v : 0;
+
+}
+
+
+
+// read a spec such as "direct=1G,sync=32M,fsync"; returns 0, or -1 with a message for a setting it does not know
+
+static inline int outfile_parse(outfile_opts *o, const char *spec) {
+
+	char *copy, *item, *save, *value;
+
+	memset(o, 0, sizeof *o);
+	o->on = 1;
+	o->sync_every = OUTFILE_DEFAULT_SYNC;
+
+	copy = strdup(spec);
+	if (copy == NULL) {
+		return -1;
+	}
+
+	for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+
+		value = strchr(item, '=');
+		if (value != NULL) {
+			*value++ = '\0';
+		}
+
+		if (strcmp(item, "atomic") == 0 && value == NULL) {
+		}
+		else if (strcmp(item, "direct") == 0) {
+			o->direct = 1;
+			o->direct_min = value != NULL ? outfile_size(value) : 0;
+		}
+		else if (strcmp(item, "sync") == 0 && value != NULL) {
+			o->sync_every = outfile_size(value);
+		}
+		else if (strcmp(item, "fsync") == 0 && value == NULL) {
+			o->durable = 1;
+		}
+		else {
+			printf("ERROR: unknown output file setting %s\n", item);
+			free(copy);
+			return -1;
+		}
+	}
+
+	free(copy);
+
+	return 0;
+
+}
+
+
+
+// the temp name of a file while it is written
+
+static inline void outfile_temp_name(char *path, size_t size, const char *name) {
+
+	snprintf(path, size, "%s%s", name, OUTFILE_SUFFIX);
+
+}
+
+
+
+// open name to receive size bytes (the whole file, or all of it for a range); direct_ok when its writes
+// come from page-aligned buffers. Returns 0, or -1 with errno set (ENOSPC: the disk cannot take it)
+
+static inline int outfile_open(outfile *f, const char *name, unsigned long long size, enum outfile_kind kind,
+	int direct_ok, const outfile_opts *o) {
+
+	int flags = O_RDWR | O_CLOEXEC;
+	struct stat st;
+	int err;
+
+	memset(f, 0, sizeof *f);
+	f->name = strdup(name);
+	f->path = malloc(strlen(name) + sizeof OUTFILE_SUFFIX);
+	if (f->name == NULL || f->path == NULL) {
+		printf("ERROR: out of memory\n");
+		exit(1);
+	}
+
+	f->temp = o->on && kind != OUTFILE_RANGE;
+	if (f->temp) {
+		outfile_temp_name(f->path, strlen(name) + sizeof OUTFILE_SUFFIX, name);
+	}
+	else {
+		strcpy(f->path, name);
+	}
+
+	if (kind == OUTFILE_NEW) {
+		flags |= O_CREAT | O_TRUNC;
+	}
+	else if (kind == OUTFILE_RANGE) {
+		flags |= O_CREAT;
+	}
+
+	f->fd = -1;
+	if (o->on && o->direct && direct_ok && size >= o->direct_min) {
+		f->fd = open(f->path, flags | O_DIRECT, 0644);
+		f->direct = f->fd >= 0;
+	}
+	if (f->fd < 0) {
+		f->fd = open(f->path, flags, 0644); // also when the file system does not take O_DIRECT
+	}
+	if (f->fd < 0) {
+		goto failed;
+	}
+
+	// the first stripe of a range to arrive sizes the shared file
+	if (kind == OUTFILE_RANGE && fstat(f->fd, &st) == 0 && (unsigned long long)st.st_size != size &&
+		ftruncate(f->fd, size) < 0) {
+		goto failed;
+	}
+
+	// best effort but for a full disk, which fails now rather than half way through
+	if (o->on && size > 0 && fallocate(f->fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0 && errno == ENOSPC) {
+		goto failed;
+	}
+
+	f->sync_every = o->on ? o->sync_every : 0;
+	f->durable = o->on && o->durable;
+
+	return 0;
+
+failed:
+	err = errno;
+	if (f->fd >= 0) {
+		close(f->fd);
+	}
+	free(f->name);
+	free(f->path);
+	f->name = f->path = NULL;
+	errno = err;
+
+	return -1;
+
+}
+
+
+
+// len bytes at offset have been written: past sync_every of them, start their writeback, and wait for the
+// window before and drop it from the page cache
+
+static inline void outfile_wrote(outfile *f, off_t offset, size_t len) {
+
+	if (f->sync_every == 0 || len == 0) {
+		return;
+	}
+
+	if (f->pending == 0) {
+		f->lo = offset;
+		f->hi = offset + len;
+	}
+	else {
+		f->lo = offset < f->lo ? offset : f->lo;
+		f->hi = offset + (off_t)len > f->hi ? offset + (off_t)len : f->hi;
+	}
+
+	f->pending += len;
+	if (f->pending < f->sync_every) {
+		return;
+	}
+
+	if (f->prev_hi > f->prev_lo) {
+		sync_file_range(f->fd, f->prev_lo, f->prev_hi - f->prev_lo,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(f->fd, f->prev_lo, f->prev_hi - f->prev_lo, POSIX_FADV_DONTNEED);
+	}
+	sync_file_range(f->fd, f->lo, f->hi - f->lo, SYNC_FILE_RANGE_WRITE);
+
+	f->prev_lo = f->lo;
+	f->prev_hi = f->hi;
+	f->pending = 0;
+
+}
+
+
+
+// turn O_DIRECT on or off on the file; returns 0, or -1 with errno set
+
+static inline int outfile_set_direct(outfile *f, int on) {
+
+	int flags = fcntl(f->fd, F_GETFL);
+
+	if (flags < 0 || fcntl(f->fd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT) < 0) {
+		return -1;
+	}
+
+	return 0;
+
+}
+
+
+
+// write the whole of an iovec array at offset; -1 with errno set on failure
+// O_DIRECT takes only aligned writes, the others go through the page cache
+
+static inline int outfile_pwritev(outfile *f, struct iovec *iov, int n, off_t offset) {
+
+	int i, aligned = f->direct && offset % OUTFILE_ALIGN == 0, rc = 0, err;
+	off_t start = offset;
+	size_t total = 0;
+	ssize_t done;
+
+	for (i = 0; i < n; i++) {
+		total += iov[i].iov_len;
+		aligned = aligned && (uintptr_t)iov[i].iov_base % OUTFILE_ALIGN == 0 && iov[i].iov_len % OUTFILE_ALIGN == 0;
+	}
+
+	if (f->direct && !aligned && outfile_set_direct(f, 0) < 0) {
+		return -1;
+	}
+
+	while (n > 0) {
+		done = pwritev(f->fd, iov, n, offset);
+		if (done < 0 && errno == EINTR) {
+			continue;
+		}
+		if (done <= 0) {
+			if (done == 0) {
+				errno = EIO;
+			}
+			rc = -1;
+			break;
+		}
+		offset += done;
+		while (n > 0 && (size_t)done >= iov->iov_len) {
+			done -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+
+	// O_DIRECT goes back on whether the write worked or not, keeping the first error
+	if (f->direct && !aligned) {
+		err = errno;
+		if (outfile_set_direct(f, 1) < 0 && rc == 0) {
+			err = errno;
+			rc = -1;
+		}
+		errno = err;
+	}
+
+	if (rc == 0) {
+		outfile_wrote(f, start, total);
+	}
+
+	return rc;
+
+}
+
+
+
+// make a rename durable: fsync() the directory that holds name
+
+static inline int outfile_sync_dir(const char *name) {
+
+	const char *slash = strrchr(name, '/');
+	char *dir;
+	int fd, rc;
+
+	dir = slash == NULL ? strdup(".") : strndup(name, slash == name ? 1 : (size_t)(slash - name));
+	if (dir == NULL) {
+		return -1;
+	}
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(dir);
+	if (fd < 0) {
+		return -1;
+	}
+
+	rc = fsync(fd);
+	close(fd);
+
+	return rc;
+
+}
+
+
+
+// close the file; a complete one is flushed as asked and renamed to its name, an incomplete one stays
+// where it is (under the temp name). Returns 0, or -1 with errno set
+
+static inline int outfile_finish(outfile *f, int complete) {
+
+	int err = 0;
+
+	if (complete && f->durable && fdatasync(f->fd) < 0) {
+		err = errno;
+	}
+
+	// the last windows leave the page cache too
+	if (f->sync_every > 0 && !err) {
+		sync_file_range(f->fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(f->fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	if (close(f->fd) < 0 && !err) {
+		err = errno;
+	}
+	f->fd = -1;
+
+	if (complete && f->temp && !err) {
+		if (rename(f->path, f->name) < 0 || (f->durable && outfile_sync_dir(f->name) < 0)) {
+			err = errno;
+		}
+	}
+
+	free(f->name);
+	free(f->path);
+	f->name = f->path = NULL;
+
+	errno = err;
+
+	return err ? -1 : 0;
+
+}
+
+
+#endif
@@ -0,0 +1,241 @@
+/*
+ * File name: reader.h
+ * Description: The input file of a client, read through mmap() in windows of READER_WINDOW bytes
+ * instead of copied into buffers, so the send path hands the kernel pointers into the page cache.
+ * reader_at() returns a pointer to the bytes at an offset; window k covers [k * READER_WINDOW,
+ * (k + 1) * READER_WINDOW) plus slack bytes after it, so that a piece of up to slack bytes that starts
+ * in a window also ends in it. A new window is mapped with MADV_SEQUENTIAL and MADV_WILLNEED, so the
+ * kernel reads it ahead and drops what was sent; reader_release() unmaps the windows before an offset
+ * once the caller no longer points into them, so files larger than memory (or than the address
+ * space of a 32-bit build) need only the windows in use. At most READER_MAPS windows are in use at
+ * a time, window k in maps[k % READER_MAPS].
+ *
+ * A file mmap() does not take (a pipe, a terminal) is read with read() into buffers of the same
+ * layout instead; then the offsets must only grow.
+ *
+ * A file truncated by another program while it is mapped has no pages left behind its new end, and
+ * touching them raises SIGBUS instead of returning an error (a send() from them fails with EFAULT);
+ * reader_open() installs a handler that reports the truncated input and exits, rather than leaving
+ * the program to die without a word.
+ *
+ * Referencer:
+ * https://man7.org/linux/man-pages/man2/mmap.2.html
+ * https://man7.org/linux/man-pages/man2/madvise.2.html
+ *
+ */
+
+#ifndef READER_H
+#define READER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+
+#define READER_WINDOW ((size_t)64 << 20) /* bytes per window, a multiple of the page size */
+#define READER_MAPS 8 /* windows in use at once */
+
+typedef struct reader_map {
+	off_t start; // offset of the window, -1 when the entry is free
+	char *base;
+	size_t len; // bytes of the file it holds
+} reader_map;
+
+typedef struct reader {
+	int fd;
+	off_t size; // of a mapped file
+	int mapped; // mmap(), or read() into buffers
+	size_t slack;
+	off_t read_end; // read(): the bytes of the file read so far
+	int eof;
+	reader_map maps[READER_MAPS];
+	unsigned long long windows; // windows mapped or read so far
+} reader;
+
+
+
+// a mapped page past the end of a file that shrank since it was mapped (write() and _exit() are
+// async-signal-safe)
+
+static void reader_sigbus(int sig) {
+
+	static const char msg[] = "ERROR: the input file was truncated while it was being sent\n";
+	ssize_t rc;
+
+	(void)sig;
+	rc = write(STDERR_FILENO, msg, sizeof msg - 1);
+	(void)rc;
+	_exit(1);
+
+}
+
+
+
+// read fd through the reader; pieces of up to slack bytes are asked for at once
+
+static inline void reader_open(reader *r, int fd, size_t slack) {
+
+	struct stat st;
+	struct sigaction sa;
+	int i;
+
+	memset(r, 0, sizeof *r);
+	r->fd = fd;
+	r->slack = slack;
+	r->mapped = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+	r->size = r->mapped ? st.st_size : 0;
+
+	if (r->mapped) {
+		memset(&sa, 0, sizeof sa);
+		sa.sa_handler = reader_sigbus;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGBUS, &sa, NULL);
+	}
+
+	for (i = 0; i < READER_MAPS; i++) {
+		r->maps[i].start = -1;
+	}
+
+}
+
+
+
+static inline void reader_unmap(reader *r, reader_map *m) {
+
+	if (m->start < 0) {
+		return;
+	}
+
+	if (r->mapped) {
+		munmap(m->base, m->len);
+	}
+	else {
+		free(m->base);
+	}
+	m->start = -1;
+
+}
+
+
+
+// bring in the window that starts at start, returns 0 or -1 with errno set
+
+static inline int reader_map_window(reader *r, reader_map *m, off_t start) {
+
+	reader_map *prev = &r->maps[(start / READER_WINDOW + READER_MAPS - 1) % READER_MAPS];
+	size_t want = READER_WINDOW + r->slack, keep;
+	ssize_t n;
+
+	reader_unmap(r, m);
+
+	if (r->mapped) {
+		m->len = start + (off_t)want < r->size ? want : (size_t)(r->size - start);
+		m->base = mmap(NULL, m->len, PROT_READ, MAP_SHARED, r->fd, start);
+		if (m->base == MAP_FAILED) {
+			return -1;
+		}
+		madvise(m->base, m->len, MADV_SEQUENTIAL);
+		madvise(m->base, m->len, MADV_WILLNEED);
+	}
+	else {
+		// the slack of the window before already holds the first bytes of this one
+		m->base = malloc(want);
+		if (m->base == NULL) {
+			return -1;
+		}
+		m->len = 0;
+		if (r->read_end > start) {
+			keep = r->read_end - start;
+			if (prev->start != start - (off_t)READER_WINDOW || prev->len < READER_WINDOW + keep) {
+				free(m->base);
+				errno = ESPIPE;
+				return -1;
+			}
+			memcpy(m->base, prev->base + READER_WINDOW, keep);
+			m->len = keep;
+		}
+		while (m->len < want && !r->eof) {
+			n = read(r->fd, m->base + m->len, want - m->len);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n < 0) {
+				free(m->base);
+				return -1;
+			}
+			r->eof = n == 0;
+			m->len += n;
+			r->read_end += n;
+		}
+	}
+
+	m->start = start;
+	r->windows++;
+
+	return 0;
+
+}
+
+
+
+// the bytes at offset, with len set to how many of up to want (at most slack) there are before the
+// end of the file (0 at the end); NULL with errno set when they cannot be read
+
+static inline const char *reader_at(reader *r, off_t offset, size_t want, size_t *len) {
+
+	off_t start = offset - offset % READER_WINDOW;
+	reader_map *m = &r->maps[(start / READER_WINDOW) % READER_MAPS];
+
+	if (r->mapped && offset >= r->size) {
+		*len = 0;
+		return "";
+	}
+
+	if (m->start != start && reader_map_window(r, m, start) < 0) {
+		return NULL;
+	}
+
+	*len = offset - start + want <= m->len ? want : offset - start < (off_t)m->len ? m->len - (offset - start) : 0;
+
+	return m->base + (offset - start);
+
+}
+
+
+
+// nothing before offset is pointed to any more: let go of the windows that end before it
+
+static inline void reader_release(reader *r, off_t offset) {
+
+	int i;
+
+	for (i = 0; i < READER_MAPS; i++) {
+		if (r->maps[i].start >= 0 && r->maps[i].start + (off_t)READER_WINDOW + (off_t)r->slack <= offset) {
+			reader_unmap(r, &r->maps[i]);
+		}
+	}
+
+}
+
+
+
+// unmap every window (the caller closes the file)
+
+static inline void reader_close(reader *r) {
+
+	int i;
+
+	for (i = 0; i < READER_MAPS; i++) {
+		reader_unmap(r, &r->maps[i]);
+	}
+
+}
+
+
+#endif
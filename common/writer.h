@@ -0,0 +1,428 @@
+/*
+ * File name: writer.h
+ * Description: A disk writer thread for a network thread, so that a slow disk holds up neither the
+ * socket nor the acknowledgements. The network thread puts the data of its files into a ring of
+ * WRITER_SLOTS buffers of WRITER_BUF bytes, page aligned and allocated when first used; the writer
+ * thread takes them in order and writes runs of slots that continue one another in the same file
+ * with one pwritev() call, then hands the slots back.
+ *
+ * There is one producer (the network thread) and one consumer (the writer) per ring, so the slots
+ * change hands with an acquire/release pair on the two counters and no lock; the mutex and the
+ * condition variables are only there to let an idle writer, or a producer facing a full ring, sleep.
+ * Data that continues the last slot of the same file goes into that slot until it is full or
+ * writer_flush() hands it over, so small packets turn into large writes. The memory is bounded by
+ * the ring: when every slot is taken the producer waits for the writer (backpressure), which it
+ * counts as a stall.
+ *
+ * A file (outfile.h) is registered with writer_open() and given back with writer_close(), which
+ * finishes it once the writes queued before have been done. A write that fails marks the file (error
+ * holds its errno), the writer reports it once and skips the rest of that file's writes; the owner
+ * checks the mark. The buffers of an O_DIRECT file are only handed over when full, and a slot that
+ * starts off the alignment ends on it, so that all but a few of its writes keep O_DIRECT.
+ *
+ * Referencer:
+ * https://man7.org/linux/man-pages/man2/pwritev.2.html
+ * https://www.kernel.org/doc/html/latest/core-api/circular-buffers.html
+ * https://gcc.gnu.org/onlinedocs/gcc/_005f_005fatomic-Builtins.html
+ *
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "outfile.h"
+
+
+#define WRITER_SLOTS 64 /* buffers in the ring, the most data a pipeline holds */
+#define WRITER_BUF (256 * 1024) /* bytes per buffer */
+#define WRITER_ALIGN 4096 /* buffers start on a page */
+#define WRITER_IOV 64 /* slots gathered into one pwritev() */
+
+enum writer_op_type {
+	WRITER_WRITE,
+	WRITER_CLOSE, // finish a complete file
+	WRITER_DROP // close an incomplete one
+};
+
+// a file of the pipeline, freed by whichever side drops the last reference
+typedef struct writer_file {
+	outfile file;
+	int refs; // the owner's until writer_close(), and one per queued slot
+	int error; // errno of the first failed write, 0 while all is well
+	char *name; // for the error message
+} writer_file;
+
+typedef struct writer_slot {
+	enum writer_op_type type;
+	writer_file *file;
+	off_t offset;
+	size_t len, cap; // bytes in the slot, and the most it takes
+	char *buf; // WRITER_BUF bytes, kept for the next use of the slot
+} writer_slot;
+
+typedef struct writer {
+	writer_slot slots[WRITER_SLOTS];
+
+	uint64_t head; // slots handed to the writer (producer)
+	int filling; // slot head is open for more data (producer)
+	char pad1[64];
+	uint64_t tail; // slots done (writer)
+	char pad2[64];
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work, space;
+	int idle, waiting, stop; // the writer sleeps, the producer waits for a slot, the writer should end
+
+	// statistics, read once the writer has stopped
+	unsigned long long writes, bytes, stalls;
+	double stall_seconds;
+} writer;
+
+
+
+static inline double writer_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+
+
+static inline void writer_put_file(writer_file *f) {
+
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(f->name);
+		free(f);
+	}
+
+}
+
+
+
+// the writer thread: take the slots in order, a run that continues in the same file at once
+
+static inline void *writer_main(void *arg) {
+
+	writer *w = arg;
+	struct iovec iov[WRITER_IOV];
+	writer_slot *s, *next;
+	uint64_t head, run;
+	off_t end;
+	int n;
+
+	for (;;) {
+
+		head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+
+		if (head == w->tail) {
+			pthread_mutex_lock(&w->lock);
+			__atomic_store_n(&w->idle, 1, __ATOMIC_SEQ_CST);
+			while ((head = __atomic_load_n(&w->head, __ATOMIC_SEQ_CST)) == w->tail && !w->stop) {
+				pthread_cond_wait(&w->work, &w->lock);
+			}
+			__atomic_store_n(&w->idle, 0, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&w->lock);
+			if (head == w->tail) {
+				return NULL;
+			}
+		}
+
+		s = &w->slots[w->tail % WRITER_SLOTS];
+		run = 1;
+
+		if (s->type != WRITER_WRITE) {
+			if (outfile_finish(&s->file->file, s->type == WRITER_CLOSE) < 0 && s->file->error == 0) {
+				__atomic_store_n(&s->file->error, errno, __ATOMIC_RELEASE);
+				printf("ERROR: failed finishing %s (%s)\n", s->file->name, strerror(s->file->error));
+			}
+		}
+		else if (s->len > 0 && s->file->error == 0) {
+
+			// gather the slots that follow on in the same file
+			iov[0].iov_base = s->buf;
+			iov[0].iov_len = s->len;
+			end = s->offset + s->len;
+			for (n = 1; n < WRITER_IOV && w->tail + run != head; n++, run++) {
+				next = &w->slots[(w->tail + run) % WRITER_SLOTS];
+				if (next->type != WRITER_WRITE || next->file != s->file || next->offset != end) {
+					break;
+				}
+				iov[n].iov_base = next->buf;
+				iov[n].iov_len = next->len;
+				end += next->len;
+			}
+
+			if (outfile_pwritev(&s->file->file, iov, n, s->offset) < 0) {
+				__atomic_store_n(&s->file->error, errno ? errno : EIO, __ATOMIC_RELEASE);
+				printf("ERROR: failed writing %s (%s)\n", s->file->name, strerror(s->file->error));
+			}
+			else {
+				w->writes++;
+				while (n-- > 0) {
+					w->bytes += iov[n].iov_len;
+				}
+			}
+		}
+
+		while (run-- > 0) {
+			writer_put_file(w->slots[w->tail % WRITER_SLOTS].file);
+			__atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_SEQ_CST);
+		}
+
+		if (__atomic_load_n(&w->waiting, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&w->lock);
+			pthread_cond_signal(&w->space);
+			pthread_mutex_unlock(&w->lock);
+		}
+	}
+
+}
+
+
+
+static inline void writer_start(writer *w) {
+
+	memset(w, 0, sizeof *w);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work, NULL);
+	pthread_cond_init(&w->space, NULL);
+
+	if (pthread_create(&w->thread, NULL, writer_main, w) != 0) {
+		printf("ERROR: failed starting the writer thread\n");
+		exit(1);
+	}
+
+}
+
+
+
+// hand the open slot to the writer
+
+static inline void writer_publish(writer *w) {
+
+	if (!w->filling) {
+		return;
+	}
+
+	w->filling = 0;
+	__atomic_store_n(&w->head, w->head + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&w->idle, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_signal(&w->work);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+}
+
+
+
+// open the next slot for file f, waiting while the writer holds every slot
+
+static inline writer_slot *writer_claim(writer *w, enum writer_op_type type, writer_file *f, off_t offset) {
+
+	writer_slot *s;
+	double started;
+
+	writer_publish(w);
+
+	if (w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) == WRITER_SLOTS) {
+		started = writer_now();
+		w->stalls++;
+		pthread_mutex_lock(&w->lock);
+		__atomic_store_n(&w->waiting, 1, __ATOMIC_SEQ_CST);
+		while (w->head - __atomic_load_n(&w->tail, __ATOMIC_SEQ_CST) == WRITER_SLOTS) {
+			pthread_cond_wait(&w->space, &w->lock);
+		}
+		__atomic_store_n(&w->waiting, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&w->lock);
+		w->stall_seconds += writer_now() - started;
+	}
+
+	s = &w->slots[w->head % WRITER_SLOTS];
+	if (type == WRITER_WRITE && s->buf == NULL && posix_memalign((void **)&s->buf, WRITER_ALIGN, WRITER_BUF) != 0) {
+		printf("ERROR: out of memory\n");
+		exit(1);
+	}
+
+	s->type = type;
+	s->file = f;
+	s->offset = offset;
+	s->len = 0;
+	s->cap = WRITER_BUF - (f->file.direct ? offset % OUTFILE_ALIGN : 0);
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+	w->filling = 1;
+
+	return s;
+
+}
+
+
+
+// hand an open file to the pipeline, which finishes it at writer_close()
+
+static inline writer_file *writer_open(const outfile *file) {
+
+	writer_file *f = calloc(1, sizeof *f);
+
+	if (f == NULL || (f->name = strdup(file->name)) == NULL) {
+		printf("ERROR: out of memory\n");
+		exit(1);
+	}
+	f->file = *file;
+	f->refs = 1;
+
+	return f;
+
+}
+
+
+
+// room for the bytes of f at offset: continues the open slot when they follow on, or opens a new one
+// returns where they go, with room set to how many fit (commit what was put there)
+
+static inline char *writer_space(writer *w, writer_file *f, off_t offset, size_t *room) {
+
+	writer_slot *s = &w->slots[w->head % WRITER_SLOTS];
+
+	if (!w->filling || s->type != WRITER_WRITE || s->file != f || s->offset + (off_t)s->len != offset || s->len == s->cap) {
+		s = writer_claim(w, WRITER_WRITE, f, offset);
+	}
+
+	*room = s->cap - s->len;
+
+	return s->buf + s->len;
+
+}
+
+
+
+// n bytes were put where writer_space() said, a full slot goes to the writer at once
+
+static inline void writer_commit(writer *w, size_t n) {
+
+	writer_slot *s = &w->slots[w->head % WRITER_SLOTS];
+
+	s->len += n;
+	if (s->len == s->cap) {
+		writer_publish(w);
+	}
+
+}
+
+
+
+// queue len bytes of f at offset
+
+static inline void writer_append(writer *w, writer_file *f, off_t offset, const void *data, size_t len) {
+
+	size_t room, n;
+	char *dst;
+
+	while (len > 0) {
+		dst = writer_space(w, f, offset, &room);
+		n = len < room ? len : room;
+		memcpy(dst, data, n);
+		writer_commit(w, n);
+		data = (const char *)data + n;
+		offset += n;
+		len -= n;
+	}
+
+}
+
+
+
+// hand over the slot being filled, so that its data does not wait for more (but for O_DIRECT)
+
+static inline void writer_flush(writer *w) {
+
+	writer_slot *s = &w->slots[w->head % WRITER_SLOTS];
+
+	if (w->filling && s->len > 0 && !s->file->file.direct) {
+		writer_publish(w);
+	}
+
+}
+
+
+
+// finish f after its queued writes (outfile_finish(), complete or not); the caller gives up its
+// reference and must not use f again
+
+static inline void writer_close(writer *w, writer_file *f, int complete) {
+
+	writer_claim(w, complete ? WRITER_CLOSE : WRITER_DROP, f, 0);
+	writer_publish(w);
+	writer_put_file(f);
+
+}
+
+
+
+// whether a write of f has failed (its errno, 0 when none has)
+
+static inline int writer_failed(const writer_file *f) {
+
+	return __atomic_load_n(&f->error, __ATOMIC_ACQUIRE);
+
+}
+
+
+
+// wait until the writer has done everything queued so far
+
+static inline void writer_sync(writer *w) {
+
+	struct timespec pause = { 0, 100000 };
+
+	writer_publish(w); // the open slot too, whatever it holds
+
+	while (__atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) != w->head) {
+		nanosleep(&pause, NULL);
+	}
+
+}
+
+
+
+// finish the queued writes and end the writer thread
+
+static inline void writer_stop(writer *w) {
+
+	int i;
+
+	writer_sync(w);
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_signal(&w->work);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	for (i = 0; i < WRITER_SLOTS; i++) {
+		free(w->slots[i].buf);
+		w->slots[i].buf = NULL;
+	}
+
+}
+
+
+#endif